@@ -557,8 +557,8 @@ class FireSimSwitchNode(FireSimNode):
         self.switch_builder = AbstractSwitchToSwitchConfig(self)
 
     def build_switch_sim_binary(self):
-        """ This actually emits a config and builds the switch binary that
-        can be used to do the simulation. """
+        """ This actually emits a config and builds (once, for all switches)
+        the switch binary that can be used to do the simulation. """
         self.switch_builder.buildswitch()
 
     def get_required_files_local_paths(self):
@@ -566,6 +566,7 @@ class FireSimSwitchNode(FireSimNode):
         array. """
         all_paths = []
         all_paths.append(self.switch_builder.switch_binary_local_path())
+        all_paths.append(self.switch_builder.switch_config_local_path())
         return all_paths
 
     def get_switch_start_command(self):
@@ -8,16 +8,21 @@ import logging
 
 from fabric.api import local
 from util.streamlogger import StreamLogger
+from runtools.utils import MacAddress
 
 rootLogger = logging.getLogger()
 
 class AbstractSwitchToSwitchConfig:
     """ This class is responsible for providing functions that take a FireSimSwitchNode
-    and emit the correct config header to produce an actual switch simulator binary
-    that behaves as defined in the FireSimSwitchNode.
+    and emit the correct config file for the switch simulator binary, so that
+    it behaves as defined in the FireSimSwitchNode. All switches share one
+    binary, which is built once per run of the manager.
 
     This assumes that the switch has already been assigned to a host."""
 
+    # build dir of the shared switch binary, once it has been built
+    shared_build_dir = None
+
     def __init__(self, fsimswitchnode):
         """ Construct the switch's config file """
         self.fsimswitchnode = fsimswitchnode
@@ -26,7 +31,7 @@ class AbstractSwitchToSwitchConfig:
         self.build_disambiguate = ''.join(random.choice(string.ascii_uppercase + string.digits) for _ in range(64))
 
     def emit_init_for_uplink(self, uplinkno):
-        """ Emit an init for a switch to talk to it's uplink."""
+        """ Emit the port line for a switch to talk to it's uplink."""
 
         linkobj = self.fsimswitchnode.uplinks[uplinkno]
         upperswitch = linkobj.get_uplink_side()
@@ -36,100 +41,104 @@ class AbstractSwitchToSwitchConfig:
             uplinkhostip = linkobj.link_hostserver_ip() #upperswitch.host_instance.get_private_ip()
             uplinkhostport = linkobj.link_hostserver_port()
 
-            return "new SocketClientPort(" + str(target_local_portno) +  \
-                    ", \"" + uplinkhostip + "\", " + str(uplinkhostport) + ");\n"
+            return "port {} socketclient {} {}\n".format(target_local_portno,
+                                                         uplinkhostip, uplinkhostport)
 
         else:
             linkbasename = linkobj.get_global_link_id()
-            return "new ShmemPort(" + str(target_local_portno) + ', "' + linkbasename + '", true);\n'
+            return "port {} shmem {} uplink\n".format(target_local_portno, linkbasename)
 
     def emit_init_for_downlink(self, downlinkno):
-        """ emit an init for the specified downlink. """
+        """ emit the port line for the specified downlink. """
         downlinkobj = self.fsimswitchnode.downlinks[downlinkno]
         downlink = downlinkobj.get_downlink_side()
         if downlinkobj.link_crosses_hosts():
             hostport = downlinkobj.link_hostserver_port()
             # create a SocketServerPort
-            return "new SocketServerPort(" + str(downlinkno) + ", " + \
-                    str(hostport)  + ");\n"
+            return "port {} socketserver {}\n".format(downlinkno, hostport)
         else:
             linkbasename = downlinkobj.get_global_link_id()
-            return "new ShmemPort(" + str(downlinkno) + ', "' + linkbasename + '", false);\n'
+            return "port {} shmem {} downlink\n".format(downlinkno, linkbasename)
 
     def emit_switch_configfile(self):
-        """ Produce a config file for the switch generator for this switch """
+        """ Produce a config file for the switch simulator for this switch.
+        See target-design/switch/switchconfig.h for the format. """
         constructedstring = ""
         constructedstring += self.get_header()
+        constructedstring += self.get_params()
         constructedstring += self.get_numclientsconfig()
         constructedstring += self.get_portsetup()
         constructedstring += self.get_mac2port()
         return constructedstring
 
-    # produce mac2port array portion of config
+    # produce mac table portion of config
     def get_mac2port(self):
         """ This takes a python array that represents the mac to port mapping,
-        and converts it to a C++ array """
+        and emits a mac line for every MAC that doesn't go to the uplinks,
+        which is the default. """
 
         mac2port_pythonarray = self.fsimswitchnode.switch_table
-
-        commaseparated = ""
-        for elem in mac2port_pythonarray:
-            commaseparated += str(elem) + ", "
-
-        #remove extraneous ", "
-        commaseparated = commaseparated[:-2]
-        commaseparated = "{" + commaseparated + "};"
-
-        retstr = """
-    #ifdef MACPORTSCONFIG
-    uint16_t mac2port[{}]  {}
-    #endif
-    """.format(len(mac2port_pythonarray), commaseparated)
+        uplinkportno = len(self.fsimswitchnode.downlinks)
+
+        retstr = ""
+        for mac_no_prefix, port in enumerate(mac2port_pythonarray):
+            if port == uplinkportno:
+                continue
+            mac = format(MacAddress.eecs_mac_prefix + mac_no_prefix, '012X')
+            mac = ":".join(mac[i:i+2] for i in range(0, 12, 2))
+            retstr += "mac {} {}\n".format(mac, port)
         return retstr
 
     def get_header(self):
         """ Produce file header. """
-        retstr = """// THIS FILE IS MACHINE GENERATED. SEE deploy/buildtools/switchmodelconfig.py
-        """
+        retstr = """# THIS FILE IS MACHINE GENERATED. SEE deploy/runtools/switch_model_config.py
+"""
+        return retstr
+
+    def get_params(self):
+        """ Emit latencies and bandwidth, and ECMP over the uplinks, salted
+        with the switch id so that tiers don't all hash flows alike. """
+        retstr = """linklatency {}
+switchlatency {}
+bandwidth {}
+multipath ecmp
+hashseed {}
+""".format(self.fsimswitchnode.switch_link_latency,
+           self.fsimswitchnode.switch_switching_latency,
+           self.fsimswitchnode.switch_bandwidth,
+           self.fsimswitchnode.switch_id_internal)
         return retstr
 
     def get_numclientsconfig(self):
-        """ Emit constants for num ports. """
+        """ Emit num ports. """
         numdownlinks = len(self.fsimswitchnode.downlinks)
         numuplinks = len(self.fsimswitchnode.uplinks)
-        totalports = numdownlinks + numuplinks
-
-        retstr = """
-    #ifdef NUMCLIENTSCONFIG
-    #define NUMPORTS {}
-    #define NUMDOWNLINKS {}
-    #define NUMUPLINKS {}
-    #endif""".format(totalports, numdownlinks, numuplinks)
+
+        retstr = """downlinks {}
+uplinks {}
+""".format(numdownlinks, numuplinks)
         return retstr
 
     def get_portsetup(self):
         """ emit port intialisations. """
         initstring = ""
         for downlinkno in range(len(self.fsimswitchnode.downlinks)):
-            initstring += "ports[" + str(downlinkno) + "] = " + \
-                    self.emit_init_for_downlink(downlinkno)
+            initstring += self.emit_init_for_downlink(downlinkno)
 
         for uplinkno in range(len(self.fsimswitchnode.uplinks)):
-            initstring += "ports[" + str(len(self.fsimswitchnode.downlinks) + \
-                        uplinkno) + "] = " + self.emit_init_for_uplink(uplinkno)
-
-        retstr = """
-    #ifdef PORTSETUPCONFIG
-    {}
-    #endif
-    """.format(initstring)
-        return retstr
+            initstring += self.emit_init_for_uplink(uplinkno)
+
+        return initstring
 
     def switch_binary_name(self):
         return "switch" + str(self.fsimswitchnode.switch_id_internal)
 
+    def switch_config_name(self):
+        return self.switch_binary_name() + ".conf"
+
     def buildswitch(self):
-        """ Generate the config file, build the switch.
+        """ Build the shared switch binary if that hasn't happened yet, then
+        generate the config file for this switch.
 
         TODO: replace calls to subprocess.check_call here with fabric."""
 
@@ -137,11 +146,7 @@ class AbstractSwitchToSwitchConfig:
         binaryname = self.switch_binary_name()
 
         switchorigdir = self.switch_build_local_dir()
-        switchbuilddir = switchorigdir + binaryname + "-" + self.build_disambiguate + "-build/"
-
-        rootLogger.info("Building switch model binary for switch " + str(self.switch_binary_name()))
-
-        rootLogger.debug(str(configfile))
+        switchbuilddir = self.switch_local_dir()
 
         def local_logged(command):
             """ Run local command with logging. """
@@ -150,25 +155,33 @@ class AbstractSwitchToSwitchConfig:
                 rootLogger.debug(localcap)
                 rootLogger.debug(localcap.stderr)
 
-        # make a build dir for this switch
+        cls = AbstractSwitchToSwitchConfig
+        if cls.shared_build_dir is None:
+            shareddir = switchorigdir + "switch-" + self.build_disambiguate + "-build/"
+            rootLogger.info("Building switch model binary")
+            local_logged("mkdir -p " + shareddir)
+            local_logged("cp " + switchorigdir + "*.h " + shareddir)
+            local_logged("cp " + switchorigdir + "*.cc " + shareddir)
+            local_logged("cp " + switchorigdir + "Makefile " + shareddir)
+            local_logged("cd " + shareddir + " && make")
+            cls.shared_build_dir = shareddir
+
+        rootLogger.info("Generating switch model config for switch " + str(binaryname))
+        rootLogger.debug(str(configfile))
+
+        # each switch gets its own name for the binary, so it can be found by
+        # pkill. a hard link is enough for that.
         local_logged("mkdir -p " + switchbuilddir)
-        local_logged("cp " + switchorigdir + "*.h " + switchbuilddir)
-        local_logged("cp " + switchorigdir + "*.cc " + switchbuilddir)
-        local_logged("cp " + switchorigdir + "Makefile " + switchbuilddir)
+        local_logged("ln -f " + cls.shared_build_dir + "switch " + switchbuilddir + binaryname)
 
-        text_file = open(switchbuilddir + "switchconfig.h", "w")
+        text_file = open(switchbuilddir + self.switch_config_name(), "w")
         text_file.write(configfile)
         text_file.close()
-        local_logged("cd " + switchbuilddir + " && make")
-        local_logged("mv " + switchbuilddir + "switch " + switchbuilddir + binaryname)
 
     def run_switch_simulation_command(self):
         """ Return the command to boot the switch."""
-        switchlatency = self.fsimswitchnode.switch_switching_latency
-        linklatency = self.fsimswitchnode.switch_link_latency
-        bandwidth = self.fsimswitchnode.switch_bandwidth
         # insert gdb -ex run --args between sudo and ./ below to start switches in gdb
-        return """screen -S {} -d -m bash -c "script -f -c 'sudo ./{} {} {} {}' switchlog"; sleep 1""".format(self.switch_binary_name(), self.switch_binary_name(), linklatency, switchlatency, bandwidth)
+        return """screen -S {} -d -m bash -c "script -f -c 'sudo ./{} {}' switchlog"; sleep 1""".format(self.switch_binary_name(), self.switch_binary_name(), self.switch_config_name())
 
     def kill_switch_simulation_command(self):
         """ Return the command to kill the switch. """
@@ -178,9 +191,14 @@ class AbstractSwitchToSwitchConfig:
         """ get local build dir of the switch. """
         return "../target-design/switch/"
 
+    def switch_local_dir(self):
+        """ local dir holding this switch's binary and config. """
+        return self.switch_build_local_dir() + self.switch_binary_name() + "-" + self.build_disambiguate + "-build/"
+
     def switch_binary_local_path(self):
         """ return the full local path where the switch binary lives. """
-        binaryname = self.switch_binary_name()
-        switchorigdir = self.switch_build_local_dir()
-        switchbuilddir = switchorigdir + binaryname + "-" + self.build_disambiguate + "-build/"
-        return switchbuilddir + self.switch_binary_name()
+        return self.switch_local_dir() + self.switch_binary_name()
+
+    def switch_config_local_path(self):
+        """ return the full local path where the switch config lives. """
+        return self.switch_local_dir() + self.switch_config_name()
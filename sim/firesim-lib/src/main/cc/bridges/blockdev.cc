@@ -4,6 +4,11 @@
 #include "blockdev.h"
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
 #include <string>
 
 /* Block Device Endpoint Driver
@@ -12,6 +17,23 @@
  * chipyard/testchipip/src/main/scala/BlockDevice.scala (Block Device RTL)
  * and
  * src/main/scala/bridges/BlockDevWidget.scala
+ *
+ * The disk is accessed through a page cache, so the tick loop never waits
+ * on the file: reads that miss are queued until I/O threads fill their
+ * pages (reading ahead on sequential access), writes land in the cache,
+ * after any earlier reads of their sectors, and are written back when
+ * evicted and, in order, at finish().
+ *   +blkdev-cacheN=MiB          cache size (default 64)
+ *   +blkdev-readaheadN=PAGES    pages read ahead (default 16, of 4 KiB)
+ *   +blkdev-io-threadsN=N       I/O threads (default 2)
+ *
+ * With +blkdev-overlayN=FILE, the disk image given by +blkdevN= is only
+ * read, mapped so all the simulations on a host share it, and writes go to
+ * a sparse copy-on-write overlay. An existing overlay is picked up where it
+ * left off if it was made from an image of the same size and contents at
+ * its start and end, and refused otherwise. Each page's entry in the
+ * overlay's sector map is written after the page's data, so an overlay left
+ * by a simulation that died holds what it had written back.
  */
 
 /* Uncomment to get DEBUG printing
@@ -32,7 +54,10 @@ blockdev_t::blockdev_t(simif_t* sim, const std::vector<std::string>& args, uint3
     this->mmio_addrs = mmio_addrs;
     this->_file = NULL;
     this->logfile = NULL;
+    this->blkdevno = blkdevno;
     _ntags = num_trackers;
+    size_t cache_mb = 64;
+    int io_threads = 2;
     long size;
     long mem_filesize = 0;
 
@@ -47,6 +72,10 @@ blockdev_t::blockdev_t(simif_t* sim, const std::vector<std::string>& args, uint3
     std::string blkdevwlatency_arg = std::string("+blkdev-wlatency") + num_equals;
     std::string blkdevrlatency_arg = std::string("+blkdev-rlatency") + num_equals;
     std::string blkdevlog_arg      = std::string("+blkdev-log") + num_equals;
+    std::string blkdevcache_arg    = std::string("+blkdev-cache") + num_equals;
+    std::string blkdevra_arg       = std::string("+blkdev-readahead") + num_equals;
+    std::string blkdevthreads_arg  = std::string("+blkdev-io-threads") + num_equals;
+    std::string blkdevoverlay_arg  = std::string("+blkdev-overlay") + num_equals;
 
     for (auto &arg: args) {
         if (arg.find(blkdev_arg) == 0) {
@@ -65,6 +94,18 @@ blockdev_t::blockdev_t(simif_t* sim, const std::vector<std::string>& args, uint3
         if (arg.find(blkdevlog_arg) == 0) {
             logname = const_cast<char*>(arg.c_str()) + blkdevlog_arg.length();
         }
+        if (arg.find(blkdevcache_arg) == 0) {
+            cache_mb = atoi(arg.c_str() + blkdevcache_arg.length());
+        }
+        if (arg.find(blkdevra_arg) == 0) {
+            readahead_pages = atoi(arg.c_str() + blkdevra_arg.length());
+        }
+        if (arg.find(blkdevoverlay_arg) == 0) {
+            overlayname = const_cast<char*>(arg.c_str()) + blkdevoverlay_arg.length();
+        }
+        if (arg.find(blkdevthreads_arg) == 0) {
+            io_threads = atoi(arg.c_str() + blkdevthreads_arg.length());
+        }
     }
 
     uint32_t max_latency = (1UL << latency_bits) - 1;
@@ -88,7 +129,28 @@ blockdev_t::blockdev_t(simif_t* sim, const std::vector<std::string>& args, uint3
         }
     }
 
-    if (filename) {
+    if (filename && overlayname) {
+        struct stat st;
+        base_fd = open(filename, O_RDONLY);
+        if (base_fd < 0 || fstat(base_fd, &st)) {
+            fprintf(stderr, "Could not open %s\n", filename);
+            abort();
+        }
+        size = st.st_size;
+        if (size > 0) {
+            base_bytes = size;
+            base = (char *) mmap(NULL, base_bytes, PROT_READ, MAP_SHARED, base_fd, 0);
+            if (base == MAP_FAILED) {
+                perror("mmap");
+                abort();
+            }
+        }
+        fd = open(overlayname, O_RDWR | O_CREAT, 0644);
+        if (fd < 0) {
+            fprintf(stderr, "Could not open %s\n", overlayname);
+            abort();
+        }
+    } else if (filename) {
         _file = fopen(filename, "r+");
         if (!_file) {
             fprintf(stderr, "Could not open %s\n", filename);
@@ -104,29 +166,394 @@ blockdev_t::blockdev_t(simif_t* sim, const std::vector<std::string>& args, uint3
             abort();
         }
     } else if (mem_filesize > 0 ) {
+        // A zero-filled temporary file, so it can be read with pread
         size = mem_filesize << SECTOR_SHIFT;
-        _file = fmemopen(NULL, size, "r+");
+        _file = tmpfile();
         if (!_file) {
-            perror("fmemopen");
+            perror("tmpfile");
+            abort();
+        }
+        if (ftruncate(fileno(_file), size)) {
+            perror("ftruncate");
             abort();
         }
     } else {
         size = 0;
     }
     _nsectors = size >> SECTOR_SHIFT;
+    _size = (uint64_t) _nsectors << SECTOR_SHIFT;
 
     write_trackers.resize(_ntags);
+
+    // Room for at least a few requests' worth of pages
+    cache_pages = std::max(cache_mb * (1 << 20) / BLKDEV_PAGE_SIZE, (size_t) 64);
+    if (io_threads < 1) {
+        fprintf(stderr, "blkdev%d: need at least one I/O thread\n", blkdevno);
+        abort();
+    }
+    if (overlayname && filename) {
+        open_overlay();
+    }
+    if (_file) {
+        fflush(_file);
+        fd = fileno(_file);
+    }
+    if (fd >= 0) {
+        for (int i = 0; i < io_threads; i++) {
+            io_queues.emplace_back(new blkdev_io_queue);
+            blkdev_io_queue *q = io_queues.back().get();
+            q->thread = std::thread(&blockdev_t::io_worker, this, q);
+        }
+    }
 }
 
 blockdev_t::~blockdev_t() {
+    flush();
+    for (auto &q: io_queues) {
+        {
+            std::lock_guard<std::mutex> l(q->lock);
+            q->stop = true;
+        }
+        q->cv.notify_one();
+        q->thread.join();
+    }
     free(this->mmio_addrs);
-    if (filename) {
+    if (_file) {
         fclose(_file);
+    } else if (fd >= 0) {
+        close(fd);
     }
+    if (base)
+        munmap(base, base_bytes);
+    if (base_fd >= 0)
+        close(base_fd);
     if (logfile)
         fclose(logfile);
 }
 
+// calls f(first, count) for each run of sectors set in a page's mask
+template <typename F>
+static void sector_runs(uint8_t sectors, F f) {
+    for (int s = 0; s < BLKDEV_PAGE_SECTORS; s++) {
+        if (!(sectors & (1 << s)))
+            continue;
+        int e = s;
+        while (e < BLKDEV_PAGE_SECTORS && (sectors & (1 << e)))
+            e++;
+        f(s, e - s);
+        s = e;
+    }
+}
+
+static void pread_all(int fd, char *data, size_t len, uint64_t offset) {
+    for (size_t done = 0; done < len; ) {
+        ssize_t n = pread(fd, data + done, len - done, offset + done);
+        if (n <= 0) {
+            fprintf(stderr, "Cannot read data at %lx\n", offset + done);
+            abort();
+        }
+        done += n;
+    }
+}
+
+static void pwrite_all(int fd, const char *data, size_t len, uint64_t offset) {
+    for (size_t done = 0; done < len; ) {
+        ssize_t n = pwrite(fd, data + done, len - done, offset + done);
+        if (n <= 0) {
+            fprintf(stderr, "Cannot write data at %lx\n", offset + done);
+            abort();
+        }
+        done += n;
+    }
+}
+
+// FNV-1a
+static uint64_t hash_bytes(const char *data, size_t len, uint64_t hash) {
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ (uint8_t) data[i]) * 0x100000001b3UL;
+    return hash;
+}
+
+/* Pick up the overlay's sector map if it was made from this base, or set
+ * up an empty overlay */
+void blockdev_t::open_overlay() {
+    uint64_t pages = (_nsectors + BLKDEV_PAGE_SECTORS - 1) / BLKDEV_PAGE_SECTORS;
+    overlay_map.resize(pages);
+    map_offset = (_size + BLKDEV_PAGE_SIZE - 1) / BLKDEV_PAGE_SIZE * BLKDEV_PAGE_SIZE;
+    uint64_t overlay_bytes = map_offset + sizeof(blkdev_overlay_header) + pages;
+
+    // identify the base by content, so copies of it on other hosts match
+    struct stat base_st, st;
+    if (fstat(base_fd, &base_st) || fstat(fd, &st)) {
+        perror("fstat");
+        abort();
+    }
+    blkdev_overlay_header ours = {};
+    ours.magic = BLKDEV_OVERLAY_MAGIC;
+    ours.base_size = _size;
+    ours.base_hash = 0xcbf29ce484222325UL;
+    if (base) {
+        size_t head = std::min((uint64_t) BLKDEV_OVERLAY_HASH_BYTES, _size);
+        ours.base_hash = hash_bytes(base, head, ours.base_hash);
+        ours.base_hash = hash_bytes(base + _size - head, head, ours.base_hash);
+    }
+    ours.base_mtime = base_st.st_mtime;
+
+    if (st.st_size == 0) {
+        if (ftruncate(fd, overlay_bytes)) {
+            perror("ftruncate");
+            abort();
+        }
+        pwrite_all(fd, (char *) &ours, sizeof(ours), map_offset);
+        if (fsync(fd))
+            perror("fsync");
+        return;
+    }
+
+    blkdev_overlay_header theirs;
+    if ((uint64_t) st.st_size != overlay_bytes ||
+            pread(fd, &theirs, sizeof(theirs), map_offset) != (ssize_t) sizeof(theirs) ||
+            theirs.magic != BLKDEV_OVERLAY_MAGIC || theirs.base_size != ours.base_size ||
+            theirs.base_hash != ours.base_hash) {
+        fprintf(stderr, "blkdev%d: overlay %s was not made from %s\n", blkdevno, overlayname, filename);
+        abort();
+    }
+    if (theirs.base_mtime != ours.base_mtime) {
+        fprintf(stderr, "blkdev%d: warning: %s was modified after overlay %s was made from it\n",
+                blkdevno, filename, overlayname);
+    }
+    if (pread(fd, overlay_map.data(), pages, map_offset + sizeof(theirs)) != (ssize_t) pages) {
+        fprintf(stderr, "Cannot read the sector map of %s\n", overlayname);
+        abort();
+    }
+    uint64_t written = 0;
+    for (auto sectors: overlay_map)
+        written += __builtin_popcount(sectors);
+    printf("blkdev%d: using overlay %s, %lu sectors written\n", blkdevno, overlayname, written);
+}
+
+/* I/O thread: run jobs until told to stop, then finish the ones left */
+void blockdev_t::io_worker(blkdev_io_queue *q) {
+    while (true) {
+        blkdev_io *io;
+        {
+            std::unique_lock<std::mutex> l(q->lock);
+            q->cv.wait(l, [q] { return q->stop || !q->jobs.empty(); });
+            if (q->jobs.empty())
+                return;
+            io = q->jobs.front();
+            q->jobs.pop_front();
+        }
+
+        uint64_t offset = io->page * BLKDEV_PAGE_SIZE;
+        char *data = (char *) io->data;
+        if (!io->write) {
+            size_t len = std::min((uint64_t) BLKDEV_PAGE_SIZE, _size - offset);
+            if (!base) {
+                pread_all(fd, data, len, offset);
+            } else {
+                memcpy(data, base + offset, len);
+                sector_runs(io->sectors, [&](int s, int n) {
+                    pread_all(fd, data + s * SECTOR_SIZE, n * SECTOR_SIZE, offset + s * SECTOR_SIZE);
+                });
+            }
+        } else {
+            sector_runs(io->sectors, [&](int s, int n) {
+                pwrite_all(fd, data + s * SECTOR_SIZE, n * SECTOR_SIZE, offset + s * SECTOR_SIZE);
+            });
+            // only once the data it points to is in the file, so a run that
+            // dies leaves a map that matches it
+            if (base)
+                pwrite_all(fd, (char *) &io->map, 1, map_offset + sizeof(blkdev_overlay_header) + io->page);
+        }
+
+        std::lock_guard<std::mutex> l(io_done_lock);
+        io_done.push_back(io);
+    }
+}
+
+void blockdev_t::submit_io(blkdev_io *io) {
+    blkdev_io_queue *q = io_queues[io->page % io_queues.size()].get();
+    io_outstanding++;
+    {
+        std::lock_guard<std::mutex> l(q->lock);
+        q->jobs.push_back(io);
+    }
+    q->cv.notify_one();
+}
+
+/* Take in finished I/O; a read fills the sectors not written since */
+void blockdev_t::reap_io() {
+    std::vector<blkdev_io*> done;
+    {
+        std::lock_guard<std::mutex> l(io_done_lock);
+        done.swap(io_done);
+    }
+    for (auto io: done) {
+        if (!io->write) {
+            // pages being loaded are never evicted
+            blkdev_page &page = cache.at(io->page);
+            for (int s = 0; s < BLKDEV_PAGE_SECTORS; s++) {
+                if (!(page.valid & (1 << s)))
+                    memcpy(page.data + s * SECTOR_BEATS, io->data + s * SECTOR_BEATS, SECTOR_SIZE);
+            }
+            page.valid = BLKDEV_PAGE_ALL;
+            page.loading = false;
+            pages_read++;
+        } else {
+            pages_written++;
+        }
+        delete io;
+        io_outstanding--;
+    }
+}
+
+void blockdev_t::write_back(uint64_t pageno, blkdev_page &page) {
+    blkdev_io *io = new blkdev_io;
+    io->write = true;
+    io->page = pageno;
+    io->sectors = page.dirty;
+    memcpy(io->data, page.data, BLKDEV_PAGE_SIZE);
+    if (base) {
+        // later reads of the page queue behind this write
+        overlay_map[pageno] |= page.dirty;
+        io->map = overlay_map[pageno];
+    }
+    page.dirty = 0;
+    unsynced = true;
+    submit_io(io);
+}
+
+/* Make room for a page, dropping the least recently used */
+void blockdev_t::evict_pages() {
+    auto it = lru.end();
+    while (cache.size() >= cache_pages && it != lru.begin()) {
+        uint64_t pageno = *--it;
+        blkdev_page &page = cache.at(pageno);
+        if (page.loading || page.pinned)
+            continue;
+        if (page.dirty)
+            write_back(pageno, page);
+        cache.erase(pageno);
+        it = lru.erase(it);
+    }
+}
+
+/* Look up a page, adding it, with nothing valid, if it isn't cached */
+blkdev_page * blockdev_t::get_page(uint64_t pageno) {
+    auto it = cache.find(pageno);
+    if (it != cache.end()) {
+        lru.splice(lru.begin(), lru, it->second.lru);
+        return &it->second;
+    }
+    evict_pages();
+    blkdev_page &page = cache[pageno];
+    page.valid = 0;
+    page.dirty = 0;
+    page.loading = false;
+    page.pinned = false;
+    lru.push_front(pageno);
+    page.lru = lru.begin();
+    return &page;
+}
+
+/* Whether the given sectors of a page are cached, starting to load it if
+ * not */
+bool blockdev_t::page_ready(uint64_t pageno, uint8_t sectors) {
+    blkdev_page *page = get_page(pageno);
+    if ((page->valid & sectors) == sectors)
+        return true;
+    if (!page->loading) {
+        blkdev_io *io = new blkdev_io;
+        io->write = false;
+        io->page = pageno;
+        io->sectors = base ? overlay_map[pageno] : 0;
+        page->loading = true;
+        submit_io(io);
+    }
+    return false;
+}
+
+// the sectors of a page within [start, end)
+static uint8_t page_sectors(uint64_t pageno, uint64_t start, uint64_t end) {
+    uint64_t first = std::max(start, pageno * BLKDEV_PAGE_SECTORS);
+    uint64_t last = std::min(end, (pageno + 1) * BLKDEV_PAGE_SECTORS);
+    return ((1 << (last - first)) - 1) << (first % BLKDEV_PAGE_SECTORS);
+}
+
+/* Answer the queued reads, in order, as far as their pages are cached */
+void blockdev_t::complete_reads() {
+    while (!pending_reads.empty()) {
+        struct blkdev_request &req = pending_reads.front();
+        uint64_t start = req.offset, end = start + req.len;
+        uint64_t first_page = start / BLKDEV_PAGE_SECTORS, last_page = (end - 1) / BLKDEV_PAGE_SECTORS;
+        bool ready = true;
+        // pin each page as we go, so making room for a later one can't
+        // evict it before the beats are copied out
+        for (uint64_t p = first_page; p <= last_page; p++) {
+            ready &= page_ready(p, page_sectors(p, start, end));
+            cache.at(p).pinned = true;
+        }
+        if (!ready)
+            return;
+
+        for (uint64_t s = start; s < end; s++) {
+            blkdev_page &page = cache.at(s / BLKDEV_PAGE_SECTORS);
+            uint64_t *data = page.data + (s % BLKDEV_PAGE_SECTORS) * SECTOR_BEATS;
+            for (int i = 0; i < SECTOR_BEATS; i++) {
+                struct blkdev_data resp;
+                resp.data = data[i];
+                resp.tag = req.tag;
+                read_responses.push(resp);
+            }
+        }
+        for (uint64_t p = first_page; p <= last_page; p++)
+            cache.at(p).pinned = false;
+        pending_reads.pop_front();
+        reads_answered++;
+        apply_held_writes();
+    }
+}
+
+/* Put the held writes whose earlier reads have been answered in the cache,
+ * in the order they came in */
+void blockdev_t::apply_held_writes() {
+    while (!held_writes.empty() && held_writes.front().after_reads <= reads_answered) {
+        apply_write(held_writes.front().tracker);
+        write_acks.push(held_writes.front().tag);
+        held_writes.pop_front();
+    }
+}
+
+/* Write back every dirty page, in disk order, and wait for it to land */
+void blockdev_t::flush() {
+    std::vector<uint64_t> dirty;
+    for (auto &entry: cache) {
+        if (entry.second.dirty)
+            dirty.push_back(entry.first);
+    }
+    std::sort(dirty.begin(), dirty.end());
+    for (auto pageno: dirty)
+        write_back(pageno, cache.at(pageno));
+    while (io_outstanding) {
+        reap_io();
+        std::this_thread::yield();
+    }
+    if (!unsynced)
+        return;
+    if (fsync(fd))
+        perror("fsync");
+    unsynced = false;
+}
+
+void blockdev_t::finish() {
+    flush();
+    if (fd >= 0) {
+        printf("blkdev%d: %lu reads, %lu hit in cache; %lu pages read (%lu ahead), %lu written back\n",
+                blkdevno, read_hits + read_misses, read_hits, pages_read, pages_read_ahead, pages_written);
+    }
+}
+
 /* "init" for blockdev widget that gets called right before target_reset.
  * Here, we set control regs e.g. for # sectors, allowed request length
  * at boot */
@@ -138,18 +565,10 @@ void blockdev_t::init() {
     write(this->mmio_addrs->write_latency, write_latency);
 }
 
-/* Take a read request, get data from the disk file, and fill the beats
- * into the response queue from which data will be written to the block device
- * widget on the FPGA */
+/* Take a read request, start loading any of its pages not cached, and queue
+ * it; complete_reads fills its beats into the response queue from which
+ * data will be written to the block device widget on the FPGA */
 void blockdev_t::do_read(struct blkdev_request &req) {
-    uint64_t offset, nbeats;
-    uint64_t blk_data[MAX_REQ_LEN * SECTOR_BEATS];
-
-    offset = req.offset;
-    offset <<= SECTOR_SHIFT;
-    nbeats = req.len;
-    nbeats *= SECTOR_BEATS;
-
     /* Check that the request is valid. */
     if ((req.offset + req.len) > nsectors()) {
         fprintf(stderr, "Read range %u - %u out of bounds\n",
@@ -170,26 +589,31 @@ void blockdev_t::do_read(struct blkdev_request &req) {
         abort();
     }
 
-    /* Seek to correct place in the file. */
-    if (fseek(_file, offset, SEEK_SET)) {
-        fprintf(stderr, "Could not seek to %llx\n", offset);
-        abort();
-    }
-
-    /* Perform the read from file. */
-    if (fread(blk_data, SECTOR_SIZE, req.len, _file) < req.len) {
-        fprintf(stderr, "Cannot read data at %llx\n", offset);
-        abort();
+    uint64_t start = req.offset, end = start + req.len;
+    uint64_t last_page = (end - 1) / BLKDEV_PAGE_SECTORS;
+    bool hit = true;
+    for (uint64_t p = start / BLKDEV_PAGE_SECTORS; p <= last_page; p++)
+        hit &= page_ready(p, page_sectors(p, start, end));
+    if (hit)
+        read_hits++;
+    else
+        read_misses++;
+
+    /* On sequential reads, start loading the pages that follow, leaving
+     * the cache room for the pages reads are waiting on */
+    if (start == next_sequential) {
+        uint64_t disk_pages = (nsectors() + BLKDEV_PAGE_SECTORS - 1) / BLKDEV_PAGE_SECTORS;
+        uint64_t ahead = std::min((size_t) readahead_pages, cache_pages / 2);
+        for (uint64_t p = last_page + 1; p <= last_page + ahead && p < disk_pages; p++) {
+            if (cache.count(p))
+                continue;
+            page_ready(p, BLKDEV_PAGE_ALL);
+            pages_read_ahead++;
+        }
     }
+    next_sequential = end;
 
-    /* Populate response queue from data that has been read from file. Response
-     * queue will be consumed when writing to FPGA. */
-    for (uint64_t i = 0; i < nbeats; i++) {
-        struct blkdev_data resp;
-        resp.data = blk_data[i];
-        resp.tag = req.tag;
-        read_responses.push(resp);
-    }
+    pending_reads.push_back(req);
 }
 
 /* Take a write request and set up a write_tracker to process it.
@@ -244,7 +668,6 @@ void blockdev_t::handle_data(struct blkdev_data &data) {
     }
 
     struct blkdev_write_tracker &tracker = write_trackers[data.tag];
-    struct blkdev_data resp;
 
     /* Copy data into the write tracker */
     tracker.data[tracker.count] = data.data;
@@ -256,26 +679,45 @@ void blockdev_t::handle_data(struct blkdev_data &data) {
         return;
     }
 
-    /* Seek to the right place to begin the write to file. */
-    if (fseek(_file, tracker.offset, SEEK_SET)) {
-        fprintf(stderr, "Could not seek to %llx\n", tracker.offset);
-        abort();
+    /* A read queued before this write must not see it, so if one of those
+     * is still waiting on a page this covers, hold the write (and any after
+     * it) until that read has been answered */
+    uint64_t start = tracker.offset >> SECTOR_SHIFT, end = start + tracker.size / SECTOR_BEATS;
+    uint64_t after_reads = held_writes.empty() ? 0 : held_writes.back().after_reads;
+    for (size_t i = 0; i < pending_reads.size(); i++) {
+        struct blkdev_request &req = pending_reads[i];
+        if (req.offset < end && start < req.offset + req.len)
+            after_reads = std::max(after_reads, reads_answered + i + 1);
     }
 
-    /* Perform the write to file. */
-    if (fwrite(tracker.data, sizeof(uint64_t), tracker.count, _file) < tracker.count) {
-        fprintf(stderr, "Cannot write data at %llx\n", tracker.offset);
-        abort();
+    if (after_reads > reads_answered) {
+        held_writes.emplace_back();
+        held_writes.back().tag = data.tag;
+        held_writes.back().after_reads = after_reads;
+        held_writes.back().tracker = tracker;
+    } else {
+        apply_write(tracker);
+        /* Send an ack to the block device.
+         * TODO: should a block device do this?  Biancolin: Yes.*/
+        write_acks.push(data.tag);
     }
 
     /* Clear the tracker state */
     tracker.offset = 0;
     tracker.count = 0;
     tracker.size = 0;
+}
 
-    /* Send an ack to the block device.
-     * TODO: should a block device do this?  Biancolin: Yes.*/
-    write_acks.push(data.tag);
+/* Perform a write into the cache; it reaches the file when written back. */
+void blockdev_t::apply_write(blkdev_write_tracker &tracker) {
+    uint64_t sector = tracker.offset >> SECTOR_SHIFT;
+    for (uint64_t i = 0; i < tracker.count; i += SECTOR_BEATS, sector++) {
+        blkdev_page *page = get_page(sector / BLKDEV_PAGE_SECTORS);
+        int s = sector % BLKDEV_PAGE_SECTORS;
+        memcpy(page->data + s * SECTOR_BEATS, tracker.data + i, SECTOR_SIZE);
+        page->valid |= 1 << s;
+        page->dirty |= 1 << s;
+    }
 }
 
 /* Read all pending request data from the widget */
@@ -337,7 +779,8 @@ void blockdev_t::send() {
 }
 
 bool blockdev_t::idle() {
-    return !resp_data_pending && !read(this->mmio_addrs->bdev_reqs_pending);
+    return !resp_data_pending && read_responses.empty() && pending_reads.empty() &&
+        !read(this->mmio_addrs->bdev_reqs_pending);
 }
 
 /* This method is called to service functional requests made by the widget.
@@ -345,6 +788,12 @@ bool blockdev_t::idle() {
  * we have not yet serviced a transaction that is scheduled to be released. */
 void blockdev_t::tick() {
 
+    /* Take in any finished disk I/O, answering the reads it was for */
+    if (io_outstanding) {
+        reap_io();
+        complete_reads();
+    }
+
     /* If there's nothing to do, early out and save a bunch of MMIO */
     if (idle()) {
         return;
@@ -385,6 +834,9 @@ void blockdev_t::tick() {
         req_data.pop();
     }
 
+    /* Answer the reads whose pages are cached */
+    complete_reads();
+
     /* Write state back to block device widget */
     this->send();
 }
@@ -4,6 +4,13 @@
 
 #include <vector>
 #include <queue>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <unordered_map>
 #include <stdio.h>
 
 #include "bridges/bridge_driver.h"
@@ -32,6 +39,62 @@ struct blkdev_write_tracker {
     uint64_t data[MAX_REQ_LEN * SECTOR_BEATS];
 };
 
+/* The disk is cached in pages of a few sectors; a sector of a page is valid
+ * once it holds the disk's current contents, and dirty until written back */
+#define BLKDEV_PAGE_SECTORS 8
+#define BLKDEV_PAGE_SIZE (BLKDEV_PAGE_SECTORS * SECTOR_SIZE)
+#define BLKDEV_PAGE_BEATS (BLKDEV_PAGE_SIZE / 8)
+#define BLKDEV_PAGE_ALL ((1 << BLKDEV_PAGE_SECTORS) - 1)
+
+struct blkdev_page {
+    uint64_t data[BLKDEV_PAGE_BEATS];
+    uint8_t valid;
+    uint8_t dirty;
+    bool loading;
+    // held by the read at the head of the queue until it's answered
+    bool pinned;
+    std::list<uint64_t>::iterator lru;
+};
+
+// a write that came in while earlier reads of its sectors were waiting on
+// their pages; it's put in the cache once they've been answered
+struct blkdev_held_write {
+    uint32_t tag;
+    uint64_t after_reads;
+    blkdev_write_tracker tracker;
+};
+
+// a page read, or a write-back of some of its sectors, run on an I/O thread
+struct blkdev_io {
+    bool write;
+    uint64_t page;
+    // those written back, or for a read, those to take from the overlay
+    uint8_t sectors;
+    // a write-back to an overlay puts the page's map entry down after it
+    uint8_t map;
+    uint64_t data[BLKDEV_PAGE_BEATS];
+};
+
+// Starts an overlay's sector map, naming the base image it was made from
+#define BLKDEV_OVERLAY_MAGIC 0x3130766f6b6c62UL // "blkov01"
+#define BLKDEV_OVERLAY_HASH_BYTES (1 << 20)
+struct blkdev_overlay_header {
+    uint64_t magic;
+    uint64_t base_size;
+    // of the base's first and last BLKDEV_OVERLAY_HASH_BYTES
+    uint64_t base_hash;
+    int64_t base_mtime;
+};
+
+// an I/O thread's jobs; a page's jobs all go to one thread, so stay in order
+struct blkdev_io_queue {
+    std::mutex lock;
+    std::condition_variable cv;
+    std::deque<blkdev_io*> jobs;
+    bool stop = false;
+    std::thread thread;
+};
+
 #ifdef BLOCKDEVBRIDGEMODULE_struct_guard
 class blockdev_t: public bridge_driver_t
 {
@@ -48,7 +111,7 @@ class blockdev_t: public bridge_driver_t
         virtual void tick();
         virtual bool terminate() { return false; }
         virtual int exit_code() { return 0; }
-        virtual void finish() {};
+        virtual void finish();
 
     private:
         BLOCKDEVBRIDGEMODULE_struct * mmio_addrs;
@@ -65,7 +128,20 @@ class blockdev_t: public bridge_driver_t
         simif_t* sim;
         uint32_t _ntags;
         uint32_t _nsectors;
+        uint64_t _size;
         FILE *_file, *logfile;
+        int fd = -1;
+        // With an overlay, the base image is mapped read-only and fd is the
+        // overlay, which has a header and then a byte per page, a bit per
+        // sector written, after the disk's data
+        char * overlayname = NULL;
+        int base_fd = -1;
+        char *base = NULL;
+        size_t base_bytes = 0;
+        std::vector<uint8_t> overlay_map;
+        uint64_t map_offset;
+        bool unsynced = false;
+        int blkdevno;
         char * filename = NULL;
         std::queue<blkdev_request> requests;
         std::queue<blkdev_data> req_data;
@@ -74,6 +150,38 @@ class blockdev_t: public bridge_driver_t
 
         std::vector<blkdev_write_tracker> write_trackers;
 
+        // Reads waiting on their pages, answered in order
+        std::deque<blkdev_request> pending_reads;
+        uint64_t reads_answered = 0;
+        std::deque<blkdev_held_write> held_writes;
+        std::unordered_map<uint64_t, blkdev_page> cache;
+        // most recently used first
+        std::list<uint64_t> lru;
+        size_t cache_pages;
+        uint32_t readahead_pages = 16;
+        uint64_t next_sequential = UINT64_MAX;
+
+        std::vector<std::unique_ptr<blkdev_io_queue>> io_queues;
+        std::mutex io_done_lock;
+        std::vector<blkdev_io*> io_done;
+        size_t io_outstanding = 0;
+
+        uint64_t read_hits = 0, read_misses = 0;
+        uint64_t pages_read = 0, pages_read_ahead = 0, pages_written = 0;
+
+        blkdev_page * get_page(uint64_t pageno);
+        bool page_ready(uint64_t pageno, uint8_t sectors);
+        void evict_pages();
+        void write_back(uint64_t pageno, blkdev_page &page);
+        void submit_io(blkdev_io *io);
+        void reap_io();
+        void io_worker(blkdev_io_queue *q);
+        void complete_reads();
+        void apply_write(blkdev_write_tracker &tracker);
+        void apply_held_writes();
+        void flush();
+        void open_overlay();
+
         void do_read(struct blkdev_request &req);
         void do_write(struct blkdev_request &req);
         bool can_accept(struct blkdev_data &data);
@@ -0,0 +1,371 @@
+//See LICENSE for license details
+
+#include "nicpeer.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+#define TOKENS_PER_BIGTOKEN 7
+#define NET_IP_ALIGN 2
+#define ETH_MAX_BYTES 1514
+#define ETH_MIN_BYTES 60
+#define MAC_MASK 0xffffffffffffUL
+// full rate is a flit a cycle
+#define LINK_GBPS 200
+// cycles per second, for pcap timestamps; see +linklatency
+#define TARGET_HZ 3.2e9
+// anything bigger in a capture file is taken to be corruption
+#define PCAP_MAX_BLOCK (1 << 24)
+
+// generator frames carry this and a sequence number in their first payload
+// flit, and the cycle they were sent in the next one
+#define NIC_PEER_MAGIC 0xf1e5ee7dUL
+#define STAMP_FLIT 3
+
+// the generator's and pcap replayer's own MAC
+#define NIC_PEER_MAC 0xfeffff6d1200UL
+
+nic_peer_t::nic_peer_t(uint64_t mac_lendian, int linklatency)
+    : mac(mac_lendian), linklatency(linklatency)
+{
+}
+
+/* frame bytes to flits, behind the NET_IP_ALIGN padding */
+void nic_peer_t::enqueue(const uint8_t *frame, size_t len, uint64_t ready) {
+    txframe f;
+    f.flits.resize((len + NET_IP_ALIGN + 7) / 8, 0);
+    memcpy(((uint8_t *) f.flits.data()) + NET_IP_ALIGN, frame, len);
+    f.ready = ready;
+    txq.push_back(f);
+}
+
+void nic_peer_t::receive_round(const uint64_t *buf, int bigtokens, uint64_t cycle) {
+    for (int bt = 0; bt < bigtokens; bt++) {
+        uint64_t lrv = buf[bt * 8];
+        for (int t = 0; t < TOKENS_PER_BIGTOKEN; t++) {
+            if (!((lrv >> (43 + t * 3)) & 1))
+                continue;
+            uint64_t flit_cycle = cycle + bt * TOKENS_PER_BIGTOKEN + t;
+            if (rx_flits.empty())
+                rx_first_cycle = flit_cycle;
+            rx_flits.push_back(buf[bt * 8 + t + 1]);
+            if (!((lrv >> (45 + t * 3)) & 1))
+                continue;
+
+            rx_frames++;
+            rx_bytes += rx_flits.size() * 8 - NET_IP_ALIGN;
+            if (rx_flits.size() > STAMP_FLIT && (rx_flits[2] >> 32) == NIC_PEER_MAGIC) {
+                uint64_t latency = rx_first_cycle - rx_flits[STAMP_FLIT];
+                stamped++;
+                latency_sum += latency;
+                latency_min = std::min(latency_min, latency);
+                latency_max = std::max(latency_max, latency);
+            }
+            frame_received(rx_flits, flit_cycle);
+            rx_flits.clear();
+        }
+    }
+}
+
+void nic_peer_t::send_round(uint64_t *buf, int bigtokens, uint64_t cycle) {
+    memset(buf, 0, bigtokens * 8 * sizeof(uint64_t));
+    generate(cycle + bigtokens * TOKENS_PER_BIGTOKEN);
+
+    for (int bt = 0; bt < bigtokens; bt++) {
+        for (int t = 0; t < TOKENS_PER_BIGTOKEN; t++) {
+            uint64_t flit_cycle = cycle + bt * TOKENS_PER_BIGTOKEN + t;
+            if (txq.empty() || (tx_flit == 0 && txq.front().ready > flit_cycle))
+                continue;
+
+            txframe &f = txq.front();
+            if (tx_flit == 0)
+                f.ready = flit_cycle;
+            uint64_t flit = f.flits[tx_flit];
+            if (tx_flit == STAMP_FLIT && (f.flits[2] >> 32) == NIC_PEER_MAGIC)
+                flit = f.ready;
+            bool last = ++tx_flit == f.flits.size();
+            buf[bt * 8] |= (1UL | ((uint64_t) last << 2)) << (43 + t * 3);
+            buf[bt * 8 + t + 1] = flit;
+            if (last) {
+                tx_frames++;
+                tx_bytes += f.flits.size() * 8 - NET_IP_ALIGN;
+                txq.pop_front();
+                tx_flit = 0;
+            }
+        }
+    }
+}
+
+void nic_peer_t::report(FILE *f, int nicno, uint64_t cycles) {
+    // bytes per cycle, at a flit a cycle being the full 200 Gbps
+    double scale = cycles ? 8.0 * LINK_GBPS / 64 / cycles : 0;
+    fprintf(f, "NIC %d peer: received %lu frames %lu bytes (%.2f Gbps), "
+            "sent %lu frames %lu bytes (%.2f Gbps) over %lu cycles\n",
+            nicno, rx_frames, rx_bytes, rx_bytes * scale,
+            tx_frames, tx_bytes, tx_bytes * scale, cycles);
+    if (stamped) {
+        fprintf(f, "NIC %d peer: %lu stamped frames back, latency min %lu mean %lu max %lu cycles\n",
+                nicno, stamped, latency_min, latency_sum / stamped, latency_max);
+    }
+}
+
+/* sends everything back the way it came */
+class nic_reflector_t: public nic_peer_t
+{
+    public:
+        using nic_peer_t::nic_peer_t;
+
+    protected:
+        virtual void frame_received(std::vector<uint64_t> &flits, uint64_t cycle) {
+            if (flits.size() < 2)
+                return;
+            // dst MAC is after the padding in flit 0, src MAC starts flit 1
+            uint64_t dst = flits[0] >> 16;
+            uint64_t src = flits[1] & MAC_MASK;
+            txframe f;
+            f.flits = flits;
+            f.flits[0] = (flits[0] & 0xffff) | (src << 16);
+            f.flits[1] = (flits[1] & ~MAC_MASK) | dst;
+            // a link latency there and another back
+            f.ready = cycle + 1 + 2 * linklatency;
+            txq.push_back(f);
+        }
+};
+
+/* a constant stream of stamped frames to the NIC */
+class nic_generator_t: public nic_peer_t
+{
+    public:
+        nic_generator_t(uint64_t mac_lendian, int linklatency, int bytes, int gbps)
+            : nic_peer_t(mac_lendian, linklatency), frame(bytes, 0)
+        {
+            int flits = (bytes + NET_IP_ALIGN + 7) / 8;
+            gap = (uint64_t) flits * LINK_GBPS / gbps;
+            // to us, from the peer, local experimental ethertype
+            memcpy(&frame[0], &mac, 6);
+            uint64_t peer_mac = NIC_PEER_MAC;
+            memcpy(&frame[6], &peer_mac, 6);
+            frame[12] = 0x88;
+            frame[13] = 0xb5;
+            // the magic lands in the top of flit 2
+            uint32_t magic = NIC_PEER_MAGIC;
+            memcpy(&frame[2 * 8 + 4 - NET_IP_ALIGN], &magic, 4);
+        }
+
+    protected:
+        virtual void generate(uint64_t until) {
+            // the link always takes a flit a cycle, so at most line rate
+            // this never builds a backlog
+            while (next < until) {
+                uint32_t s = seq++;
+                memcpy(&frame[2 * 8 - NET_IP_ALIGN], &s, 4);
+                enqueue(frame.data(), frame.size(), next);
+                next += gap;
+            }
+        }
+
+    private:
+        std::vector<uint8_t> frame;
+        uint64_t gap;
+        uint64_t next = 0;
+        uint32_t seq = 0;
+};
+
+/* replays a capture, classic pcap or pcapng, with its original spacing */
+class nic_pcap_replayer_t: public nic_peer_t
+{
+    public:
+        nic_pcap_replayer_t(uint64_t mac_lendian, int linklatency, const char *path)
+            : nic_peer_t(mac_lendian, linklatency)
+        {
+            file = fopen(path, "r");
+            if (!file) {
+                fprintf(stderr, "Could not open pcap file %s\n", path);
+                abort();
+            }
+            uint32_t magic;
+            if (fread(&magic, 4, 1, file) != 1) {
+                fprintf(stderr, "%s: empty pcap file\n", path);
+                abort();
+            }
+            if (magic == 0xa1b2c3d4 || magic == 0xa1b23c4d) {
+                uint32_t hdr[5];
+                if (fread(hdr, 4, 5, file) != 5 || hdr[4] != 1) {
+                    fprintf(stderr, "%s: not an Ethernet pcap\n", path);
+                    abort();
+                }
+                ngformat = false;
+                tick_secs = magic == 0xa1b2c3d4 ? 1e-6 : 1e-9;
+            } else if (magic == 0x0a0d0d0a) {
+                ngformat = true;
+                rewind(file);
+            } else {
+                fprintf(stderr, "%s: not a pcap or little-endian pcapng file\n", path);
+                abort();
+            }
+            this->path = path;
+        }
+        ~nic_pcap_replayer_t() { fclose(file); }
+
+    protected:
+        virtual void generate(uint64_t until) {
+            while (!done && (txq.empty() || txq.back().ready < until)) {
+                if (!(ngformat ? next_ng_frame() : next_frame())) {
+                    done = true;
+                    if (skipped)
+                        fprintf(stderr, "%s: skipped %lu frames over %d bytes\n",
+                                path.c_str(), skipped, ETH_MAX_BYTES);
+                    break;
+                }
+                if (buf.size() > ETH_MAX_BYTES) {
+                    skipped++;
+                    continue;
+                }
+                if (!have_start) {
+                    start_ts = ts;
+                    start_cycle = until;
+                    have_start = true;
+                }
+                enqueue(buf.data(), buf.size(),
+                        start_cycle + (uint64_t) ((ts - start_ts) * TARGET_HZ));
+            }
+        }
+
+    private:
+        bool next_frame() {
+            uint32_t rec[4];
+            if (fread(rec, 4, 4, file) != 4)
+                return false;
+            ts = rec[0] + rec[1] * tick_secs;
+            if (rec[2] > PCAP_MAX_BLOCK) {
+                fprintf(stderr, "%s: bad record length %u\n", path.c_str(), rec[2]);
+                abort();
+            }
+            return read_data(rec[2]);
+        }
+
+        bool next_ng_frame() {
+            uint32_t hdr[2];
+            while (fread(hdr, 4, 2, file) == 2) {
+                // type, length and a trailing copy of the length frame the body
+                if (hdr[1] < 12 || hdr[1] % 4 || hdr[1] > PCAP_MAX_BLOCK) {
+                    fprintf(stderr, "%s: bad pcapng block length %u\n", path.c_str(), hdr[1]);
+                    abort();
+                }
+                uint32_t type = hdr[0], body = hdr[1] - 12;
+                std::vector<uint8_t> blk(body);
+                if (fread(blk.data(), 1, body, file) != body || fseek(file, 4, SEEK_CUR))
+                    break;
+                if (type == 0x0a0d0d0a) {
+                    if (body < 4) {
+                        fprintf(stderr, "%s: truncated pcapng section header\n", path.c_str());
+                        abort();
+                    }
+                    uint32_t bom;
+                    memcpy(&bom, blk.data(), 4);
+                    if (bom != 0x1a2b3c4d) {
+                        fprintf(stderr, "%s: big-endian pcapng not supported\n", path.c_str());
+                        abort();
+                    }
+                    iface_tick.clear();
+                } else if (type == 1) {
+                    if (body < 8) {
+                        fprintf(stderr, "%s: truncated pcapng interface block\n", path.c_str());
+                        abort();
+                    }
+                    iface_tick.push_back(idb_tick(blk));
+                } else if (type == 6) {
+                    uint32_t f[5];
+                    if (body < 20) {
+                        fprintf(stderr, "%s: truncated pcapng packet block\n", path.c_str());
+                        abort();
+                    }
+                    memcpy(f, blk.data(), 20);
+                    if (f[3] > body - 20) {
+                        fprintf(stderr, "%s: pcapng packet of %u bytes in a %u byte block\n",
+                                path.c_str(), f[3], hdr[1]);
+                        abort();
+                    }
+                    double tick = f[0] < iface_tick.size() ? iface_tick[f[0]] : 1e-6;
+                    ts = (((uint64_t) f[1] << 32) | f[2]) * tick;
+                    buf.assign(blk.begin() + 20, blk.begin() + 20 + f[3]);
+                    return true;
+                } else if (type == 3) {
+                    if (body < 4) {
+                        fprintf(stderr, "%s: truncated pcapng packet block\n", path.c_str());
+                        abort();
+                    }
+                    // simple packet: no timestamp, send straight after
+                    buf.assign(blk.begin() + 4, blk.end());
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        double idb_tick(std::vector<uint8_t> &blk) {
+            uint16_t linktype;
+            memcpy(&linktype, blk.data(), 2);
+            if (linktype != 1) {
+                fprintf(stderr, "%s: not an Ethernet pcapng\n", path.c_str());
+                abort();
+            }
+            // if_tsresol option, else microseconds
+            for (size_t off = 8; off + 4 <= blk.size(); ) {
+                uint16_t code, len;
+                memcpy(&code, &blk[off], 2);
+                memcpy(&len, &blk[off + 2], 2);
+                if (code == 0)
+                    break;
+                if (code == 9 && len == 1) {
+                    uint8_t res = blk[off + 4];
+                    double tick = 1;
+                    for (int i = 0; i < (res & 0x7f); i++)
+                        tick /= (res & 0x80) ? 2 : 10;
+                    return tick;
+                }
+                off += 4 + (len + 3) / 4 * 4;
+            }
+            return 1e-6;
+        }
+
+        bool read_data(uint32_t len) {
+            buf.resize(len);
+            return fread(buf.data(), 1, len, file) == len;
+        }
+
+        FILE *file;
+        std::string path;
+        bool ngformat;
+        bool done = false;
+        std::vector<double> iface_tick;
+        double tick_secs = 1e-6;
+        std::vector<uint8_t> buf;
+        double ts = 0, start_ts = 0;
+        bool have_start = false;
+        uint64_t start_cycle = 0;
+        uint64_t skipped = 0;
+};
+
+nic_peer_t * make_nic_peer(std::string spec, uint64_t mac_lendian, int linklatency) {
+    if (spec == "reflect")
+        return new nic_reflector_t(mac_lendian, linklatency);
+
+    int bytes, gbps;
+    char junk;
+    if (sscanf(spec.c_str(), "gen:%d:%d%c", &bytes, &gbps, &junk) == 2) {
+        if (bytes < ETH_MIN_BYTES || bytes > ETH_MAX_BYTES || gbps < 1 || gbps > LINK_GBPS) {
+            fprintf(stderr, "+nic-peer gen: frames must be %d to %d bytes, at 1 to %d Gbps\n",
+                    ETH_MIN_BYTES, ETH_MAX_BYTES, LINK_GBPS);
+            abort();
+        }
+        return new nic_generator_t(mac_lendian, linklatency, bytes, gbps);
+    }
+    if (spec.find("pcap:") == 0)
+        return new nic_pcap_replayer_t(mac_lendian, linklatency, spec.c_str() + 5);
+
+    fprintf(stderr, "Unknown +nic-peer %s: expected reflect, gen:BYTES:GBPS or pcap:FILE\n",
+            spec.c_str());
+    abort();
+}
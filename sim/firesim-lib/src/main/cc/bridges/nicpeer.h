@@ -0,0 +1,66 @@
+//See LICENSE for license details
+
+#ifndef __NICPEER_H
+#define __NICPEER_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+/* A host-side peer for a SimpleNIC, standing in for the switch so the NIC
+ * can be benchmarked on its own (+nic-peerN=):
+ *
+ *   reflect            send every frame back, MACs swapped
+ *   gen:BYTES:GBPS     send BYTES-byte frames to the NIC at GBPS (out of
+ *                      the 200 Gbps link), stamped with their send cycle
+ *   pcap:FILE          replay the frames in a pcap/pcapng file, keeping
+ *                      their spacing
+ *
+ * The driver hands the peer each round of big tokens the FPGA produced,
+ * and asks it for each round to send back, both labelled with the target
+ * cycle the round starts at. Frames are modelled at one flit per cycle, a
+ * link latency each way. Frames the NIC sends back carrying a generator
+ * stamp give the latency through the target. */
+class nic_peer_t
+{
+    public:
+        nic_peer_t(uint64_t mac_lendian, int linklatency);
+        virtual ~nic_peer_t() { }
+
+        void receive_round(const uint64_t *buf, int bigtokens, uint64_t cycle);
+        void send_round(uint64_t *buf, int bigtokens, uint64_t cycle);
+        void report(FILE *f, int nicno, uint64_t cycles);
+
+    protected:
+        struct txframe {
+            std::vector<uint64_t> flits;
+            // first cycle it can start arriving at the NIC
+            uint64_t ready;
+        };
+
+        // a whole frame came in from the NIC, its last flit at cycle
+        virtual void frame_received(std::vector<uint64_t> &flits, uint64_t cycle) { }
+        // queue any frames due to start arriving before cycle until
+        virtual void generate(uint64_t until) { }
+        void enqueue(const uint8_t *frame, size_t len, uint64_t ready);
+
+        uint64_t mac;
+        int linklatency;
+        std::deque<txframe> txq;
+
+    private:
+        std::vector<uint64_t> rx_flits;
+        uint64_t rx_first_cycle = 0;
+        size_t tx_flit = 0;
+
+        uint64_t rx_frames = 0, rx_bytes = 0;
+        uint64_t tx_frames = 0, tx_bytes = 0;
+        uint64_t stamped = 0, latency_sum = 0;
+        uint64_t latency_min = UINT64_MAX, latency_max = 0;
+};
+
+nic_peer_t * make_nic_peer(std::string spec, uint64_t mac_lendian, int linklatency);
+
+#endif // __NICPEER_H
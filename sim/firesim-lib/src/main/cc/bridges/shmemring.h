@@ -0,0 +1,222 @@
+#ifndef __SHMEMRING_H
+#define __SHMEMRING_H
+
+/* Single-producer/single-consumer ring of link rounds in shared memory.
+ *
+ * This is the transport between the SimpleNIC driver and the switch model.
+ * The switch side lives in target-design/switch/shmemring.h; the two must
+ * agree on the layout below and on SHMEM_RING_SLOTS.
+ *
+ * Layout of one region (one region per link direction):
+ *   [ control block, SHMEM_RING_CTRL_BYTES ][ slot 0 ] ... [ slot K-1 ]
+ * Each slot holds one round (a link latency worth of big tokens). The
+ * control block is a page and slots are padded to whole pages, so every
+ * slot is page aligned and a DMA engine can target it in place.
+ *
+ * head counts rounds published by the producer, tail counts rounds released
+ * by the consumer. Both free-run and wrap; head - tail is the occupancy.
+ * They live on separate cache lines so the two processes don't false-share.
+ * Waiters spin with a pause for a while, then sleep on a futex.
+ *
+ * The side that opens a region first stamps its layout (magic, version and
+ * slot size) in the control block and the other checks it, so two copies
+ * of this header that drift apart, or ends with different link latencies,
+ * fail at open() instead of corrupting the link. Bump SHMEM_RING_VERSION on
+ * any layout change; the static_asserts below are the same in both copies. */
+
+#include <atomic>
+#include <climits>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#define SHMEM_RING_MAGIC 0x73686d72UL // "shmr"
+#define SHMEM_RING_VERSION 2UL
+#define SHMEM_RING_LAYOUT ((SHMEM_RING_MAGIC << 32) | SHMEM_RING_VERSION)
+// number of rounds of slack between producer and consumer
+#define SHMEM_RING_SLOTS 4
+#define SHMEM_RING_PAGE 4096
+#define SHMEM_RING_CTRL_BYTES SHMEM_RING_PAGE
+// number of pause iterations before falling back to futex sleep
+#define SHMEM_SPIN_ITERS (1 << 14)
+
+struct shmem_ring_ctrl {
+    alignas(64) std::atomic<uint64_t> layout;
+    std::atomic<uint64_t> slot_bytes;
+    alignas(64) std::atomic<uint32_t> head;
+    std::atomic<uint32_t> head_waiters;
+    alignas(64) std::atomic<uint32_t> tail;
+    std::atomic<uint32_t> tail_waiters;
+};
+
+static_assert(sizeof(shmem_ring_ctrl) <= SHMEM_RING_CTRL_BYTES,
+        "shmem ring control block too large");
+static_assert(offsetof(shmem_ring_ctrl, slot_bytes) == 8 && offsetof(shmem_ring_ctrl, head) == 64 &&
+        offsetof(shmem_ring_ctrl, tail) == 128 && sizeof(shmem_ring_ctrl) == 192,
+        "shmem ring control block layout changed; bump SHMEM_RING_VERSION in both copies");
+static_assert(SHMEM_RING_SLOTS == 4 && SHMEM_RING_CTRL_BYTES == 4096 && SHMEM_RING_VERSION == 2,
+        "shmem ring parameters must match the other copy of this header");
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t),
+        "futex word must be a plain 32-bit int");
+
+static inline void shmem_cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_pause();
+#endif
+}
+
+static inline long shmem_futex(std::atomic<uint32_t> *word, int op, uint32_t val) {
+    // non-private futex ops, since the word is shared between processes
+    return syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), op, val, NULL, NULL, 0);
+}
+
+// stamp a field if we're first to the region, else check it matches
+static inline void shmem_ring_check(std::atomic<uint64_t> *field, uint64_t ours,
+        const char * what, const char * name) {
+    uint64_t theirs = 0;
+    if (!field->compare_exchange_strong(theirs, ours) && theirs != ours) {
+        fprintf(stderr, "shmem region %s: %s is %#lx on the other end, %#lx here\n",
+                name, what, theirs, ours);
+        abort();
+    }
+}
+
+// block until *word != val
+static inline void shmem_wait_while_eq(std::atomic<uint32_t> *word, uint32_t val,
+        std::atomic<uint32_t> *waiters) {
+    for (int i = 0; i < SHMEM_SPIN_ITERS; i++) {
+        if (word->load(std::memory_order_acquire) != val)
+            return;
+        shmem_cpu_relax();
+    }
+    while (word->load(std::memory_order_acquire) == val) {
+        waiters->fetch_add(1, std::memory_order_seq_cst);
+        // the kernel re-checks *word == val, so a wake between our load and
+        // the sleep is not lost
+        if (word->load(std::memory_order_seq_cst) == val)
+            shmem_futex(word, FUTEX_WAIT, val);
+        waiters->fetch_sub(1, std::memory_order_relaxed);
+    }
+}
+
+static inline void shmem_wake(std::atomic<uint32_t> *word, std::atomic<uint32_t> *waiters) {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiters->load(std::memory_order_relaxed))
+        shmem_futex(word, FUTEX_WAKE, INT_MAX);
+}
+
+class ShmemRing {
+    public:
+        // open the named region, creating it if the switch hasn't yet
+        void open(const char * name, size_t slot_bytes);
+
+        // producer side
+        uint8_t * producer_acquire();
+        uint8_t * producer_try_acquire();
+        void producer_publish();
+
+        // consumer side
+        uint8_t * consumer_acquire();
+        uint8_t * consumer_try_acquire();
+        void consumer_release();
+
+        size_t region_bytes() { return SHMEM_RING_CTRL_BYTES + SHMEM_RING_SLOTS * _slot_bytes; }
+        // all the slots, contiguous, for registering with a DMA engine
+        uint8_t * slots() { return _base + SHMEM_RING_CTRL_BYTES; }
+        size_t slots_bytes() { return SHMEM_RING_SLOTS * _slot_bytes; }
+
+    private:
+        uint8_t * slot(uint32_t round) {
+            return _base + SHMEM_RING_CTRL_BYTES + (round % SHMEM_RING_SLOTS) * _slot_bytes;
+        }
+        shmem_ring_ctrl * _ctrl;
+        uint8_t * _base;
+        size_t _slot_bytes;
+        // local copies of our own index
+        uint32_t _head = 0;
+        uint32_t _tail = 0;
+};
+
+inline void ShmemRing::open(const char * name, size_t slot_bytes) {
+    _slot_bytes = (slot_bytes + SHMEM_RING_PAGE - 1) / SHMEM_RING_PAGE * SHMEM_RING_PAGE;
+    size_t nbytes = region_bytes();
+
+    printf("opening/creating shmem region\n%s\n", name);
+    int shmemfd = shm_open(name, O_RDWR | O_CREAT, S_IRWXU);
+    if (shmemfd == -1) {
+        perror("shm_open failed");
+        abort();
+    }
+    if (ftruncate(shmemfd, nbytes) == -1) {
+        perror("ftruncate failed");
+        abort();
+    }
+    _base = (uint8_t*)mmap(NULL, nbytes, PROT_READ | PROT_WRITE, MAP_SHARED, shmemfd, 0);
+    if (_base == MAP_FAILED) {
+        perror("mmap failed");
+        abort();
+    }
+    close(shmemfd);
+    // back the slots with huge pages where shmem THP allows it, so a DMA
+    // engine mapping them sees a few large pages instead of many small ones
+    madvise(_base, nbytes, MADV_HUGEPAGE);
+    _ctrl = (shmem_ring_ctrl*)_base;
+    shmem_ring_check(&_ctrl->layout, SHMEM_RING_LAYOUT, "layout", name);
+    shmem_ring_check(&_ctrl->slot_bytes, _slot_bytes, "slot size", name);
+}
+
+// returns the next free slot, waiting while the ring is full
+inline uint8_t * ShmemRing::producer_acquire() {
+    uint32_t tail;
+    while ((_head - (tail = _ctrl->tail.load(std::memory_order_acquire))) >= SHMEM_RING_SLOTS) {
+        shmem_wait_while_eq(&_ctrl->tail, tail, &_ctrl->tail_waiters);
+    }
+    return slot(_head);
+}
+
+// returns the next free slot, or NULL if the ring is full
+inline uint8_t * ShmemRing::producer_try_acquire() {
+    if (_head - _ctrl->tail.load(std::memory_order_acquire) >= SHMEM_RING_SLOTS)
+        return NULL;
+    return slot(_head);
+}
+
+inline void ShmemRing::producer_publish() {
+    _head++;
+    _ctrl->head.store(_head, std::memory_order_release);
+    shmem_wake(&_ctrl->head, &_ctrl->head_waiters);
+}
+
+// returns the oldest published slot, waiting while the ring is empty
+inline uint8_t * ShmemRing::consumer_acquire() {
+    while (_ctrl->head.load(std::memory_order_acquire) == _tail) {
+        shmem_wait_while_eq(&_ctrl->head, _tail, &_ctrl->head_waiters);
+    }
+    return slot(_tail);
+}
+
+// returns the oldest published slot, or NULL if the ring is empty
+inline uint8_t * ShmemRing::consumer_try_acquire() {
+    if (_ctrl->head.load(std::memory_order_acquire) == _tail)
+        return NULL;
+    return slot(_tail);
+}
+
+inline void ShmemRing::consumer_release() {
+    _tail++;
+    _ctrl->tail.store(_tail, std::memory_order_release);
+    shmem_wake(&_ctrl->tail, &_ctrl->tail_waiters);
+}
+
+#endif // __SHMEMRING_H
@@ -5,6 +5,8 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <math.h>
+#include <algorithm>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -12,34 +14,77 @@
 #include <unistd.h>
 
 #include <sys/mman.h>
+#include <time.h>
 
 // DO NOT MODIFY PARAMS BELOW THIS LINE
 #define TOKENS_PER_BIGTOKEN 7
 
 #define SIMLATENCY_BT (this->LINKLATENCY/TOKENS_PER_BIGTOKEN)
+// big tokens in one round exchanged with the switch
+#define ROUND_BT (SIMLATENCY_BT/this->pipeline_depth)
 
 #define BUFWIDTH (512/8)
-#define BUFBYTES (SIMLATENCY_BT*BUFWIDTH)
-#define EXTRABYTES 1
+#define BUFBYTES (ROUND_BT*BUFWIDTH)
 
 #define FLIT_BITS 64
 #define PACKET_MAX_FLITS 190
 #define BITTIME_PER_QUANTA 512
 #define CYCLES_PER_QUANTA (BITTIME_PER_QUANTA / FLIT_BITS)
 
-static void simplify_frac(int n, int d, int *nn, int *dd)
+// the rate limiter adds inc tokens (of a flit) every period cycles, up to
+// size; all three are 8 bit fields, period stored less one
+#define RLIMIT_MAX_INC 255
+#define RLIMIT_MAX_PERIOD 256
+#define RLIMIT_MAX_SIZE 255
+#define PAUSE_FIELD_MAX 0xffff
+
+/* the inc/period closest to frac (of full rate) the limiter can do */
+static void rate_frac(double frac, int *inc, int *period)
 {
-    int a = n, b = d;
+    double best = 2;
+    *inc = 1;
+    *period = RLIMIT_MAX_PERIOD;
+    for (int p = 1; p <= RLIMIT_MAX_PERIOD; p++) {
+        int i = std::min((int) (frac * p + 0.5), std::min(p, RLIMIT_MAX_INC));
+        if (i < 1)
+            continue;
+        double err = fabs((double) i / p - frac);
+        if (err < best) {
+            best = err;
+            *inc = i;
+            *period = p;
+        }
+    }
+}
 
-    // compute GCD
-    while (b > 0) {
-        int t = b;
-        b = a % b;
-        a = t;
+/* page-aligned, huge-page-advised buffer for DMA to/from the FPGA */
+static char * dma_alloc(size_t bytes)
+{
+    void * buf = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED) {
+        perror("mmap DMA buffer");
+        abort();
     }
+    madvise(buf, bytes, MADV_HUGEPAGE);
+    return (char *) buf;
+}
+
+#define ceil_div(n, d) (((n) - 1) / (d) + 1)
+
+// the valid bits of the 7 tokens in a big token's first word; each last
+// bit is two above its valid bit
+#define BT_VALID_MASK 0x2492480000000000UL
+#define BT_LAST_MASK (BT_VALID_MASK << 2)
+#define NET_IP_ALIGN 2
+#define TOKEN_COUNT_MASK ((1UL << 43) - 1)
+#define ETHTYPE_PAUSE 0x0888 // 0x8808, as it sits in the top of flit 1
 
-    *nn = n / a;
-    *dd = d / a;
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
 }
 
 #define niclog_printf(...) if (this->niclog) { fprintf(this->niclog, __VA_ARGS__); fflush(this->niclog); }
@@ -52,12 +97,19 @@ simplenic_t::simplenic_t(simif_t *sim, std::vector<std::string> &args,
 
     const char *niclogfile = NULL;
     const char *shmemportname = NULL;
-    int netbw = MAX_BANDWIDTH, netburst = 8;
+    double netbw = MAX_BANDWIDTH;
+    int netburst = 8;
 
     this->loopback = false;
     this->niclog = NULL;
     this->mac_lendian = 0;
     this->LINKLATENCY = 0;
+    this->pipeline_depth = 1;
+    int chunk_cycles = 0;
+    const char *peerspec = NULL;
+    const char *statsfile = NULL;
+    this->stats_interval = 1000000;
+    this->simplenicno = simplenicno;
     this->dma_addr = dma_addr;
 
 
@@ -69,8 +121,16 @@ simplenic_t::simplenic_t(simif_t *sim, std::vector<std::string> &args,
     std::string macaddr_arg = std::string("+macaddr") + num_equals;
     std::string netbw_arg = std::string("+netbw") + num_equals;
     std::string netburst_arg = std::string("+netburst") + num_equals;
+    std::string netbwschedule_arg = std::string("+netbw-schedule") + num_equals;
+    std::string pauseschedule_arg = std::string("+nicpause-schedule") + num_equals;
     std::string linklatency_arg = std::string("+linklatency") + num_equals;
     std::string shmemportname_arg = std::string("+shmemportname") + num_equals;
+    std::string nicpipeline_arg = std::string("+nicpipeline") + num_equals;
+    std::string nicchunk_arg = std::string("+nicchunk") + num_equals;
+    std::string nicpeer_arg = std::string("+nic-peer") + num_equals;
+    std::string nicstats_arg = std::string("+nicstats") + num_equals;
+    std::string nicverify_arg = std::string("+nic-verify") + std::to_string(simplenicno);
+    std::string nicstatsinterval_arg = std::string("+nicstats-interval") + num_equals;
 
 
     for (auto &arg: args) {
@@ -102,7 +162,13 @@ simplenic_t::simplenic_t(simif_t *sim, std::vector<std::string> &args,
         }
         if (arg.find(netbw_arg) == 0) {
             char *str = const_cast<char*>(arg.c_str()) + netbw_arg.length();
-            netbw = atoi(str);
+            netbw = atof(str);
+        }
+        if (arg.find(netbwschedule_arg) == 0) {
+            parse_schedule(arg.c_str() + netbwschedule_arg.length(), true);
+        }
+        if (arg.find(pauseschedule_arg) == 0) {
+            parse_schedule(arg.c_str() + pauseschedule_arg.length(), false);
         }
         if (arg.find(netburst_arg) == 0) {
             char *str = const_cast<char*>(arg.c_str()) + netburst_arg.length();
@@ -115,20 +181,66 @@ simplenic_t::simplenic_t(simif_t *sim, std::vector<std::string> &args,
         if (arg.find(shmemportname_arg) == 0) {
             shmemportname = const_cast<char*>(arg.c_str()) + shmemportname_arg.length();
         }
+        if (arg.find(nicpipeline_arg) == 0) {
+            char *str = const_cast<char*>(arg.c_str()) + nicpipeline_arg.length();
+            this->pipeline_depth = atoi(str);
+        }
+        if (arg.find(nicchunk_arg) == 0) {
+            char *str = const_cast<char*>(arg.c_str()) + nicchunk_arg.length();
+            chunk_cycles = atoi(str);
+        }
+        if (arg.find(nicpeer_arg) == 0) {
+            peerspec = const_cast<char*>(arg.c_str()) + nicpeer_arg.length();
+        }
+        if (arg == nicverify_arg) {
+            this->verify = true;
+        }
+        if (arg.find(nicstats_arg) == 0) {
+            statsfile = const_cast<char*>(arg.c_str()) + nicstats_arg.length();
+        }
+        if (arg.find(nicstatsinterval_arg) == 0) {
+            char *str = const_cast<char*>(arg.c_str()) + nicstatsinterval_arg.length();
+            this->stats_interval = strtoull(str, NULL, 10);
+        }
     }
 
     assert(this->LINKLATENCY > 0);
-    assert(netbw <= MAX_BANDWIDTH);
-    assert(netburst < 256);
-    simplify_frac(netbw, MAX_BANDWIDTH, &rlimit_inc, &rlimit_period);
-    rlimit_size = netburst;
+    if (peerspec) {
+        // a local peer takes the switch's place, over the loopback buffers
+        this->peer = make_nic_peer(peerspec, this->mac_lendian, this->LINKLATENCY);
+        this->loopback = true;
+        printf("using local peer: %s\n", peerspec);
+    }
+    if (this->pipeline_depth < 1 ||
+            this->LINKLATENCY % (TOKENS_PER_BIGTOKEN * this->pipeline_depth) != 0) {
+        fprintf(stderr, "+nicpipeline%d=%d: link latency %d must split into that many rounds of a multiple of %d cycles\n",
+                simplenicno, this->pipeline_depth, this->LINKLATENCY, TOKENS_PER_BIGTOKEN);
+        abort();
+    }
+    // smallest DMA worth doing, in big tokens. default: whole rounds only
+    chunk_bt = ROUND_BT;
+    if (chunk_cycles > 0)
+        chunk_bt = std::min(ceil_div(chunk_cycles, TOKENS_PER_BIGTOKEN), ROUND_BT);
+    check_rate(netbw, netburst);
+    rate_frac(netbw / MAX_BANDWIDTH, &rlimit_inc, &rlimit_period);
+    rlimit_size = std::max(netburst, rlimit_inc);
     pause_threshold = PACKET_MAX_FLITS + this->LINKLATENCY;
     pause_quanta = pause_threshold / CYCLES_PER_QUANTA;
     pause_refresh = this->LINKLATENCY;
+    check_pause(pause_threshold, pause_quanta, pause_refresh);
+    std::stable_sort(schedule.begin(), schedule.end(),
+            [](const schedule_entry &a, const schedule_entry &b) { return a.cycle < b.cycle; });
 
     printf("using link latency: %d cycles\n", this->LINKLATENCY);
-    printf("using netbw: %d\n", netbw);
-    printf("using netburst: %d\n", netburst);
+    printf("using netbw: %g (%d/%d of %d)\n", netbw, rlimit_inc, rlimit_period, MAX_BANDWIDTH);
+    printf("using netburst: %d\n", rlimit_size);
+    if (!schedule.empty())
+        printf("%zu rate/pause changes scheduled\n", schedule.size());
+    printf("using %d rounds of %d cycles per link latency\n", this->pipeline_depth,
+            this->LINKLATENCY / this->pipeline_depth);
+    if (chunk_bt < ROUND_BT)
+        printf("moving rounds in chunks of at least %d cycles\n",
+                chunk_bt * TOKENS_PER_BIGTOKEN);
 
     if (niclogfile) {
         this->niclog = fopen(niclogfile, "w");
@@ -138,52 +250,162 @@ simplenic_t::simplenic_t(simif_t *sim, std::vector<std::string> &args,
         }
     }
 
+#ifdef TOKENVERIFY
+    this->verify = true;
+#endif
+    if (this->verify)
+        printf("verifying token counts from the FPGA\n");
+
+    if (statsfile) {
+        this->stats_file = fopen(statsfile, "w");
+        if (!this->stats_file) {
+            fprintf(stderr, "Could not open NIC stats file: %s\n", statsfile);
+            abort();
+        }
+        fprintf(this->stats_file, "cycle,tx_frames,tx_bytes,tx_pause_frames,"
+                "rx_frames,rx_bytes,rx_pause_frames,rounds,pull_us,wait_us,push_us\n");
+        if (this->stats_interval == 0)
+            this->stats_interval = 1000000;
+        this->stats_next_cycle = this->stats_interval;
+    }
+
     char name[257];
-    int shmemfd;
 
     if (!loopback) {
         assert(shmemportname != NULL);
-        for (int j = 0; j < 2; j++) {
-            printf("Using non-slot-id associated shmemportname:\n");
-            sprintf(name, "/port_nts%s_%d", shmemportname, j);
-
-            printf("opening/creating shmem region\n%s\n", name);
-            shmemfd = shm_open(name, O_RDWR | O_CREAT , S_IRWXU);
-            ftruncate(shmemfd, BUFBYTES+EXTRABYTES);
-            pcis_read_bufs[j] = (char*)mmap(NULL, BUFBYTES+EXTRABYTES, PROT_READ | PROT_WRITE, MAP_SHARED, shmemfd, 0);
-
-            printf("Using non-slot-id associated shmemportname:\n");
-            sprintf(name, "/port_stn%s_%d", shmemportname, j);
-
-            printf("opening/creating shmem region\n%s\n", name);
-            shmemfd = shm_open(name, O_RDWR | O_CREAT , S_IRWXU);
-            ftruncate(shmemfd, BUFBYTES+EXTRABYTES);
-            pcis_write_bufs[j] = (char*)mmap(NULL, BUFBYTES+EXTRABYTES, PROT_READ | PROT_WRITE, MAP_SHARED, shmemfd, 0);
-        }
+        printf("Using non-slot-id associated shmemportname:\n");
+        sprintf(name, "/port_nts%s", shmemportname);
+        nic_to_switch.open(name, BUFBYTES);
+
+        printf("Using non-slot-id associated shmemportname:\n");
+        sprintf(name, "/port_stn%s", shmemportname);
+        switch_to_nic.open(name, BUFBYTES);
     } else {
-        for (int j = 0; j < 2; j++) {
-            pcis_read_bufs[j] = (char *) malloc(BUFBYTES + EXTRABYTES);
-            pcis_write_bufs[j] = pcis_read_bufs[j];
-        }
+        loopback_buf = dma_alloc(BUFBYTES * this->pipeline_depth);
+    }
+    // zeroed by mmap; the first link latency of input to the FPGA
+    empty_round = dma_alloc(BUFWIDTH * SIMLATENCY_BT);
+
+    // every round is pulled into / pushed from one of these, so register
+    // them once and let the DMA engine use them in place
+    bool zero_copy = sim->dma_register(empty_round, BUFWIDTH * SIMLATENCY_BT);
+    if (loopback) {
+        zero_copy &= sim->dma_register(loopback_buf, BUFBYTES * this->pipeline_depth);
+    } else {
+        zero_copy &= sim->dma_register((char *) nic_to_switch.slots(), nic_to_switch.slots_bytes());
+        zero_copy &= sim->dma_register((char *) switch_to_nic.slots(), switch_to_nic.slots_bytes());
     }
+    printf("NIC DMA: %s\n", zero_copy ? "zero-copy into registered buffers"
+            : "through the host backend's copy");
 }
 
 simplenic_t::~simplenic_t() {
     if (this->niclog)
         fclose(this->niclog);
-    if (loopback) {
-        for (int j = 0; j < 2; j++)
-            free(pcis_read_bufs[j]);
-    } else {
-        for (int j = 0; j < 2; j++) {
-            munmap(pcis_read_bufs[j], BUFBYTES+EXTRABYTES);
-            munmap(pcis_write_bufs[j], BUFBYTES+EXTRABYTES);
+    if (loopback)
+        munmap(loopback_buf, BUFBYTES * this->pipeline_depth);
+    delete peer;
+    if (this->stats_file)
+        fclose(this->stats_file);
+    munmap(empty_round, BUFWIDTH * SIMLATENCY_BT);
+    free(this->mmio_addrs);
+}
+
+void simplenic_t::check_rate(double gbps, int burst) {
+    double min_gbps = (double) MAX_BANDWIDTH / RLIMIT_MAX_PERIOD;
+    if (!(gbps >= min_gbps && gbps <= MAX_BANDWIDTH) || burst < 1 || burst > RLIMIT_MAX_SIZE) {
+        fprintf(stderr, "NIC %d: bandwidth %g must be in [%g, %d] Gbps and burst %d in [1, %d]\n",
+                simplenicno, gbps, min_gbps, MAX_BANDWIDTH, burst, RLIMIT_MAX_SIZE);
+        abort();
+    }
+}
+
+void simplenic_t::check_pause(int threshold, int quanta, int refresh) {
+    if (threshold < 0 || threshold > PAUSE_FIELD_MAX || quanta < 0 || quanta > PAUSE_FIELD_MAX ||
+            refresh < 0 || refresh > PAUSE_FIELD_MAX) {
+        fprintf(stderr, "NIC %d: pause threshold %d, quanta %d, refresh %d must each fit in 16 bits\n",
+                simplenicno, threshold, quanta, refresh);
+        abort();
+    }
+}
+
+/* CYCLE:GBPS[/BURST],... for rates, CYCLE:THRESHOLD/QUANTA/REFRESH,...
+ * for pause settings */
+void simplenic_t::parse_schedule(const char *spec, bool rate) {
+    std::string list(spec);
+    size_t pos = 0;
+    while (pos < list.size()) {
+        size_t end = list.find(',', pos);
+        if (end == std::string::npos)
+            end = list.size();
+        std::string item = list.substr(pos, end - pos);
+        pos = end + 1;
+
+        schedule_entry e = {};
+        e.rate = rate;
+        e.burst = -1;
+        unsigned long long cycle;
+        int n;
+        if (rate)
+            n = sscanf(item.c_str(), "%llu:%lf/%d", &cycle, &e.gbps, &e.burst);
+        else
+            n = sscanf(item.c_str(), "%llu:%d/%d/%d", &cycle, &e.threshold, &e.quanta, &e.refresh);
+        if (rate ? n < 2 : n != 4) {
+            fprintf(stderr, "NIC %d: bad %s schedule entry '%s'\n", simplenicno,
+                    rate ? "bandwidth" : "pause", item.c_str());
+            abort();
         }
+        e.cycle = cycle;
+        if (rate)
+            check_rate(e.gbps, e.burst < 0 ? 1 : e.burst);
+        else
+            check_pause(e.threshold, e.quanta, e.refresh);
+        schedule.push_back(e);
     }
-    free(this->mmio_addrs);
 }
 
-#define ceil_div(n, d) (((n) - 1) / (d) + 1)
+/* set the rate limiter to the closest it can get to gbps; a burst of -1
+ * keeps the current one */
+void simplenic_t::set_rate(double gbps, int burst) {
+    if (burst < 0)
+        burst = rlimit_size;
+    check_rate(gbps, burst);
+    rate_frac(gbps / MAX_BANDWIDTH, &rlimit_inc, &rlimit_period);
+    // a bucket smaller than inc would cap the rate below inc/period
+    rlimit_size = std::max(burst, rlimit_inc);
+    write(mmio_addrs->rlimit_settings,
+            (rlimit_inc << 16) | ((rlimit_period - 1) << 8) | rlimit_size);
+}
+
+void simplenic_t::set_pause(int threshold, int quanta, int refresh) {
+    check_pause(threshold, quanta, refresh);
+    pause_threshold = threshold;
+    pause_quanta = quanta;
+    pause_refresh = refresh;
+    write(mmio_addrs->pause_threshold, pause_threshold);
+    write(mmio_addrs->pause_times,
+            (pause_refresh << 16) | (pause_quanta & 0xffff));
+}
+
+/* apply the scheduled changes due now; returns the cycles to the next */
+uint64_t simplenic_t::run_schedule() {
+    uint64_t now = schedule[schedule_next].cycle;
+    for (; schedule_next < schedule.size() && schedule[schedule_next].cycle == now; schedule_next++) {
+        schedule_entry &e = schedule[schedule_next];
+        if (e.rate) {
+            set_rate(e.gbps, e.burst);
+            fprintf(stderr, "NIC %d: cycle %lu: netbw %g (%d/%d), burst %d\n", simplenicno,
+                    now, e.gbps, rlimit_inc, rlimit_period, rlimit_size);
+        } else {
+            set_pause(e.threshold, e.quanta, e.refresh);
+            fprintf(stderr, "NIC %d: cycle %lu: pause threshold %d quanta %d refresh %d\n",
+                    simplenicno, now, e.threshold, e.quanta, e.refresh);
+        }
+    }
+    if (schedule_next == schedule.size())
+        return UINT64_MAX - now; // never again
+    return schedule[schedule_next].cycle - now;
+}
 
 void simplenic_t::init() {
     write(mmio_addrs->macaddr_upper, (mac_lendian >> 32) & 0xFFFF);
@@ -202,11 +424,14 @@ void simplenic_t::init() {
     }
 
     printf("On init, %d token slots available on input.\n", input_token_capacity);
+    // the first link latency worth of input (pipeline_depth rounds) is empty
     uint32_t token_bytes_produced = 0;
     token_bytes_produced = push(
             dma_addr,
-            pcis_write_bufs[1],
+            empty_round,
             BUFWIDTH*input_token_capacity);
+    if (!loopback)
+        empty_rounds_left = pipeline_depth - 1;
     if (token_bytes_produced != input_token_capacity*BUFWIDTH) {
         printf("ERR MISMATCH!\n");
         exit(1);
@@ -215,126 +440,384 @@ void simplenic_t::init() {
 }
 
 //#define TOKENVERIFY
+//#define DEBUG_NIC_PRINT
+
+// an SSE2 register's worth of 64-bit lanes
+typedef uint64_t u64x2 __attribute__((vector_size(16)));
+
+/* the widget tags each big token it sends with a 43 bit count in the pad
+ * below the valid/last bits. check ntokens of them continue the count,
+ * with one branch-free vector pass over the chunk (the low bits of the
+ * differences all OR to zero); only on a mismatch find and report the
+ * first divergence, and fail the simulation */
+void simplenic_t::verify_tokens(const char *buf, int ntokens) {
+    const uint64_t *bt = (const uint64_t *) buf;
+    uint64_t expect = next_token_from_fpga;
+    // a big token's count is in its first word, so each vector takes two
+    // big tokens' counts and subtracts what they should be; two of them,
+    // so the loads aren't serialized on one OR chain
+    u64x2 expect0 = { expect, expect + 1 }, expect1 = { expect + 2, expect + 3 };
+    u64x2 bad0 = { 0, 0 }, bad1 = { 0, 0 };
+    int i = 0;
+    for (; i + 4 <= ntokens; i += 4) {
+        u64x2 counts0 = { bt[i * 8], bt[i * 8 + 8] };
+        u64x2 counts1 = { bt[i * 8 + 16], bt[i * 8 + 24] };
+        bad0 |= counts0 - expect0;
+        bad1 |= counts1 - expect1;
+        expect0 += 4;
+        expect1 += 4;
+    }
+    bad0 |= bad1;
+    uint64_t bad = bad0[0] | bad0[1];
+    for (; i < ntokens; i++)
+        bad |= bt[i * 8] - (expect + i);
+    bad &= TOKEN_COUNT_MASK;
+
+    if (bad && !verify_failed) {
+        i = 0;
+        while (((bt[i * 8] - (next_token_from_fpga + i)) & TOKEN_COUNT_MASK) == 0)
+            i++;
+        fprintf(stderr, "NIC %d: token lost on FPGA interface: round %ld big token %d "
+                "has count %ld, expected %ld\n", simplenicno, rounds_pulled,
+                pull_cursor + i, bt[i * 8] & TOKEN_COUNT_MASK,
+                (next_token_from_fpga + i) & TOKEN_COUNT_MASK);
+        niclog_printf("FAIL! Token lost on FPGA interface.\n");
+        verify_failed = true;
+    }
+    next_token_from_fpga += ntokens;
+}
 
-void simplenic_t::tick() {
-    struct timespec tstart, tend;
-
-    //#define DEBUG_NIC_PRINT
-
-    while (true) { // break when we don't have 5k tokens
-        uint32_t tokens_this_round = 0;
-
-        uint32_t output_tokens_available = read(mmio_addrs->outgoing_count);
-        uint32_t input_token_capacity = SIMLATENCY_BT - read(mmio_addrs->incoming_count);
-
-        // we will read/write the min of tokens available / token input capacity
-        tokens_this_round = std::min(output_tokens_available, input_token_capacity);
-#ifdef DEBUG_NIC_PRINT
-        niclog_printf("tokens this round: %d\n", tokens_this_round);
-#endif
-
-        if (tokens_this_round != SIMLATENCY_BT) {
-#ifdef DEBUG_NIC_PRINT
-            niclog_printf("FAIL: output available %d, input capacity: %d\n", output_tokens_available, input_token_capacity);
-#endif
-            return;
+/* pull what the FPGA has produced into the round being filled, at least
+ * chunk_bt big tokens (or the rest of the round) at a time, and hand the
+ * round to the switch once it's full. output_tokens_available is what the
+ * FPGA last reported, less what's been pulled since. returns whether it
+ * moved anything */
+bool simplenic_t::pull_tokens(int &output_tokens_available) {
+    int want = ROUND_BT - pull_cursor;
+    int ntokens = std::min(output_tokens_available, want);
+    if (ntokens < std::min(chunk_bt, want))
+        return false;
+
+    if (!pull_buf) {
+        if (loopback) {
+            // can't happen: the FPGA can't get more than a link latency ahead
+            if (rounds_pulled - rounds_pushed == (uint64_t)pipeline_depth)
+                return false;
+            pull_buf = loopback_buf + (rounds_pulled % pipeline_depth) * BUFBYTES;
+        } else {
+            // full only if the switch is SHMEM_RING_SLOTS rounds behind
+            pull_buf = (char *) nic_to_switch.producer_try_acquire();
+            if (!pull_buf)
+                return false;
         }
+    }
+    char * read_buf = pull_buf + pull_cursor * BUFWIDTH;
 
-        // read into read_buffer
 #ifdef DEBUG_NIC_PRINT
-        iter++;
-        niclog_printf("read fpga iter %ld\n", iter);
+    niclog_printf("read fpga round %ld tokens %d-%d\n", rounds_pulled,
+            pull_cursor, pull_cursor + ntokens);
 #endif
-        uint32_t token_bytes_obtained_from_fpga = 0;
-        token_bytes_obtained_from_fpga = pull(
-                dma_addr,
-                pcis_read_bufs[currentround],
-                BUFWIDTH * tokens_this_round);
-#ifdef DEBUG_NIC_PRINT
-        niclog_printf("send iter %ld\n", iter);
-#endif
-
-        pcis_read_bufs[currentround][BUFBYTES] = 1;
+    uint64_t start_ns = now_ns();
+    uint32_t token_bytes_obtained_from_fpga = 0;
+    token_bytes_obtained_from_fpga = pull(
+            dma_addr,
+            read_buf,
+            BUFWIDTH * ntokens);
+    scan_tokens(read_buf, ntokens, tx_frame_flit,
+            stats.tx_frames, stats.tx_bytes, stats.tx_pause_frames);
+    stats.pull_ns += now_ns() - start_ns;
 
 #ifdef TOKENVERIFY
-        // the widget is designed to tag tokens with a 43 bit number,
-        // incrementing for each sent token. verify that we are not losing
-        // tokens over PCIS
-        for (int i = 0; i < tokens_this_round; i++) {
-            uint64_t TOKENLRV_AND_COUNT = *(((uint64_t*)pcis_read_bufs[currentround])+i*8);
-            uint8_t LAST;
-            for (int token_in_bigtoken = 0; token_in_bigtoken < 7; token_in_bigtoken++) {
-                if (TOKENLRV_AND_COUNT & (1L << (43+token_in_bigtoken*3))) {
-                    LAST = (TOKENLRV_AND_COUNT >> (45 + token_in_bigtoken*3)) & 0x1;
-                    niclog_printf("sending to other node, valid data chunk: "
-                                "%016lx, last %x, sendcycle: %016ld\n",
-                                *((((uint64_t*)pcis_read_bufs[currentround])+i*8)+1+token_in_bigtoken),
-                                LAST, timeelapsed_cycles + i*7 + token_in_bigtoken);
-                }
-            }
-
-            //            *((uint64_t*)(pcis_read_buf + i*64)) |= 0x4924900000000000;
-            uint32_t thistoken = *((uint32_t*)(pcis_read_bufs[currentround] + i*64));
-            if (thistoken != next_token_from_fpga) {
-                niclog_printf("FAIL! Token lost on FPGA interface.\n");
-                exit(1);
+    for (int i = 0; i < ntokens; i++) {
+        uint64_t TOKENLRV_AND_COUNT = *(((uint64_t*)read_buf)+i*8);
+        uint8_t LAST;
+        for (int token_in_bigtoken = 0; token_in_bigtoken < 7; token_in_bigtoken++) {
+            if (TOKENLRV_AND_COUNT & (1L << (43+token_in_bigtoken*3))) {
+                LAST = (TOKENLRV_AND_COUNT >> (45 + token_in_bigtoken*3)) & 0x1;
+                niclog_printf("sending to other node, valid data chunk: "
+                            "%016lx, last %x, sendcycle: %016ld\n",
+                            *((((uint64_t*)read_buf)+i*8)+1+token_in_bigtoken),
+                            LAST, timeelapsed_cycles + (pull_cursor + i)*7 + token_in_bigtoken);
             }
-            next_token_from_fpga++;
-        }
-#endif
-        if (token_bytes_obtained_from_fpga != tokens_this_round * BUFWIDTH) {
-            printf("ERR MISMATCH! on reading tokens out. actually read %d bytes, wanted %d bytes.\n", token_bytes_obtained_from_fpga, BUFWIDTH * tokens_this_round);
-            printf("errno: %s\n", strerror(errno));
-            exit(1);
         }
 
-#ifdef DEBUG_NIC_PRINT
-        niclog_printf("recv iter %ld\n", iter);
+    }
 #endif
+    if (token_bytes_obtained_from_fpga != ntokens * BUFWIDTH) {
+        printf("ERR MISMATCH! on reading tokens out. actually read %d bytes, wanted %d bytes.\n", token_bytes_obtained_from_fpga, BUFWIDTH * ntokens);
+        printf("errno: %s\n", strerror(errno));
+        exit(1);
+    }
+    if (verify)
+        verify_tokens(read_buf, ntokens);
+
+    output_tokens_available -= ntokens;
+    pull_cursor += ntokens;
+    if (pull_cursor == ROUND_BT) {
+        if (peer)
+            peer->receive_round((uint64_t *) pull_buf, ROUND_BT,
+                    rounds_pulled * ROUND_BT * TOKENS_PER_BIGTOKEN);
+        if (!loopback)
+            nic_to_switch.producer_publish();
+        rounds_pulled++;
+        stats.rounds = rounds_pulled;
+        if (stats_file && rounds_pulled * ROUND_BT * TOKENS_PER_BIGTOKEN >= stats_next_cycle) {
+            dump_stats(rounds_pulled * ROUND_BT * TOKENS_PER_BIGTOKEN);
+            stats_next_cycle += stats_interval;
+        }
 
+        midas_time_t now = timestamp();
+        if (rounds_pulled > 1) {
+            midas_time_t round_time = now - last_round_time;
+            round_time_sum += round_time;
+            round_time_max = std::max(round_time_max, round_time);
+            niclog_printf("round %ld: %ld us\n", rounds_pulled - 1, round_time);
+        }
+        last_round_time = now;
+        pull_buf = NULL;
+        pull_cursor = 0;
 #ifdef TOKENVERIFY
-        timeelapsed_cycles += LINKLATENCY;
+        timeelapsed_cycles += LINKLATENCY / pipeline_depth;
 #endif
+    }
+    return true;
+}
 
-        if (!loopback) {
-            volatile uint8_t * polladdr = (uint8_t*)(pcis_write_bufs[currentround] + BUFBYTES);
-            while (*polladdr == 0) { ; }
+/* push as much of the round the switch returned as the FPGA has room for,
+ * at least chunk_bt big tokens (or the rest of the round) at a time, and
+ * release the round once it's all in. input_token_capacity is kept up to
+ * date like output_tokens_available above. returns whether it moved
+ * anything */
+bool simplenic_t::push_tokens(int &input_token_capacity) {
+    int want = ROUND_BT - push_cursor;
+    int ntokens = std::min(input_token_capacity, want);
+    if (ntokens < std::min(chunk_bt, want))
+        return false;
+
+    if (!push_buf) {
+        push_from_switch = false;
+        if (loopback) {
+            if (rounds_pushed == rounds_pulled)
+                return false;
+            push_buf = loopback_buf + (rounds_pushed % pipeline_depth) * BUFBYTES;
+            // the first pipeline_depth rounds went in on init
+            if (peer)
+                peer->send_round((uint64_t *) push_buf, ROUND_BT,
+                        (rounds_pushed + pipeline_depth) * ROUND_BT * TOKENS_PER_BIGTOKEN);
+        } else if (empty_rounds_left) {
+            push_buf = empty_round;
+            empty_rounds_left--;
+        } else {
+            push_from_switch = true;
+            push_buf = (char *) switch_to_nic.consumer_try_acquire();
+            if (!push_buf) {
+                push_waiting = true;
+                if (!wait_start_ns)
+                    wait_start_ns = now_ns();
+                return false;
+            }
+            if (wait_start_ns) {
+                stats.wait_ns += now_ns() - wait_start_ns;
+                wait_start_ns = 0;
+            }
         }
+    }
+    char * write_buf = push_buf + push_cursor * BUFWIDTH;
+
 #ifdef DEBUG_NIC_PRINT
-        niclog_printf("done recv iter %ld\n", iter);
+    niclog_printf("push fpga round %ld tokens %d-%d\n", rounds_pushed,
+            push_cursor, push_cursor + ntokens);
 #endif
 
 #ifdef TOKENVERIFY
-        // this does not do tokenverify - it's just printing tokens
-        // there should not be tokenverify on this interface
-        for (int i = 0; i < tokens_this_round; i++) {
-            uint64_t TOKENLRV_AND_COUNT = *(((uint64_t*)pcis_write_bufs[currentround])+i*8);
-            uint8_t LAST;
-            for (int token_in_bigtoken = 0; token_in_bigtoken < 7; token_in_bigtoken++) {
-                if (TOKENLRV_AND_COUNT & (1L << (43+token_in_bigtoken*3))) {
-                    LAST = (TOKENLRV_AND_COUNT >> (45 + token_in_bigtoken*3)) & 0x1;
-                    niclog_printf("from other node, valid data chunk: %016lx, "
-                                "last %x, recvcycle: %016ld\n",
-                                *((((uint64_t*)pcis_write_bufs[currentround])+i*8)+1+token_in_bigtoken),
-                                LAST, timeelapsed_cycles + i*7 + token_in_bigtoken);
-                }
+    // this does not do tokenverify - it's just printing tokens
+    // there should not be tokenverify on this interface
+    for (int i = 0; i < ntokens; i++) {
+        uint64_t TOKENLRV_AND_COUNT = *(((uint64_t*)write_buf)+i*8);
+        uint8_t LAST;
+        for (int token_in_bigtoken = 0; token_in_bigtoken < 7; token_in_bigtoken++) {
+            if (TOKENLRV_AND_COUNT & (1L << (43+token_in_bigtoken*3))) {
+                LAST = (TOKENLRV_AND_COUNT >> (45 + token_in_bigtoken*3)) & 0x1;
+                niclog_printf("from other node, valid data chunk: %016lx, "
+                            "last %x, recvcycle: %016ld\n",
+                            *((((uint64_t*)write_buf)+i*8)+1+token_in_bigtoken),
+                            LAST, timeelapsed_cycles + (push_cursor + i)*7 + token_in_bigtoken);
             }
         }
+    }
 #endif
-        uint32_t token_bytes_sent_to_fpga = 0;
-        token_bytes_sent_to_fpga = push(
-                dma_addr,
-                pcis_write_bufs[currentround],
-                BUFWIDTH * tokens_this_round);
-        pcis_write_bufs[currentround][BUFBYTES] = 0;
-        if (token_bytes_sent_to_fpga != tokens_this_round * BUFWIDTH) {
-            printf("ERR MISMATCH! on writing tokens in. actually wrote in %d bytes, wanted %d bytes.\n", token_bytes_sent_to_fpga, BUFWIDTH * tokens_this_round);
-            printf("errno: %s\n", strerror(errno));
-            exit(1);
+    uint64_t start_ns = now_ns();
+    scan_tokens(write_buf, ntokens, rx_frame_flit,
+            stats.rx_frames, stats.rx_bytes, stats.rx_pause_frames);
+    uint32_t token_bytes_sent_to_fpga = 0;
+    token_bytes_sent_to_fpga = push(
+            dma_addr,
+            write_buf,
+            BUFWIDTH * ntokens);
+    stats.push_ns += now_ns() - start_ns;
+    if (token_bytes_sent_to_fpga != ntokens * BUFWIDTH) {
+        printf("ERR MISMATCH! on writing tokens in. actually wrote in %d bytes, wanted %d bytes.\n", token_bytes_sent_to_fpga, BUFWIDTH * ntokens);
+        printf("errno: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    input_token_capacity -= ntokens;
+    push_cursor += ntokens;
+    if (push_cursor == ROUND_BT) {
+        if (push_from_switch)
+            switch_to_nic.consumer_release();
+        rounds_pushed++;
+        push_buf = NULL;
+        push_cursor = 0;
+    }
+    return true;
+}
+
+/* move tokens in both directions until neither can go, given the FPGA's
+ * token counts. never waits: a round the switch hasn't returned yet is
+ * picked up on a later tick, and the other bridges get serviced in
+ * between. returns whether anything moved */
+bool simplenic_t::service(uint32_t outgoing_count, uint32_t incoming_count) {
+    int output_tokens_available = outgoing_count;
+    int input_token_capacity = SIMLATENCY_BT - incoming_count;
+    bool progress = false;
+    push_waiting = false;
+    while (true) {
+        // push first, so the FPGA can get going on the next round while
+        // the last one is pulled
+        bool pushed = push_tokens(input_token_capacity);
+        bool pulled = pull_tokens(output_tokens_available);
+        if (!pushed && !pulled)
+            break;
+        progress = true;
+    }
+    // the FPGA has run out of input, so it won't produce any more output
+    // either, until the switch returns a round
+    waiting_on_switch = push_waiting && input_token_capacity == SIMLATENCY_BT;
+    return progress;
+}
+
+/* count the frames in ntokens big tokens from the valid and last bits, and
+ * look at the ethertype flit of each for pause frames. frame_flit carries
+ * the position in a frame over from the last call */
+void simplenic_t::scan_tokens(const char *buf, int ntokens, int &frame_flit,
+        uint64_t &frames, uint64_t &bytes, uint64_t &pause_frames) {
+    const uint64_t *bt = (const uint64_t *) buf;
+    for (int i = 0; i < ntokens; i++, bt += 8) {
+        uint64_t valid = bt[0] & BT_VALID_MASK;
+        if (!valid)
+            continue;
+        int nlast = __builtin_popcountl(bt[0] & BT_LAST_MASK);
+        frames += nlast;
+        bytes += __builtin_popcountl(valid) * sizeof(uint64_t) - nlast * NET_IP_ALIGN;
+        while (valid) {
+            int bit = __builtin_ctzl(valid);
+            int token = (bit - 43) / 3;
+            if (frame_flit == 1 && (bt[token + 1] >> 48) == ETHTYPE_PAUSE)
+                pause_frames++;
+            frame_flit = ((bt[0] >> (bit + 2)) & 1) ? 0 : frame_flit + 1;
+            valid &= valid - 1;
+        }
+    }
+}
+
+void simplenic_t::dump_stats(uint64_t cycle) {
+    fprintf(stats_file, "%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu\n", cycle,
+            stats.tx_frames, stats.tx_bytes, stats.tx_pause_frames,
+            stats.rx_frames, stats.rx_bytes, stats.rx_pause_frames, stats.rounds,
+            stats.pull_ns / 1000, stats.wait_ns / 1000, stats.push_ns / 1000);
+    fflush(stats_file);
+}
+
+void simplenic_t::finish() {
+    if (stats_file)
+        dump_stats(rounds_pulled * ROUND_BT * TOKENS_PER_BIGTOKEN);
+    if (rounds_pulled > 1) {
+        fprintf(stderr, "NIC %d: %ld rounds, host time per round mean %.1f us max %ld us\n",
+                simplenicno, rounds_pulled, (double) round_time_sum / (rounds_pulled - 1),
+                round_time_max);
+    }
+    if (peer)
+        peer->report(stderr, simplenicno, rounds_pulled * ROUND_BT * TOKENS_PER_BIGTOKEN);
+}
+
+void simplenic_t::tick() {
+    while (service(read(mmio_addrs->outgoing_count), read(mmio_addrs->incoming_count)));
+}
+
+/* whether the switch has returned a round this NIC was waiting for. just a
+ * load from shared memory */
+bool simplenic_t::switch_moved() {
+    return switch_to_nic.consumer_try_acquire() != NULL;
+}
+
+void simplenic_poller_t::init() {
+    for (auto &nic: nics)
+        nic->init();
+}
+
+void simplenic_poller_t::tick() {
+    std::vector<uint32_t> counts(2 * nics.size());
+    while (true) {
+        // all the MMIO up front, back to back, then the DMA
+        for (size_t i = 0; i < nics.size(); i++) {
+            counts[2*i] = nics[i]->read(nics[i]->mmio_addrs->outgoing_count);
+            counts[2*i+1] = nics[i]->read(nics[i]->mmio_addrs->incoming_count);
+        }
+        bool progress = false;
+        bool all_waiting = true;
+        for (size_t i = 0; i < nics.size(); i++) {
+            progress |= nics[i]->service(counts[2*i], counts[2*i+1]);
+            all_waiting &= nics[i]->waiting_on_switch;
         }
+        if (progress)
+            continue;
+        if (!all_waiting)
+            return;
+
+        // every NIC is held up by its switch: watch all their rings at
+        // once, for a bounded while, instead of going back to MMIO
+        for (int spin = 0; spin < NIC_POLLER_SPIN_ITERS; spin++) {
+            for (auto &nic: nics) {
+                if (nic->switch_moved())
+                    goto next;
+            }
+            shmem_cpu_relax();
+        }
+        return;
+next:;
+    }
+}
 
-        currentround = (currentround + 1) % 2;
+bool simplenic_poller_t::terminate() {
+    for (auto &nic: nics) {
+        if (nic->terminate())
+            return true;
     }
+    return false;
+}
+
+int simplenic_poller_t::exit_code() {
+    for (auto &nic: nics) {
+        if (nic->exit_code())
+            return nic->exit_code();
+    }
+    return 0;
+}
+
+void simplenic_poller_t::register_schedules(
+        std::function<void(std::function<uint64_t()>, uint64_t)> register_task) {
+    for (auto &nic: nics) {
+        if (nic->schedule.empty())
+            continue;
+        simplenic_t *n = nic.get();
+        register_task([n]() { return n->run_schedule(); }, n->schedule[0].cycle);
+    }
+}
+
+void simplenic_poller_t::finish() {
+    for (auto &nic: nics)
+        nic->finish();
 }
 
 #endif // #ifdef SIMPLENICBRIDGEMODULE_struct_guard
@@ -4,12 +4,68 @@
 #define __SIMPLENIC_H
 
 #include "bridges/bridge_driver.h"
+#include "bridges/shmemring.h"
+#include "bridges/nicpeer.h"
+#include <functional>
+#include <memory>
 #include <vector>
 
+// pauses the NIC poller spins on the switch rings before going back to
+// the main loop
+#define NIC_POLLER_SPIN_ITERS 1024
+
 // TODO this should not be hardcoded here.
 #define MAX_BANDWIDTH 200
 
 #ifdef SIMPLENICBRIDGEMODULE_struct_guard
+/* Cumulative traffic and host time counters of one NIC. tx is FPGA to
+ * network, rx network to FPGA. Times are host ns spent pulling from the
+ * FPGA, waiting on the switch (or peer) for a round, and pushing to the
+ * FPGA. */
+struct nic_stats {
+    uint64_t tx_frames = 0, tx_bytes = 0, tx_pause_frames = 0;
+    uint64_t rx_frames = 0, rx_bytes = 0, rx_pause_frames = 0;
+    uint64_t rounds = 0;
+    uint64_t pull_ns = 0, wait_ns = 0, push_ns = 0;
+};
+
+/* Driver for the SimpleNIC bridge: moves rounds of big tokens between the
+ * FPGA and the switch model (or back into the NIC, in loopback mode).
+ *
+ * The link latency is split into pipeline_depth rounds (+nicpipelineN=D,
+ * default 1), and that many empty rounds are pushed on init, so the FPGA
+ * sees the same latency but can run D-1 rounds ahead of the switch. The
+ * switch starts its side of the link with one empty round; D-1 more are
+ * pushed ahead of it, so the round trip is still two link latencies. Each
+ * tick pulls whatever whole rounds the FPGA has produced and pushes
+ * whatever rounds the switch has returned, without waiting on either, so
+ * round N+1 can be pulled while round N is still at the switch. The
+ * switch port for this NIC must use the same round size, i.e. be given
+ * latency=LINKLATENCY/D. Depths beyond SHMEM_RING_SLOTS don't help.
+ *
+ * With +nicchunkN=C (cycles), a round is moved in pieces of at least C
+ * cycles as the FPGA produces output or frees input space, rather than
+ * waiting for a whole round of either.
+ *
+ * +nic-peerN= connects the NIC to a host-side peer (see nicpeer.h) in
+ * place of the switch, for benchmarking the NIC alone. Either way, the
+ * host time per round is reported at the end, and per round in the NIC
+ * log.
+ *
+ * +nicstatsN=FILE writes the counters in nic_stats to FILE as CSV, a row
+ * every +nicstats-intervalN= cycles (default 1000000, rounded to whole
+ * rounds) keyed by target cycle, and a last row at the end.
+ *
+ * +nic-verifyN checks the running count the FPGA puts in every big token
+ * it sends, and fails the simulation at the first one lost.
+ *
+ * The rate limiter and pause settings can be changed while running, with
+ * set_rate()/set_pause(), or at given target cycles through the
+ * simulation's scheduler:
+ *   +netbw-scheduleN=CYCLE:GBPS[/BURST],...
+ *   +nicpause-scheduleN=CYCLE:THRESHOLD/QUANTA/REFRESH,...
+ * Any rate, fractional or not, is set as the limiter's closest inc/period
+ * (each at most 8 bits), e.g. 123.456 Gbps as 50 flits per 81 cycles. */
 class simplenic_t: public bridge_driver_t
 {
     public:
@@ -20,40 +76,137 @@ class simplenic_t: public bridge_driver_t
 
         virtual void init();
         virtual void tick();
-        virtual bool terminate() { return false; };
-        virtual int exit_code() { return 0; }
-        virtual void finish() {};
+        // token loss found by +nic-verify fails the simulation
+        virtual bool terminate() { return verify_failed; };
+        virtual int exit_code() { return verify_failed ? 1 : 0; }
+        virtual void finish();
+
+        void set_rate(double gbps, int burst = -1);
+        void set_pause(int threshold, int quanta, int refresh);
 
     private:
+        friend class simplenic_poller_t;
+        bool pull_tokens(int &output_tokens_available);
+        bool push_tokens(int &input_token_capacity);
+        bool service(uint32_t outgoing_count, uint32_t incoming_count);
+        bool switch_moved();
+        // the last service() found no round from the switch to push, and
+        // the FPGA idle for lack of one
+        bool push_waiting = false;
+        bool waiting_on_switch = false;
+
         simif_t* sim;
         uint64_t mac_lendian;
-        char * pcis_read_bufs[2];
-        char * pcis_write_bufs[2];
+        // rounds to/from the switch model. in loopback mode a single
+        // private buffer is used instead
+        ShmemRing nic_to_switch;
+        ShmemRing switch_to_nic;
+        // loopback: pipeline_depth rounds, pulled but not yet pushed back
+        char * loopback_buf = NULL;
+        // sees the rounds going through loopback_buf and replaces them
+        nic_peer_t * peer = NULL;
         int rlimit_inc, rlimit_period, rlimit_size;
 	int pause_threshold, pause_quanta, pause_refresh;
 
+        struct schedule_entry {
+            uint64_t cycle;
+            bool rate;
+            double gbps;
+            int burst;
+            int threshold, quanta, refresh;
+        };
+        // by cycle
+        std::vector<schedule_entry> schedule;
+        size_t schedule_next = 0;
+        void parse_schedule(const char *spec, bool rate);
+        void check_rate(double gbps, int burst);
+        void check_pause(int threshold, int quanta, int refresh);
+        uint64_t run_schedule();
+
         // link latency in cycles
         // assuming 3.2 GHz, this number / 3.2 = link latency in ns
         // e.g. setting this to 6405 gives you 6405/3.2 = 2001.5625 ns latency
         // IMPORTANT: this must be a multiple of 7
         int LINKLATENCY;
+        // rounds per link latency
+        int pipeline_depth;
+        uint64_t rounds_pulled = 0;
+        uint64_t rounds_pushed = 0;
+        // smallest DMA in big tokens (+nicchunkN=, in cycles); less than a
+        // round lets the FPGA drain and refill a round piecemeal
+        int chunk_bt;
+        // round being filled from / drained to the FPGA, and how many big
+        // tokens of it are done. a round only goes to (or back to) the
+        // switch whole, so the switch still sees whole rounds
+        char * pull_buf = NULL;
+        int pull_cursor = 0;
+        char * push_buf = NULL;
+        int push_cursor = 0;
+        bool push_from_switch = false;
+        // empty rounds still to push before the switch's first one
+        int empty_rounds_left = 0;
+        char * empty_round = NULL;
+        void scan_tokens(const char *buf, int ntokens, int &frame_flit,
+                uint64_t &frames, uint64_t &bytes, uint64_t &pause_frames);
+        void dump_stats(uint64_t cycle);
+
+        nic_stats stats;
+        // flit of the current frame each way, to find ethertypes
+        int tx_frame_flit = 0;
+        int rx_frame_flit = 0;
+        // when push started waiting on the switch, 0 if it isn't
+        uint64_t wait_start_ns = 0;
+        FILE * stats_file = NULL;
+        uint64_t stats_interval;
+        uint64_t stats_next_cycle = 0;
+
+        int simplenicno;
+        // host time between rounds from the FPGA
+        midas_time_t last_round_time = 0;
+        midas_time_t round_time_sum = 0;
+        midas_time_t round_time_max = 0;
         FILE * niclog;
         SIMPLENICBRIDGEMODULE_struct *mmio_addrs;
         bool loopback;
 
-        // checking for token loss
-        uint32_t next_token_from_fpga = 0x0;
+        // checking for token loss (+nic-verifyN, or TOKENVERIFY)
+        void verify_tokens(const char *buf, int ntokens);
+        bool verify = false;
+        bool verify_failed = false;
+        uint64_t next_token_from_fpga = 0x0;
         uint32_t next_token_from_socket = 0x0;
 
-        uint64_t iter = 0;
-
-        int currentround = 0;
-
         // only for TOKENVERIFY
         uint64_t timeelapsed_cycles = 0;
 
         long dma_addr;
 };
+
+/* Services all of a simulation's NICs as one bridge. Each pass reads every
+ * NIC's token counts back to back, then moves tokens for each from those
+ * counts, so a NIC costs two MMIO reads per pass however much it moves.
+ * When every NIC is held up by its switch, it spins on all of their rings
+ * together rather than re-reading the counts. */
+class simplenic_poller_t: public bridge_driver_t
+{
+    public:
+        simplenic_poller_t(simif_t* sim): bridge_driver_t(sim) {}
+
+        void add(simplenic_t *nic) { nics.push_back(std::unique_ptr<simplenic_t>(nic)); }
+        bool empty() { return nics.empty(); }
+        // hand each NIC's rate/pause schedule to the simulation's scheduler
+        void register_schedules(
+                std::function<void(std::function<uint64_t()>, uint64_t)> register_task);
+
+        virtual void init();
+        virtual void tick();
+        virtual bool terminate();
+        virtual int exit_code();
+        virtual void finish();
+
+    private:
+        std::vector<std::unique_ptr<simplenic_t>> nics;
+};
 #endif // SIMPLENICBRIDGEMODULE_struct_guard
 
 #endif // __SIMPLENIC_H
@@ -0,0 +1,31 @@
+// See LICENSE for license details.
+
+// What the generated <DESIGN>-const.h gives blockdev.cc: the widget's
+// registers, here numbered in order for the test to decode
+#define BLOCKDEVBRIDGEMODULE_struct_guard
+typedef struct BLOCKDEVBRIDGEMODULE_struct {
+    unsigned long bdev_req_valid;
+    unsigned long bdev_req_write;
+    unsigned long bdev_req_offset;
+    unsigned long bdev_req_len;
+    unsigned long bdev_req_tag;
+    unsigned long bdev_req_ready;
+    unsigned long bdev_data_valid;
+    unsigned long bdev_data_data_upper;
+    unsigned long bdev_data_data_lower;
+    unsigned long bdev_data_tag;
+    unsigned long bdev_data_ready;
+    unsigned long bdev_rresp_data_upper;
+    unsigned long bdev_rresp_data_lower;
+    unsigned long bdev_rresp_tag;
+    unsigned long bdev_rresp_valid;
+    unsigned long bdev_rresp_ready;
+    unsigned long bdev_wack_tag;
+    unsigned long bdev_wack_valid;
+    unsigned long bdev_wack_ready;
+    unsigned long bdev_reqs_pending;
+    unsigned long bdev_nsectors;
+    unsigned long bdev_max_req_len;
+    unsigned long read_latency;
+    unsigned long write_latency;
+} BLOCKDEVBRIDGEMODULE_struct;
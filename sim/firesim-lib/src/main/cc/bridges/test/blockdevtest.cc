@@ -0,0 +1,194 @@
+// See LICENSE for license details.
+
+// Drives blockdev_t through a model of its widget's registers and checks
+// that the page cache answers reads as if the disk were read in order
+
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <vector>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "bridges/blockdev.h"
+
+#define NREGS (sizeof(BLOCKDEVBRIDGEMODULE_struct) / sizeof(unsigned long))
+
+// The widget end: requests and write data queued for the driver, and the
+// read beats and write acks it has sent back
+class widget_t: public simif_t
+{
+  public:
+    BLOCKDEVBRIDGEMODULE_struct regs;
+    std::deque<blkdev_request> reqs;
+    std::deque<blkdev_data> data;
+    std::vector<blkdev_data> resps;
+    std::vector<uint32_t> acks;
+
+    widget_t() {
+        unsigned long *r = (unsigned long *) &regs;
+        for (size_t i = 0; i < NREGS; i++)
+            r[i] = i;
+    }
+
+    void write_req(uint32_t offset, uint32_t len, uint32_t tag, uint64_t fill) {
+        reqs.push_back({ true, offset, len, tag });
+        for (uint32_t i = 0; i < len * SECTOR_BEATS; i++)
+            data.push_back({ fill, tag });
+    }
+
+    data_t read(size_t addr) {
+        if (addr == regs.bdev_req_valid) return !reqs.empty();
+        if (addr == regs.bdev_req_write) return reqs.front().write;
+        if (addr == regs.bdev_req_offset) return reqs.front().offset;
+        if (addr == regs.bdev_req_len) return reqs.front().len;
+        if (addr == regs.bdev_req_tag) return reqs.front().tag;
+        if (addr == regs.bdev_data_valid) return !data.empty();
+        if (addr == regs.bdev_data_data_upper) return data.front().data >> 32;
+        if (addr == regs.bdev_data_data_lower) return data.front().data;
+        if (addr == regs.bdev_data_tag) return data.front().tag;
+        if (addr == regs.bdev_rresp_ready || addr == regs.bdev_wack_ready) return 1;
+        if (addr == regs.bdev_reqs_pending) return !reqs.empty() || !data.empty();
+        return 0;
+    }
+
+    void write(size_t addr, data_t value) {
+        if (addr == regs.bdev_req_ready) reqs.pop_front();
+        if (addr == regs.bdev_data_ready) data.pop_front();
+        if (addr == regs.bdev_rresp_data_upper) resp.data = (uint64_t) value << 32;
+        if (addr == regs.bdev_rresp_data_lower) resp.data |= value;
+        if (addr == regs.bdev_rresp_tag) resp.tag = value;
+        if (addr == regs.bdev_rresp_valid) resps.push_back(resp);
+        if (addr == regs.bdev_wack_tag) ack = value;
+        if (addr == regs.bdev_wack_valid) acks.push_back(ack);
+    }
+
+  private:
+    blkdev_data resp;
+    uint32_t ack;
+};
+
+static int failures = 0;
+
+static void check(bool ok, const char *what) {
+    printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+    failures += !ok;
+}
+
+// tick until the widget has the read beats and write acks asked for
+static bool tick_until(blockdev_t &bd, widget_t &w, size_t beats, size_t acks) {
+    for (int i = 0; i < 1000000; i++) {
+        if (w.resps.size() >= beats && w.acks.size() >= acks)
+            return true;
+        bd.tick();
+    }
+    return false;
+}
+
+// whether beats [first, first + n) of the responses hold value
+static bool beats_are(widget_t &w, size_t first, size_t n, uint64_t value) {
+    for (size_t i = first; i < first + n; i++) {
+        if (w.resps[i].data != value)
+            return false;
+    }
+    return true;
+}
+
+static BLOCKDEVBRIDGEMODULE_struct * copy_regs(widget_t &w) {
+    BLOCKDEVBRIDGEMODULE_struct *regs = (BLOCKDEVBRIDGEMODULE_struct *) malloc(sizeof(*regs));
+    *regs = w.regs;
+    return regs;
+}
+
+static void test_read_write_order() {
+    widget_t w;
+    std::vector<std::string> args = { "+blkdev-in-mem0=64", "+blkdev-io-threads0=1" };
+    blockdev_t bd(&w, args, 4, 16, copy_regs(w), 0);
+    bd.init();
+
+    // A read of a page not yet cached, then a write to some of its sectors
+    // whose data is all in before the page has been loaded: the read is
+    // answered with what was there before the write
+    w.reqs.push_back({ false, 0, 8, 0 });
+    w.write_req(2, 2, 1, 0x1111111111111111UL);
+    bd.tick();
+    check(w.resps.empty(), "read waits on its page load");
+    check(tick_until(bd, w, 8 * SECTOR_BEATS, 1), "read answered and write acked");
+    check(beats_are(w, 0, 8 * SECTOR_BEATS, 0), "read doesn't see the later write");
+
+    // A read after the write sees it
+    w.reqs.push_back({ false, 0, 4, 2 });
+    check(tick_until(bd, w, 12 * SECTOR_BEATS, 1), "second read answered");
+    check(beats_are(w, 8 * SECTOR_BEATS, 2 * SECTOR_BEATS, 0) &&
+            beats_are(w, 10 * SECTOR_BEATS, 2 * SECTOR_BEATS, 0x1111111111111111UL),
+            "read after the write sees it");
+
+    // Two writes held behind a read, and a read after both, see them land
+    // in order
+    w.reqs.push_back({ false, 16, 4, 0 });
+    w.write_req(16, 2, 1, 0x2222222222222222UL);
+    w.write_req(17, 2, 3, 0x3333333333333333UL);
+    bd.tick();
+    w.reqs.push_back({ false, 16, 4, 2 });
+    check(tick_until(bd, w, 20 * SECTOR_BEATS, 3), "reads answered and writes acked");
+    check(beats_are(w, 12 * SECTOR_BEATS, 4 * SECTOR_BEATS, 0), "first read sees neither write");
+    check(beats_are(w, 16 * SECTOR_BEATS, SECTOR_BEATS, 0x2222222222222222UL) &&
+            beats_are(w, 17 * SECTOR_BEATS, 2 * SECTOR_BEATS, 0x3333333333333333UL) &&
+            beats_are(w, 19 * SECTOR_BEATS, SECTOR_BEATS, 0),
+            "second read sees both writes, in order");
+
+    bd.finish();
+}
+
+// A simulation that dies without finishing leaves an overlay that reads
+// back the pages it had written back
+static void test_overlay_crash() {
+    char basename[] = "/tmp/blockdevtest-base-XXXXXX";
+    char overlayname[] = "/tmp/blockdevtest-overlay-XXXXXX";
+    int base_fd = mkstemp(basename), overlay_fd = mkstemp(overlayname);
+    if (base_fd < 0 || overlay_fd < 0 || ftruncate(base_fd, 1 << 20)) {
+        perror("blockdevtest");
+        exit(1);
+    }
+    close(base_fd);
+    close(overlay_fd);
+    std::vector<std::string> args = { std::string("+blkdev0=") + basename,
+        std::string("+blkdev-overlay0=") + overlayname, "+blkdev-cache0=0" };
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        // write a page, then enough others to evict it; reading it again
+        // waits for its write-back, which is queued ahead of the load
+        widget_t w;
+        blockdev_t bd(&w, args, 4, 16, copy_regs(w), 0);
+        bd.init();
+        for (uint32_t p = 0; p <= 64; p++) {
+            w.write_req(p * BLKDEV_PAGE_SECTORS, BLKDEV_PAGE_SECTORS, 0, 0x4444444444444444UL + p);
+            if (!tick_until(bd, w, 0, p + 1))
+                _exit(1);
+        }
+        w.reqs.push_back({ false, 0, BLKDEV_PAGE_SECTORS, 1 });
+        _exit(tick_until(bd, w, BLKDEV_PAGE_BEATS, 0) ? 0 : 1);
+    }
+    int status;
+    check(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0,
+            "simulation writes back a page and dies");
+
+    widget_t w;
+    blockdev_t bd(&w, args, 4, 16, copy_regs(w), 0);
+    bd.init();
+    w.reqs.push_back({ false, 0, BLKDEV_PAGE_SECTORS, 0 });
+    check(tick_until(bd, w, BLKDEV_PAGE_BEATS, 0) &&
+            beats_are(w, 0, BLKDEV_PAGE_BEATS, 0x4444444444444444UL),
+            "overlay it left reads back the page");
+    unlink(basename);
+    unlink(overlayname);
+}
+
+int main(int argc, char *argv[])
+{
+    // first, so the child it forks is the only thread of a new process
+    test_overlay_crash();
+    test_read_write_order();
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,24 @@
+// See LICENSE for license details.
+
+#ifndef __SIMIF_H
+#define __SIMIF_H
+
+// Stands in for the simulator so a bridge driver can be built and run on
+// its own; the test supplies read() and write()
+
+#include <cstdint>
+#include <sys/types.h>
+
+typedef uint32_t data_t;
+
+class simif_t
+{
+  public:
+    virtual ~simif_t() { }
+    virtual void write(size_t addr, data_t data) = 0;
+    virtual data_t read(size_t addr) = 0;
+    virtual ssize_t pull(size_t addr, char *data, size_t size) { return 0; }
+    virtual ssize_t push(size_t addr, char *data, size_t size) { return 0; }
+};
+
+#endif // __SIMIF_H
@@ -59,6 +59,11 @@ class simif_t
     virtual data_t read(size_t addr) = 0;
     virtual ssize_t pull(size_t addr, char *data, size_t size) = 0;
     virtual ssize_t push(size_t addr, char *data, size_t size) = 0;
+    // Register a host buffer that pull/push will target over and over
+    // (e.g. NIC rounds in shared memory), so a backend that can DMA to and
+    // from it in place sets that up once. Returns false if it can't;
+    // pull/push on the buffer still work, through the backend's usual copy.
+    virtual bool dma_register(char *data, size_t size) { return false; }
 
     inline void poke(size_t id, data_t value) {
       if (log) fprintf(stderr, "* POKE %s.%s <- 0x%x *\n",
@@ -117,6 +117,9 @@ void simif_emul_t::init(int argc, char** argv, bool log) {
 
 int simif_emul_t::finish() {
   int exitcode = simif_t::finish();
+  if (!dma_regions.empty())
+    fprintf(stderr, "DMA: %lu of %lu bytes through registered buffers\n",
+            dma_registered_bytes, dma_bytes);
   ::finish();
   return exitcode;
 }
@@ -158,7 +161,23 @@ data_t simif_emul_t::read(size_t addr) {
 
 #define MAX_LEN 255
 
+bool simif_emul_t::dma_register(char* data, size_t size) {
+  dma_regions.push_back(std::make_pair(data, size));
+  return true;
+}
+
+void simif_emul_t::count_dma(char* data, size_t size) {
+  dma_bytes += size;
+  for (auto &r: dma_regions) {
+    if (data >= r.first && data + size <= r.first + r.second) {
+      dma_registered_bytes += size;
+      return;
+    }
+  }
+}
+
 ssize_t simif_emul_t::pull(size_t addr, char* data, size_t size) {
+  count_dma(data, size);
   ssize_t len = (size - 1) / DMA_BEAT_BYTES;
 
   while (len >= 0) {
@@ -175,6 +194,7 @@ ssize_t simif_emul_t::pull(size_t addr, char* data, size_t size) {
 }
 
 ssize_t simif_emul_t::push(size_t addr, char *data, size_t size) {
+  count_dma(data, size);
   ssize_t len = (size - 1) / DMA_BEAT_BYTES;
   size_t remaining = size - len * DMA_BEAT_BYTES;
   size_t strb[len + 1];
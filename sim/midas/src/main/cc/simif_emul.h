@@ -4,6 +4,7 @@
 #define __SIMIF_EMUL_H
 
 #include <memory>
+#include <vector>
 
 #include "simif.h"
 #include "mm.h"
@@ -24,8 +25,16 @@ class simif_emul_t : public virtual simif_t
     virtual data_t read(size_t addr);
     virtual ssize_t pull(size_t addr, char* data, size_t size);
     virtual ssize_t push(size_t addr, char* data, size_t size);
+    // Stands in for a backend with zero-copy DMA, so that path can be
+    // exercised on a plain host: buffers are accepted as registered, and
+    // finish() reports how much DMA traffic stayed inside them
+    virtual bool dma_register(char* data, size_t size);
 
   private:
+    std::vector<std::pair<char*, size_t>> dma_regions;
+    uint64_t dma_bytes = 0;
+    uint64_t dma_registered_bytes = 0;
+    void count_dma(char* data, size_t size);
     // The maximum number of cycles the RTL simulator can advance before
     // switching back to the driver process. +fuzz-host-timings sets this to a value > 1, introducing random delays
     // in MMIO (read, write) and DMA (push, pull) requests
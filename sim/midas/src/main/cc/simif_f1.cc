@@ -2,6 +2,7 @@
 #include <cassert>
 
 #include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -189,6 +190,26 @@ ssize_t simif_f1_t::push(size_t addr, char* data, size_t size) {
 #endif
 }
 
+bool simif_f1_t::dma_register(char* data, size_t size) {
+#ifdef SIMULATION_XSIM
+  return false;
+#else
+  // The XDMA char device has no way to import a buffer once; it maps the
+  // user pages of each transfer itself and DMAs to them directly, as long
+  // as they're page aligned. Locking the buffer keeps those pages resident
+  // and in place, so every transfer maps the same (ideally huge) pages.
+  if ((uintptr_t)data % sysconf(_SC_PAGESIZE) != 0) {
+    fprintf(stderr, "DMA buffer %p is not page aligned\n", data);
+    return false;
+  }
+  if (mlock(data, size) != 0) {
+    perror("mlock DMA buffer");
+    return false;
+  }
+  return true;
+#endif
+}
+
 uint32_t simif_f1_t::is_write_ready() {
     uint64_t addr = 0x4;
 #ifdef SIMULATION_XSIM
@@ -215,38 +215,48 @@ firesim_top_t::firesim_top_t(int argc, char** argv)
 #endif
 
 #ifdef SIMPLENICBRIDGEMODULE_struct_guard
+    // all NICs are serviced together by one poller bridge
+    simplenic_poller_t *nic_poller = new simplenic_poller_t(this);
     #ifdef SIMPLENICBRIDGEMODULE_0_PRESENT
     SIMPLENICBRIDGEMODULE_0_substruct_create;
-    add_bridge_driver(new simplenic_t(this, args, SIMPLENICBRIDGEMODULE_0_substruct, 0, SIMPLENICBRIDGEMODULE_0_DMA_ADDR));
+    nic_poller->add(new simplenic_t(this, args, SIMPLENICBRIDGEMODULE_0_substruct, 0, SIMPLENICBRIDGEMODULE_0_DMA_ADDR));
     #endif
     #ifdef SIMPLENICBRIDGEMODULE_1_PRESENT
     SIMPLENICBRIDGEMODULE_1_substruct_create;
-    add_bridge_driver(new simplenic_t(this, args, SIMPLENICBRIDGEMODULE_1_substruct, 1, SIMPLENICBRIDGEMODULE_1_DMA_ADDR));
+    nic_poller->add(new simplenic_t(this, args, SIMPLENICBRIDGEMODULE_1_substruct, 1, SIMPLENICBRIDGEMODULE_1_DMA_ADDR));
     #endif
     #ifdef SIMPLENICBRIDGEMODULE_2_PRESENT
     SIMPLENICBRIDGEMODULE_2_substruct_create;
-    add_bridge_driver(new simplenic_t(this, args, SIMPLENICBRIDGEMODULE_2_substruct, 2, SIMPLENICBRIDGEMODULE_2_DMA_ADDR));
+    nic_poller->add(new simplenic_t(this, args, SIMPLENICBRIDGEMODULE_2_substruct, 2, SIMPLENICBRIDGEMODULE_2_DMA_ADDR));
     #endif
     #ifdef SIMPLENICBRIDGEMODULE_3_PRESENT
     SIMPLENICBRIDGEMODULE_3_substruct_create;
-    add_bridge_driver(new simplenic_t(this, args, SIMPLENICBRIDGEMODULE_3_substruct, 3, SIMPLENICBRIDGEMODULE_3_DMA_ADDR));
+    nic_poller->add(new simplenic_t(this, args, SIMPLENICBRIDGEMODULE_3_substruct, 3, SIMPLENICBRIDGEMODULE_3_DMA_ADDR));
     #endif
     #ifdef SIMPLENICBRIDGEMODULE_4_PRESENT
     SIMPLENICBRIDGEMODULE_4_substruct_create;
-    add_bridge_driver(new simplenic_t(this, args, SIMPLENICBRIDGEMODULE_4_substruct, 4, SIMPLENICBRIDGEMODULE_4_DMA_ADDR));
+    nic_poller->add(new simplenic_t(this, args, SIMPLENICBRIDGEMODULE_4_substruct, 4, SIMPLENICBRIDGEMODULE_4_DMA_ADDR));
     #endif
     #ifdef SIMPLENICBRIDGEMODULE_5_PRESENT
     SIMPLENICBRIDGEMODULE_5_substruct_create;
-    add_bridge_driver(new simplenic_t(this, args, SIMPLENICBRIDGEMODULE_5_substruct, 5, SIMPLENICBRIDGEMODULE_5_DMA_ADDR));
+    nic_poller->add(new simplenic_t(this, args, SIMPLENICBRIDGEMODULE_5_substruct, 5, SIMPLENICBRIDGEMODULE_5_DMA_ADDR));
     #endif
     #ifdef SIMPLENICBRIDGEMODULE_6_PRESENT
     SIMPLENICBRIDGEMODULE_6_substruct_create;
-    add_bridge_driver(new simplenic_t(this, args, SIMPLENICBRIDGEMODULE_6_substruct, 6, SIMPLENICBRIDGEMODULE_6_DMA_ADDR));
+    nic_poller->add(new simplenic_t(this, args, SIMPLENICBRIDGEMODULE_6_substruct, 6, SIMPLENICBRIDGEMODULE_6_DMA_ADDR));
     #endif
     #ifdef SIMPLENICBRIDGEMODULE_7_PRESENT
     SIMPLENICBRIDGEMODULE_7_substruct_create;
-    add_bridge_driver(new simplenic_t(this, args, SIMPLENICBRIDGEMODULE_7_substruct, 7, SIMPLENICBRIDGEMODULE_7_DMA_ADDR));
-    #endif
+    nic_poller->add(new simplenic_t(this, args, SIMPLENICBRIDGEMODULE_7_substruct, 7, SIMPLENICBRIDGEMODULE_7_DMA_ADDR));
+    #endif
+    if (nic_poller->empty())
+        delete nic_poller;
+    else {
+        add_bridge_driver(nic_poller);
+        nic_poller->register_schedules([this](std::function<uint64_t()> task, uint64_t first_cycle) {
+            register_task(task, first_cycle);
+        });
+    }
 #endif
 
 #ifdef TRACERVBRIDGEMODULE_struct_guard
@@ -4,22 +4,77 @@
 
 #define MAC_ETHTYPE 0x8808
 #define PAUSE_CONTROL 0x0001
+#define PFC_CONTROL 0x0101
 
-struct switchpacket {
-    uint64_t timestamp;
-    uint64_t dat[200];
-    int amtwritten;
-    int amtread;
-    int sender;
+// a PFC frame: 60 bytes plus the NET_IP_ALIGN padding
+#define PFC_FRAME_FLITS 8
+
+// output schedulers
+#define QSCHED_FIFO 0 // one queue, in arrival order
+#define QSCHED_SP 1    // a queue per traffic class, highest class first
+#define QSCHED_DRR 2   // a queue per traffic class, deficit round robin
+
+#define DRR_DEFAULT_QUANTUM 1600
+
+/* Output queue model of a port. The queue is unbounded unless limit_bytes
+ * is set, in which case packets that don't fit are tail dropped. The limit
+ * is shared by all the traffic classes.
+ *
+ * Packets are classified by packet_priority (VLAN PCP, else DSCP). With
+ * QSCHED_SP the highest class with a packet waiting goes first; with
+ * QSCHED_DRR each class gets drr_quantum bytes per turn.
+ *
+ * With RED, packets arriving to a queue holding between red_min and
+ * red_max bytes are dropped with a probability rising linearly to
+ * red_maxp, and all packets are dropped above red_max. This uses the
+ * instantaneous queue depth, not an average. With ecn set, ECN-capable
+ * IPv4 packets are marked CE instead of being dropped early.
+ *
+ * With pfc_xoff set, a packet arriving to a queue that holds more than
+ * pfc_xoff bytes of its priority makes the port it came in on send a PFC
+ * pause for that priority, of pfc_quanta quanta. Pauses are refreshed while
+ * the queue stays above pfc_xoff, and are left to expire when it drains. */
+struct queueparams {
+    uint64_t limit_bytes = 0; // 0: unbounded
+    uint64_t red_min = 0;
+    uint64_t red_max = 0; // 0: no RED
+    double red_maxp = 0.0;
+    bool ecn = false;
+    uint64_t pfc_xoff = 0; // 0: no PFC
+    uint16_t pfc_quanta = 0xffff;
+    int sched = QSCHED_FIFO;
+    uint32_t drr_quantum[NUM_PRIORITIES] = {
+        DRR_DEFAULT_QUANTUM, DRR_DEFAULT_QUANTUM, DRR_DEFAULT_QUANTUM, DRR_DEFAULT_QUANTUM,
+        DRR_DEFAULT_QUANTUM, DRR_DEFAULT_QUANTUM, DRR_DEFAULT_QUANTUM, DRR_DEFAULT_QUANTUM
+    };
 };
 
-typedef struct switchpacket switchpacket;
+// per-port link parameters, filled in from the config before the ports are built
+struct linkparams {
+    int latency; // in cycles, also the size of this port's rounds
+    bool throttle; // explicit bandwidth given for this port
+    int throttle_numer;
+    int throttle_denom;
+    queueparams queue;
+};
 
+linkparams * port_links;
 
 class BasePort {
     public:
         BasePort(int portNo, bool throttle);
         void write_flits_to_output();
+
+        // this port's round: its link latency worth of tokens
+        int num_tokens() { return _linklatency; }
+        int num_bigtokens() { return _linklatency / TOKENS_PER_BIGTOKEN; }
+        size_t bufsize_bytes() { return num_bigtokens() * BIGTOKEN_BYTES; }
+        int linklatency() { return _linklatency; }
+        // # of switch time steps (step_cycles) per round of this port
+        int steps_per_round() { return _linklatency / step_cycles; }
+
+        // start of this port's current round, in cycles
+        uint64_t round_start = 0;
         virtual void tick() = 0; // some ports need to do management every switching loop
         virtual void tick_pre() = 0; // some ports need to do management every switching loop
 
@@ -33,24 +88,94 @@ class BasePort {
         uint8_t * current_output_buf; // current output buf
 
         int pauseCycles = 0;
-        int recv_buf_port_map = -1; // used when frame crosses batching boundary. the last port that fed this port's send buf
 
         switchpacket * input_in_progress = NULL;
-        switchpacket * output_in_progress = NULL;
 
-        std::queue<switchpacket*> inputqueue;
-        std::queue<switchpacket*> outputqueue;
+        packetlist inputqueue;
+        // packets routed here, in timestamp order. they are classified and
+        // admitted to the class queues as simulated time reaches them
+        packetlist outputqueue;
 
         int push_input(switchpacket *sp);
 
+        // PFC pauses other ports have asked this one to send, a bitmask of
+        // priorities. double-buffered on the switch's barrier parity: set
+        // by any thread between barriers, taken by the owner after the next
+        void request_pfc_pause(int priority, int parity);
+        void take_pfc_requests(int parity);
+
+        // this port's block of port_stats
+        portstats * stats;
+
     protected:
         int _portNo;
         bool _throttle;
+        int _linklatency;
+        int _throttle_numer;
+        int _throttle_denom;
+        // the throttle as a schedule: after every _throttle_burst flits of a
+        // packet, skip _throttle_gap cycles. unthrottled ports never skip
+        int _throttle_burst;
+        int _throttle_gap;
+
+    private:
+        bool admit_packet(switchpacket *sp, int priority);
+        void admit_arrivals(uint64_t until);
+        bool class_ready(int queue, uint64_t now);
+        int pick_class(uint64_t now);
+        uint64_t next_ready_time();
+        switchpacket * make_pfc_frame(uint8_t priorities);
+
+        queueparams _queue;
+        unsigned int _red_seed;
+
+        void load_ce_header(switchpacket *sp);
+
+        // what the output loop touches on every packet, kept together:
+        // the packet on the wire, possibly carried over from the last round,
+        // and its first flits when they go out changed (marked CE)
+        switchpacket * in_service = NULL;
+        int txheader_flits = 0;
+        uint64_t txheader[CUT_THROUGH_FLITS];
+
+        // admitted packets, one queue per class (just the first for
+        // QSCHED_FIFO). the bytes include the packet being sent
+        packetlist classqueue[NUM_PRIORITIES];
+        uint64_t queued_bytes = 0;
+        uint64_t queued_priority_bytes[NUM_PRIORITIES] = {};
+
+        // DRR state: whose turn it is, and whether its quantum was added
+        int drr_turn = 0;
+        bool drr_turn_started = false;
+        int64_t drr_deficit[NUM_PRIORITIES] = {};
+
+        // PFC state: pauses received, and pauses we've sent
+        uint64_t pfc_paused_until[NUM_PRIORITIES] = {};
+        uint64_t pfc_sent_until[NUM_PRIORITIES] = {};
+        std::atomic<uint8_t> pfc_requests[2];
+        packetlist controlqueue;
 };
 
+// all the switch's ports, indexed by port number
+BasePort ** ports;
+
 BasePort::BasePort(int portNo, bool throttle)
     : _portNo(portNo), _throttle(throttle)
 {
+    linkparams &link = port_links[portNo];
+    _linklatency = link.latency;
+    // ports without their own bandwidth use the switch-wide one, and only
+    // if they are throttled by default (downlinks)
+    _throttle = link.throttle || throttle;
+    _throttle_numer = link.throttle ? link.throttle_numer : throttle_numer;
+    _throttle_denom = link.throttle ? link.throttle_denom : throttle_denom;
+    _throttle_burst = _throttle ? _throttle_numer : INT_MAX;
+    _throttle_gap = _throttle_denom - _throttle_numer;
+    _queue = link.queue;
+    stats = &port_stats[portNo];
+    _red_seed = portNo + 1;
+    pfc_requests[0] = 0;
+    pfc_requests[1] = 0;
 }
 
 int BasePort::push_input(switchpacket *sp)
@@ -69,93 +194,322 @@ int BasePort::push_input(switchpacket *sp)
 
     if (ethtype == MAC_ETHTYPE && ctrl == PAUSE_CONTROL) {
         this->pauseCycles = quanta * CYCLES_PER_QUANTA;
+        stats->pause_frames_received++;
         printf("Pause %d for %d cycles\n", _portNo, pauseCycles);
         return 0;
     }
 
+    if (ethtype == MAC_ETHTYPE && ctrl == PFC_CONTROL) {
+        // class-enable vector, then one pause time per priority
+        uint8_t * f = frame_bytes(sp);
+        uint16_t enabled = get_be16(f + 16);
+        for (int prio = 0; prio < NUM_PRIORITIES; prio++) {
+            if ((enabled & (1 << prio)) && frame_len(sp) >= 20 + 2 * prio) {
+                pfc_paused_until[prio] = sp->timestamp +
+                    get_be16(f + 18 + 2 * prio) * CYCLES_PER_QUANTA;
+            }
+        }
+        stats->pfc_frames_received++;
+        printf("PFC pause %d classes %x\n", _portNo, enabled);
+        free(sp);
+        return 0;
+    }
+
     inputqueue.push(sp);
     return 1;
 }
 
+void BasePort::request_pfc_pause(int priority, int parity) {
+    uint8_t bit = 1 << priority;
+    if (!(pfc_requests[parity].load(std::memory_order_relaxed) & bit))
+        pfc_requests[parity].fetch_or(bit, std::memory_order_relaxed);
+}
+
+void BasePort::take_pfc_requests(int parity) {
+    uint8_t requested = pfc_requests[parity].exchange(0, std::memory_order_relaxed);
+    uint8_t send = 0;
+    if (!requested)
+        return;
+    for (int prio = 0; prio < NUM_PRIORITIES; prio++) {
+        // refresh once the last pause we sent is half over
+        uint64_t half = _queue.pfc_quanta * CYCLES_PER_QUANTA / 2;
+        if ((requested & (1 << prio)) && round_start + half >= pfc_sent_until[prio]) {
+            send |= 1 << prio;
+            pfc_sent_until[prio] = round_start + _queue.pfc_quanta * CYCLES_PER_QUANTA;
+        }
+    }
+    if (send) {
+        controlqueue.push(make_pfc_frame(send));
+        stats->pfc_frames_sent++;
+    }
+}
+
+switchpacket * BasePort::make_pfc_frame(uint8_t priorities) {
+    switchpacket * sp = alloc_packet();
+    uint8_t * f = frame_bytes(sp);
+    static const uint8_t pfc_dest[6] = { 0x01, 0x80, 0xc2, 0x00, 0x00, 0x01 };
+
+    memcpy(f, pfc_dest, sizeof(pfc_dest));
+    put_be16(f + 12, MAC_ETHTYPE);
+    put_be16(f + 14, PFC_CONTROL);
+    put_be16(f + 16, priorities);
+    for (int prio = 0; prio < NUM_PRIORITIES; prio++) {
+        if (priorities & (1 << prio))
+            put_be16(f + 18 + 2 * prio, _queue.pfc_quanta);
+    }
+    sp->timestamp = round_start;
+    sp->amtwritten = PFC_FRAME_FLITS;
+    sp->sender = _portNo;
+    return sp;
+}
+
+/* decide whether a packet gets into the output queue, at the time it
+ * arrives there */
+bool BasePort::admit_packet(switchpacket *sp, int priority) {
+    uint32_t bytes = sp->qbytes;
+
+    stats->queue_hist[stats_bucket(queued_bytes)]++;
+
+    if (_queue.pfc_xoff && (queued_priority_bytes[priority] + bytes > _queue.pfc_xoff)) {
+        ports[sp->sender]->request_pfc_pause(priority, shard_parity);
+    }
+
+    if (_queue.limit_bytes && (queued_bytes + bytes > _queue.limit_bytes)) {
+        stats->tail_drops++;
+        stats->classes[priority].drops++;
+        printf("tail drop on port %d, queue %ld bytes\n", _portNo, queued_bytes);
+        return false;
+    }
+
+    if (_queue.red_max && (queued_bytes >= _queue.red_min)) {
+        bool congested = queued_bytes >= _queue.red_max;
+        if (!congested) {
+            double p = _queue.red_maxp * (queued_bytes - _queue.red_min) /
+                (double)(_queue.red_max - _queue.red_min);
+            congested = rand_r(&_red_seed) < p * RAND_MAX;
+        }
+        if (congested) {
+            if (_queue.ecn && ipv4_ecn_capable(sp)) {
+                sp->mark_ce = true;
+                stats->ecn_marks++;
+                stats->classes[priority].ecn_marks++;
+            } else {
+                stats->red_drops++;
+                stats->classes[priority].drops++;
+                return false;
+            }
+        }
+    }
+
+    queued_bytes += bytes;
+    queued_priority_bytes[priority] += bytes;
+    return true;
+}
+
+/* classify and admit everything that reached the output queue before
+ * until. called as the output side's clock advances, so the queue depth a
+ * packet sees is the depth at its arrival. */
+void BasePort::admit_arrivals(uint64_t until) {
+    while (!outputqueue.empty() && outputqueue.front()->timestamp < until) {
+        switchpacket * sp = outputqueue.front();
+        outputqueue.pop();
+        sp->qbytes = packet_queue_bytes(sp);
+        if (!admit_packet(sp, sp->priority)) {
+            release_packet(sp);
+            continue;
+        }
+        classqueue[_queue.sched == QSCHED_FIFO ? 0 : sp->priority].push(sp);
+    }
+}
+
+// the head of this class queue can go now: it isn't PFC paused
+bool BasePort::class_ready(int queue, uint64_t now) {
+    return !classqueue[queue].empty() &&
+        pfc_paused_until[classqueue[queue].front()->priority] <= now;
+}
+
+/* which class queue sends next, or -1 if none can at time now */
+int BasePort::pick_class(uint64_t now) {
+    if (_queue.sched == QSCHED_FIFO)
+        return class_ready(0, now) ? 0 : -1;
+
+    if (_queue.sched == QSCHED_SP) {
+        for (int queue = NUM_PRIORITIES - 1; queue >= 0; queue--) {
+            if (class_ready(queue, now))
+                return queue;
+        }
+        return -1;
+    }
+
+    bool any = false;
+    for (int queue = 0; queue < NUM_PRIORITIES; queue++)
+        any |= class_ready(queue, now);
+    if (!any)
+        return -1;
+
+    // DRR: a class keeps its turn while its deficit covers its head packet
+    while (true) {
+        int queue = drr_turn;
+        if (class_ready(queue, now)) {
+            if (!drr_turn_started) {
+                drr_deficit[queue] += _queue.drr_quantum[queue];
+                drr_turn_started = true;
+            }
+            int64_t bytes = classqueue[queue].front()->qbytes;
+            if (bytes <= drr_deficit[queue]) {
+                drr_deficit[queue] -= bytes;
+                return queue;
+            }
+        } else if (classqueue[queue].empty()) {
+            drr_deficit[queue] = 0;
+        }
+        drr_turn = (queue + 1) % NUM_PRIORITIES;
+        drr_turn_started = false;
+    }
+}
+
+/* earliest time something queued could go: the next arrival, or the end
+ * of a PFC pause holding up a class */
+uint64_t BasePort::next_ready_time() {
+    uint64_t next = outputqueue.empty() ? UINT64_MAX : outputqueue.front()->timestamp;
+    for (int queue = 0; queue < NUM_PRIORITIES; queue++) {
+        if (!classqueue[queue].empty())
+            next = std::min(next, pfc_paused_until[classqueue[queue].front()->priority]);
+    }
+    return next;
+}
+
 // assumes valid
 void BasePort::write_flits_to_output() {
     // 1) assume that outputbuf's valids have been cleared,
     // so if you write nothing, it's the same as no valid input to the
     // thing this port is connected to for that cycle.
     //
-    // 2) next, we will go through the output queue, and keep grabbing
-    // things off of its front until we can no longer fit them (either due
-    // to congestion, crossing a batch boundary (TODO fix this), or timing.
+    // 2) next, we will walk this round's time forward, at each packet
+    // boundary admitting what has arrived by then and letting the scheduler
+    // pick the class that sends next, until we run out of time or packets.
+    //
+    // PFC frames we've been asked to send go out ahead of the output
+    // queue, at the next packet boundary.
 
-    uint64_t flitswritten = std::min(this->pauseCycles, LINKLATENCY);
-    uint64_t basetime = this_iter_cycles_start;
-    uint64_t maxtime = this_iter_cycles_start + LINKLATENCY;
+    uint64_t flitswritten = std::min(this->pauseCycles, _linklatency);
+    uint64_t basetime = round_start;
+    uint64_t maxtime = round_start + _linklatency;
     bool empty_buf = true;
 
     this->pauseCycles -= flitswritten;
 
-    while (!(outputqueue.empty())) {
-        switchpacket *thispacket = outputqueue.front();
-        // first, check timing boundaries.
-        uint64_t space_available = LINKLATENCY - flitswritten;
-        uint64_t outputtimestamp = thispacket->timestamp;
-        uint64_t outputtimestampend = outputtimestamp + thispacket->amtwritten;
-
-        // confirm that a) we are allowed to send this out based on timestamp
-        // b) we are allowed to send this out based on available space (TODO fix)
-        if (outputtimestamp < maxtime) {
-#ifdef LIMITED_BUFSIZE
-            // output-buffer size-based throttling, based on input time of first flit
-            int64_t diff = basetime + flitswritten - outputtimestamp;
-            if ((thispacket->amt_read == 0) && (diff > OUTPUT_BUF_SIZE)) {
-                // this packet would've been dropped due to buffer overflow.
-                // so, drop it.
-                printf("overflow, drop pack: intended timestamp: %ld, current timestamp: %ld, out bufsize in # flits: %ld, diff: %ld\n", outputtimestamp, basetime + flitswritten, OUTPUT_BUF_SIZE, (int64_t)(basetime + flitswritten) - (int64_t)(outputtimestamp));
-                outputqueue.pop();
-                free(thispacket);
+    while (flitswritten < (uint64_t)_linklatency) {
+        uint64_t now = basetime + flitswritten;
+        bool control = false;
+        switchpacket *thispacket = in_service;
+
+        if (!thispacket && !controlqueue.empty() && controlqueue.front()->timestamp < maxtime) {
+            control = true;
+            thispacket = controlqueue.front();
+        } else if (!thispacket) {
+            admit_arrivals(now + 1);
+            int queue = pick_class(now);
+            if (queue < 0) {
+                // nothing can go yet, skip ahead to when something can
+                uint64_t next = next_ready_time();
+                if (next >= maxtime)
+                    break;
+                flitswritten = next - basetime;
                 continue;
             }
-#endif
-            // we can write this flit
-            //
-            // first, advance flitswritten to the correct start point:
-            uint64_t timestampdiff = outputtimestamp > basetime ? outputtimestamp - basetime : 0L;
-            flitswritten = std::max(flitswritten, timestampdiff);
-
-            int i = thispacket->amtread;
-            if (i == 0) {
-                //printf("intended timestamp: %ld, actual timestamp: %ld, diff %ld\n", 
-                //        outputtimestamp, basetime + flitswritten, 
-                //        (int64_t)(basetime + flitswritten) - (int64_t)(outputtimestamp));
-                printf("packet timestamp: %ld, len: %ld, receiver: %d\n",
-                        basetime + flitswritten, thispacket->amtwritten, _portNo);
+            thispacket = classqueue[queue].front();
+            classqueue[queue].pop();
+            in_service = thispacket;
+        }
+
+        // we can write this flit
+        //
+        // first, advance flitswritten to the correct start point:
+        uint64_t outputtimestamp = thispacket->timestamp;
+        uint64_t timestampdiff = outputtimestamp > basetime ? outputtimestamp - basetime : 0L;
+        flitswritten = std::max(flitswritten, timestampdiff);
+
+        int i = thispacket->amtread;
+        if (i == 0) {
+            thispacket->txstart = basetime + flitswritten;
+            //printf("intended timestamp: %ld, actual timestamp: %ld, diff %ld\n", 
+            //        outputtimestamp, basetime + flitswritten, 
+            //        (int64_t)(basetime + flitswritten) - (int64_t)(outputtimestamp));
+            printf("packet timestamp: %ld, len: %ld, receiver: %d\n",
+                    basetime + flitswritten, thispacket->amtwritten, _portNo);
+            if (thispacket->mark_ce)
+                load_ce_header(thispacket);
+            if (!control) {
+                // from the first flit in (the timestamp includes switchlat)
+                uint64_t latency = basetime + flitswritten - (outputtimestamp - SWITCHLATENCY);
+                stats->latency_sum += latency;
+                stats->latency_max = std::max(stats->latency_max, latency);
+                stats->latency_hist[stats_bucket(latency)]++;
+            }
+        }
+
+        // how much of it is here. cut-through packets may still be arriving
+        int avail = thispacket->amtwritten;
+        bool done = true;
+        if (thispacket->cut_through) {
+            done = __atomic_load_n(&thispacket->cut_flags, __ATOMIC_ACQUIRE) & CUT_DONE;
+            avail = __atomic_load_n(&thispacket->cut_avail, __ATOMIC_ACQUIRE);
+            if (done)
+                thispacket->amtwritten = avail;
+        }
+
+        // where this packet is in the throttle schedule. a packet picked
+        // up from the last round needs a division, nothing else does
+        int burst = _throttle_burst;
+        if (i && _throttle)
+            burst -= i % _throttle_burst;
+
+        for (;(i < avail) && (flitswritten < (uint64_t)_linklatency); i++) {
+            if (thispacket->cut_through) {
+                // a flit can't leave before it got here
+                uint64_t ready = outputtimestamp + thispacket->flittime[i];
+                if (basetime + flitswritten < ready) {
+                    flitswritten = ready - basetime;
+                    if (flitswritten >= (uint64_t)_linklatency)
+                        break;
+                }
             }
-            for (;(i < thispacket->amtwritten) && (flitswritten < LINKLATENCY); i++) {
-                write_last_flit(current_output_buf, flitswritten, i == (thispacket->amtwritten-1));
-                write_valid_flit(current_output_buf, flitswritten);
-                write_flit(current_output_buf, flitswritten, thispacket->dat[i]);
-                empty_buf = false;
-
-                if (!_throttle)
-                    flitswritten++;
-                else if ((i + 1) % throttle_numer == 0)
-                    flitswritten += (throttle_denom - throttle_numer + 1);
-                else
-                    flitswritten++;
+            write_output_flit(current_output_buf, flitswritten,
+                    i < txheader_flits ? txheader[i] : thispacket->dat[i],
+                    done && i == (avail-1));
+            empty_buf = false;
+
+            flitswritten++;
+            if (--burst == 0) {
+                flitswritten += _throttle_gap;
+                burst = _throttle_burst;
             }
-            if (i == thispacket->amtwritten) {
-                // we finished sending this packet, so get rid of it
-                outputqueue.pop();
-                free(thispacket);
+        }
+        if (done && i == avail) {
+            // we finished sending this packet, so get rid of it
+            capture_packet(_portNo, CAPTURE_OUT, thispacket, thispacket->amtwritten,
+                    thispacket->txstart);
+            txheader_flits = 0;
+            stats->tx_packets++;
+            stats->tx_bytes += thispacket->amtwritten * sizeof(uint64_t);
+            if (control) {
+                controlqueue.pop();
             } else {
-                // we're not done sending this packet, so mark how much has been sent
-                // for the next time
-                thispacket->amtread = i;
-                break;
+                // whatever arrived while it was on the wire saw it queued
+                admit_arrivals(basetime + flitswritten);
+                queued_bytes -= thispacket->qbytes;
+                queued_priority_bytes[thispacket->priority] -= thispacket->qbytes;
+                stats->classes[thispacket->priority].tx_packets++;
+                stats->classes[thispacket->priority].tx_bytes +=
+                    thispacket->amtwritten * sizeof(uint64_t);
+                in_service = NULL;
             }
+            release_packet(thispacket);
         } else {
-            // since otuput queue is sorted on time, we have nothing else to
-            // write
+            // we're not done sending this packet, so mark how much has been sent
+            // for the next time
+            thispacket->amtread = i;
             break;
         }
     }
@@ -164,9 +518,20 @@ void BasePort::write_flits_to_output() {
     }
 }
 
+/* copy the headers of a packet that's to be marked CE, and mark the copy.
+ * the packet itself is left alone, since with cut-through its input side
+ * may still be reading it */
+void BasePort::load_ce_header(switchpacket *sp) {
+    int off = frame_ipv4_offset(sp);
+    txheader_flits = std::min(sp->amtwritten, CUT_THROUGH_FLITS);
+    memcpy(txheader, sp->dat, txheader_flits * sizeof(uint64_t));
+    if (off >= 0 && NET_IP_ALIGN + off + 12 <= txheader_flits * (int)sizeof(uint64_t))
+        ipv4_mark_ce((uint8_t*)txheader + NET_IP_ALIGN + off);
+}
+
 // initialize output port fullness for this round
 void BasePort::setup_send_buf() {
-    for (int bigtokenno = 0; bigtokenno < NUM_BIGTOKENS; bigtokenno++) {
+    for (int bigtokenno = 0; bigtokenno < num_bigtokens(); bigtokenno++) {
         *((uint64_t*)(current_output_buf) + bigtokenno*8) = 0L;
     }
 }
@@ -0,0 +1,89 @@
+/* Checks the capture filter's primitives against hand-built frames.
+ * Built and run by "make test". */
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <new>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <atomic>
+#include <cstdlib>
+#include <time.h>
+#include <arpa/inet.h>
+
+int NUMPORTS = 0;
+bool cut_through = false;
+#define NET_IP_ALIGN 2
+
+#include "mactable.h"
+#include "packet.h"
+#include "capture.h"
+
+static int failures = 0;
+
+static bool matches(const char * expr, const uint8_t * dst, uint16_t ethtype) {
+    std::vector<std::string> words;
+    std::string e(expr);
+    for (size_t pos = 0; pos < e.size(); ) {
+        size_t end = e.find(' ', pos);
+        if (end == std::string::npos)
+            end = e.size();
+        words.push_back(e.substr(pos, end - pos));
+        pos = end + 1;
+    }
+    std::vector<capturefilterterm> terms;
+    if (!parse_capture_filter(words, terms)) {
+        fprintf(stderr, "cannot parse '%s'\n", expr);
+        exit(1);
+    }
+
+    switchpacket sp;
+    memset(&sp, 0, sizeof(sp));
+    uint8_t * f = frame_bytes(&sp);
+    const uint8_t src[6] = { 0x00, 0x12, 0x6d, 0x00, 0x00, 0x01 };
+    memcpy(f, dst, 6);
+    memcpy(f + 6, src, 6);
+    f[12] = ethtype >> 8;
+    f[13] = ethtype & 0xff;
+    sp.amtwritten = 8;
+
+    for (size_t i = 0; i < terms.size(); i++) {
+        if (capture_filter_term(terms[i], &sp) == terms[i].negate)
+            return false;
+    }
+    return true;
+}
+
+static void expect(const char * expr, const char * what, const uint8_t * dst, uint16_t ethtype,
+        bool want) {
+    if (matches(expr, dst, ethtype) != want) {
+        fprintf(stderr, "FAIL: '%s' %s %s\n", expr, want ? "should match" : "should not match", what);
+        failures++;
+    }
+}
+
+int main() {
+    const uint8_t bcast[6] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+    const uint8_t ipv6_nd[6] = { 0x33, 0x33, 0xff, 0x00, 0x00, 0x01 };
+    const uint8_t lldp[6] = { 0x01, 0x80, 0xc2, 0x00, 0x00, 0x0e };
+    const uint8_t pause[6] = { 0x01, 0x80, 0xc2, 0x00, 0x00, 0x01 };
+    const uint8_t unicast[6] = { 0x00, 0x12, 0x6d, 0x00, 0x00, 0x02 };
+
+    expect("broadcast", "a broadcast", bcast, ETHTYPE_ARP, true);
+    expect("broadcast", "an IPv6 multicast", ipv6_nd, 0x86dd, false);
+    expect("broadcast", "LLDP", lldp, 0x88cc, false);
+    expect("broadcast", "a PAUSE frame", pause, ETHTYPE_MAC_CONTROL, false);
+    expect("broadcast", "a unicast", unicast, 0x0800, false);
+    expect("not broadcast", "an IPv6 multicast", ipv6_nd, 0x86dd, true);
+    expect("pause", "a PAUSE frame", pause, ETHTYPE_MAC_CONTROL, true);
+    expect("arp and broadcast", "a broadcast ARP", bcast, ETHTYPE_ARP, true);
+
+    if (failures)
+        return 1;
+    printf("capture filter: all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,432 @@
+/* Packet capture to pcapng.
+ *
+ * With a capture file set in the switch config, every captured port gets a
+ * single-producer/single-consumer ring of fixed-size records. The port's
+ * shard copies each frame it receives (after the link, before switching)
+ * and each frame it starts sending into the ring, and never waits: if the
+ * ring is full the record is dropped and counted. A background writer
+ * thread drains the rings into one pcapng file, with one interface per
+ * captured port and the direction in each packet's flags. Timestamps are
+ * simulated cycles converted to ns at CAPTURE_CLOCK_MHZ.
+ *
+ * The filter is a small subset of pcap-filter(7): primitives joined by
+ * "and", each optionally negated with "not":
+ *   ether host|src|dst MAC, broadcast, vlan, arp, ip, tcp, udp, pause,
+ *   host|src host|dst host A.B.C.D, port|src port|dst port N
+ * "or" and parentheses are not supported. */
+
+// each ring gets the largest power of two of records that fits in this
+#define CAPTURE_RING_BYTES (4 << 20)
+#define CAPTURE_CLOCK_MHZ 3200
+#define CAPTURE_MAX_BYTES (sizeof(((switchpacket*)0)->dat) - NET_IP_ALIGN)
+// writer thread sleep when all rings are empty
+#define CAPTURE_IDLE_NS 1000000
+
+#define CAPTURE_IN 1
+#define CAPTURE_OUT 2
+
+#define ETHTYPE_ARP 0x0806
+#define ETHTYPE_MAC_CONTROL 0x8808
+
+enum capturefilterkind {
+    CF_ETHER_HOST, CF_ETHER_SRC, CF_ETHER_DST, CF_BROADCAST, CF_VLAN,
+    CF_ARP, CF_IP, CF_TCP, CF_UDP, CF_PAUSE,
+    CF_HOST, CF_SRC_HOST, CF_DST_HOST, CF_PORT, CF_SRC_PORT, CF_DST_PORT
+};
+
+struct capturefilterterm {
+    capturefilterkind kind;
+    bool negate;
+    uint64_t value; // MAC, IPv4 address or L4 port, in host order
+};
+
+struct capturerecord {
+    uint64_t cycle;
+    uint32_t len;
+    uint32_t caplen;
+    uint32_t direction;
+    uint8_t data[];
+};
+
+struct capturering {
+    alignas(64) std::atomic<uint32_t> head{0}; // written by the port's shard
+    alignas(64) std::atomic<uint32_t> tail{0}; // written by the writer thread
+    alignas(64) uint64_t dropped = 0;
+    uint32_t ifid; // pcapng interface of this port
+    uint8_t * slots;
+};
+
+// NULL if capture is off. indexed by port, NULL for ports not captured
+capturering ** capture_rings = NULL;
+static std::vector<capturefilterterm> capture_filter;
+static uint32_t capture_snaplen = CAPTURE_MAX_BYTES;
+static size_t capture_slot_bytes;
+static uint32_t capture_ring_slots;
+static FILE * capture_file;
+static pthread_t capture_thread;
+static std::atomic<bool> capture_running;
+
+/* parse a filter expression, already split into words. returns false on
+ * anything it doesn't understand. */
+static bool parse_capture_filter(const std::vector<std::string> &words,
+        std::vector<capturefilterterm> &terms) {
+    size_t i = 0;
+    while (i < words.size()) {
+        capturefilterterm term = { CF_IP, false, 0 };
+        if (!terms.empty()) {
+            if (words[i] != "and" && words[i] != "&&")
+                return false;
+            i++;
+        }
+        while (i < words.size() && (words[i] == "not" || words[i] == "!")) {
+            term.negate = !term.negate;
+            i++;
+        }
+        if (i >= words.size())
+            return false;
+
+        std::string word = words[i++];
+        std::string qual;
+        if (word == "src" || word == "dst") {
+            qual = word;
+            if (i >= words.size())
+                return false;
+            word = words[i++];
+        }
+
+        if (word == "ether") {
+            if (i + 1 >= words.size())
+                return false;
+            std::string which = words[i++];
+            if (!parse_mac(words[i++].c_str(), &term.value))
+                return false;
+            if (which == "host")
+                term.kind = CF_ETHER_HOST;
+            else if (which == "src")
+                term.kind = CF_ETHER_SRC;
+            else if (which == "dst")
+                term.kind = CF_ETHER_DST;
+            else
+                return false;
+        } else if (word == "host") {
+            struct in_addr addr;
+            if (i >= words.size() || !inet_aton(words[i++].c_str(), &addr))
+                return false;
+            term.value = ntohl(addr.s_addr);
+            term.kind = qual == "src" ? CF_SRC_HOST : qual == "dst" ? CF_DST_HOST : CF_HOST;
+        } else if (word == "port") {
+            char * end;
+            if (i >= words.size())
+                return false;
+            term.value = strtoul(words[i].c_str(), &end, 10);
+            if (*end != '\0' || term.value > 0xffff)
+                return false;
+            i++;
+            term.kind = qual == "src" ? CF_SRC_PORT : qual == "dst" ? CF_DST_PORT : CF_PORT;
+        } else if (!qual.empty()) {
+            return false;
+        } else if (word == "broadcast") {
+            term.kind = CF_BROADCAST;
+        } else if (word == "vlan") {
+            term.kind = CF_VLAN;
+        } else if (word == "arp") {
+            term.kind = CF_ARP;
+        } else if (word == "ip") {
+            term.kind = CF_IP;
+        } else if (word == "tcp") {
+            term.kind = CF_TCP;
+        } else if (word == "udp") {
+            term.kind = CF_UDP;
+        } else if (word == "pause") {
+            term.kind = CF_PAUSE;
+        } else {
+            return false;
+        }
+        terms.push_back(term);
+    }
+    return true;
+}
+
+static uint64_t get_mac(uint8_t * p) {
+    uint64_t mac = 0;
+    for (int i = 0; i < 6; i++)
+        mac = (mac << 8) | p[i];
+    return mac;
+}
+
+static bool capture_filter_term(const capturefilterterm &term, switchpacket * sp) {
+    uint8_t * f = frame_bytes(sp);
+    uint16_t ethtype;
+    int pcp;
+    int l3 = frame_l3_offset(sp, &ethtype, &pcp);
+    if (l3 < 0)
+        return false;
+
+    switch (term.kind) {
+        case CF_ETHER_HOST:
+            return get_mac(f) == term.value || get_mac(f + 6) == term.value;
+        case CF_ETHER_SRC:
+            return get_mac(f + 6) == term.value;
+        case CF_ETHER_DST:
+            return get_mac(f) == term.value;
+        case CF_BROADCAST:
+            // ff:ff:ff:ff:ff:ff only; other group addresses are multicast
+            return get_mac(f) == 0xffffffffffffUL;
+        case CF_VLAN:
+            return get_be16(f + 12) == ETHTYPE_VLAN;
+        case CF_ARP:
+            return ethtype == ETHTYPE_ARP;
+        case CF_PAUSE:
+            return ethtype == ETHTYPE_MAC_CONTROL;
+        default:
+            break;
+    }
+
+    int off = frame_ipv4_offset(sp);
+    if (off < 0)
+        return false;
+    uint8_t * ip = f + off;
+    uint8_t proto = ip[9];
+    uint32_t src = ((uint32_t)get_be16(ip + 12) << 16) | get_be16(ip + 14);
+    uint32_t dst = ((uint32_t)get_be16(ip + 16) << 16) | get_be16(ip + 18);
+    switch (term.kind) {
+        case CF_IP:
+            return true;
+        case CF_TCP:
+            return proto == IPPROTO_TCP_NUM;
+        case CF_UDP:
+            return proto == IPPROTO_UDP_NUM;
+        case CF_HOST:
+            return src == term.value || dst == term.value;
+        case CF_SRC_HOST:
+            return src == term.value;
+        case CF_DST_HOST:
+            return dst == term.value;
+        default:
+            break;
+    }
+
+    int l4 = off + (ip[0] & 0xf) * 4;
+    if ((proto != IPPROTO_TCP_NUM && proto != IPPROTO_UDP_NUM) ||
+            (get_be16(ip + 6) & 0x1fff) || frame_len(sp) < l4 + 4)
+        return false;
+    uint16_t sport = get_be16(f + l4);
+    uint16_t dport = get_be16(f + l4 + 2);
+    switch (term.kind) {
+        case CF_PORT:
+            return sport == term.value || dport == term.value;
+        case CF_SRC_PORT:
+            return sport == term.value;
+        case CF_DST_PORT:
+            return dport == term.value;
+        default:
+            return false;
+    }
+}
+
+static void capture_packet_slow(capturering * ring, int direction, switchpacket * sp,
+        int flits, uint64_t cycle) {
+    for (size_t i = 0; i < capture_filter.size(); i++) {
+        if (capture_filter_term(capture_filter[i], sp) == capture_filter[i].negate)
+            return;
+    }
+
+    uint32_t head = ring->head.load(std::memory_order_relaxed);
+    if (head - ring->tail.load(std::memory_order_acquire) == capture_ring_slots) {
+        ring->dropped++;
+        return;
+    }
+    capturerecord * rec = (capturerecord*)(ring->slots +
+            (head & (capture_ring_slots - 1)) * capture_slot_bytes);
+    int len = std::max(flits * (int)sizeof(uint64_t) - NET_IP_ALIGN, 0);
+    rec->cycle = cycle;
+    rec->len = len;
+    rec->caplen = std::min((uint32_t)len, capture_snaplen);
+    rec->direction = direction;
+    memcpy(rec->data, frame_bytes(sp), rec->caplen);
+    if (direction == CAPTURE_OUT && sp->mark_ce) {
+        // it went out marked, though the packet itself wasn't changed
+        int off = frame_ipv4_offset(sp);
+        if (off >= 0 && off + 12 <= (int)rec->caplen)
+            ipv4_mark_ce(rec->data + off);
+    }
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+/* record the first flits of a frame crossing port, if that port is being
+ * captured. cheap when capture is off. */
+static inline void capture_packet(int port, int direction, switchpacket * sp, int flits,
+        uint64_t cycle) {
+    if (capture_rings && capture_rings[port])
+        capture_packet_slow(capture_rings[port], direction, sp, flits, cycle);
+}
+
+/* pcapng blocks. all lengths are padded to 4 bytes */
+
+static void pcapng_put(const void * p, size_t len) {
+    static const uint8_t zeros[4] = {};
+    fwrite(p, 1, len, capture_file);
+    if (len % 4)
+        fwrite(zeros, 1, 4 - len % 4, capture_file);
+}
+
+static void pcapng_put32(uint32_t v) {
+    fwrite(&v, sizeof(v), 1, capture_file);
+}
+
+static size_t pad4(size_t len) {
+    return (len + 3) & ~(size_t)3;
+}
+
+static void pcapng_section_header() {
+    uint32_t blocklen = 28;
+    int64_t section_len = -1;
+    pcapng_put32(0x0A0D0D0A);
+    pcapng_put32(blocklen);
+    pcapng_put32(0x1A2B3C4D);
+    uint16_t version[2] = { 1, 0 };
+    fwrite(version, sizeof(version), 1, capture_file);
+    fwrite(&section_len, sizeof(section_len), 1, capture_file);
+    pcapng_put32(blocklen);
+}
+
+static void pcapng_interface(int port) {
+    char name[32];
+    int namelen = snprintf(name, sizeof(name), "port%d", port);
+    uint8_t tsresol = 9; // ns
+    uint32_t blocklen = 20 + 4 + pad4(namelen) + 4 + 4 + 4;
+    pcapng_put32(1);
+    pcapng_put32(blocklen);
+    uint16_t linktype[2] = { 1 /* ethernet */, 0 };
+    fwrite(linktype, sizeof(linktype), 1, capture_file);
+    pcapng_put32(capture_snaplen);
+    uint16_t opt[2] = { 2 /* if_name */, (uint16_t)namelen };
+    fwrite(opt, sizeof(opt), 1, capture_file);
+    pcapng_put(name, namelen);
+    opt[0] = 9; // if_tsresol
+    opt[1] = 1;
+    fwrite(opt, sizeof(opt), 1, capture_file);
+    pcapng_put(&tsresol, 1);
+    pcapng_put32(0); // opt_endofopt
+    pcapng_put32(blocklen);
+}
+
+static void pcapng_packet(uint32_t ifid, capturerecord * rec) {
+    uint64_t ns = rec->cycle * 1000 / CAPTURE_CLOCK_MHZ;
+    uint32_t blocklen = 28 + pad4(rec->caplen) + 8 + 4 + 4;
+    pcapng_put32(6);
+    pcapng_put32(blocklen);
+    pcapng_put32(ifid);
+    pcapng_put32(ns >> 32);
+    pcapng_put32(ns & 0xffffffff);
+    pcapng_put32(rec->caplen);
+    pcapng_put32(rec->len);
+    pcapng_put(rec->data, rec->caplen);
+    uint16_t opt[2] = { 2 /* epb_flags */, 4 };
+    fwrite(opt, sizeof(opt), 1, capture_file);
+    pcapng_put32(rec->direction);
+    pcapng_put32(0);
+    pcapng_put32(blocklen);
+}
+
+// write out everything in the rings. returns the number of records written
+static int capture_drain() {
+    int written = 0;
+    for (int port = 0; port < NUMPORTS; port++) {
+        capturering * ring = capture_rings[port];
+        if (!ring)
+            continue;
+        uint32_t tail = ring->tail.load(std::memory_order_relaxed);
+        uint32_t head = ring->head.load(std::memory_order_acquire);
+        for (; tail != head; tail++) {
+            pcapng_packet(ring->ifid, (capturerecord*)(ring->slots +
+                        (tail & (capture_ring_slots - 1)) * capture_slot_bytes));
+            written++;
+        }
+        ring->tail.store(tail, std::memory_order_release);
+    }
+    return written;
+}
+
+static void * capture_writer(void *) {
+    struct timespec idle = { 0, CAPTURE_IDLE_NS };
+    while (capture_running.load(std::memory_order_acquire)) {
+        if (capture_drain() == 0) {
+            // flush when idle so a killed switch leaves a readable file
+            fflush(capture_file);
+            nanosleep(&idle, NULL);
+        }
+    }
+    capture_drain();
+    return NULL;
+}
+
+/* open the capture file, write its header, and start the writer thread.
+ * captured[i] says whether port i is captured. */
+void capture_start(const char * path, uint32_t snaplen,
+        const std::vector<capturefilterterm> &filter, const std::vector<bool> &captured) {
+    capture_file = fopen(path, "wb");
+    if (!capture_file) {
+        perror("opening capture file");
+        exit(1);
+    }
+    capture_snaplen = std::min(snaplen, (uint32_t)CAPTURE_MAX_BYTES);
+    capture_filter = filter;
+    capture_slot_bytes = pad4(sizeof(capturerecord) + capture_snaplen);
+    capture_slot_bytes = (capture_slot_bytes + 7) & ~(size_t)7;
+    capture_ring_slots = 1;
+    while (capture_ring_slots * 2 * capture_slot_bytes <= CAPTURE_RING_BYTES)
+        capture_ring_slots *= 2;
+
+    pcapng_section_header();
+    capture_rings = new capturering*[NUMPORTS];
+    uint32_t ifid = 0;
+    for (int port = 0; port < NUMPORTS; port++) {
+        capture_rings[port] = NULL;
+        if (!captured[port])
+            continue;
+        // plain new doesn't honour alignas(64) before C++17
+        void * mem;
+        if (posix_memalign(&mem, 64, sizeof(capturering))) {
+            perror("allocating capture ring");
+            exit(1);
+        }
+        capturering * ring = new (mem) capturering;
+        ring->ifid = ifid++;
+        ring->slots = (uint8_t*)malloc(capture_ring_slots * capture_slot_bytes);
+        capture_rings[port] = ring;
+        pcapng_interface(port);
+    }
+    fprintf(stdout, "capturing %u ports to %s, snaplen %u, %lu filter terms, %u record rings\n",
+            ifid, path, capture_snaplen, filter.size(), capture_ring_slots);
+
+    capture_running = true;
+    if (pthread_create(&capture_thread, NULL, capture_writer, NULL)) {
+        perror("pthread_create");
+        exit(1);
+    }
+}
+
+/* drain the rings and close the file. only reached on bounded runs; an
+ * unbounded switch's file is flushed whenever the writer is idle. */
+void capture_stop() {
+    if (!capture_rings)
+        return;
+    capture_running = false;
+    pthread_join(capture_thread, NULL);
+    fclose(capture_file);
+
+    uint64_t dropped = 0;
+    for (int port = 0; port < NUMPORTS; port++) {
+        capturering * ring = capture_rings[port];
+        if (!ring)
+            continue;
+        dropped += ring->dropped;
+        free(ring->slots);
+        ring->~capturering();
+        free(ring);
+    }
+    delete[] capture_rings;
+    capture_rings = NULL;
+    fprintf(stdout, "capture: %lu records dropped on full rings\n", dropped);
+}
@@ -2,6 +2,9 @@
 
 #define BROADCAST_ADJUSTED (0xffff)
 
+// uplink selection is done by each routing thread, so each gets its own seed
+thread_local unsigned int route_seed = 1;
+
 /* ----------------------------------------------------
  * buffer flit operations
  *
@@ -49,7 +52,7 @@ void write_valid_flit(uint8_t * send_buf, int tokenid) {
     *lrv |= (1L << bitoffset);
 }
 
-int write_last_flit(uint8_t * send_buf, int tokenid, int is_last) {
+void write_last_flit(uint8_t * send_buf, int tokenid, int is_last) {
     int base = tokenid / TOKENS_PER_BIGTOKEN;
     int offset = tokenid % TOKENS_PER_BIGTOKEN;
 
@@ -58,28 +61,41 @@ int write_last_flit(uint8_t * send_buf, int tokenid, int is_last) {
     *lrv |= (((uint64_t)is_last) << bitoffset);
 }
 
-/* get dest mac from flit, then get port from mac */
-uint16_t get_port_from_flit(uint64_t flit, int current_port) {
+// write a flit to send_buf and mark it valid (and last), in one go
+void write_output_flit(uint8_t * send_buf, int tokenid, uint64_t flit, bool is_last) {
+    int base = tokenid / TOKENS_PER_BIGTOKEN;
+    int offset = tokenid % TOKENS_PER_BIGTOKEN;
+
+    uint64_t * lrv = ((uint64_t*)send_buf) + base*8;
+    *lrv |= (1UL | ((uint64_t)is_last << 2)) << (43 + offset * 3);
+    lrv[offset+1] = flit;
+}
+
+/* pick the uplink for a packet headed to "any uplink" */
+uint16_t pick_uplink(switchpacket * sp) {
+    if (multipath == MULTIPATH_RANDOM)
+        return NUMDOWNLINKS + rand_r(&route_seed) % NUMUPLINKS;
+    // multiply-shift the top of the hash instead of a modulo
+    uint64_t h = flow_hash(sp, hash_seed) >> 32;
+    return NUMDOWNLINKS + (uint16_t)((h * NUMUPLINKS) >> 32);
+}
+
+/* get dest mac from the first flit, then get port from mac */
+uint16_t get_port_from_packet(switchpacket * sp) {
+    uint64_t flit = sp->dat[0];
     uint16_t is_multicast = (flit >> 16) & 0x1;
-    uint16_t flit_low = (flit >> 48) & 0xFFFF; // indicates dest
-    uint16_t sendport = (__builtin_bswap16(flit_low));
 
     if (is_multicast)
 	return BROADCAST_ADJUSTED;
 
-    sendport = sendport & 0xFFFF;
-    //printf("mac: %04x\n", sendport);
-
     // At this point, we know the MAC address is not a broadcast address,
-    // so we can just look up the port in the mac2port table
-    sendport = mac2port[sendport];
+    // so we can just look up the port in the mac table
+    uint16_t sendport = mac_table.lookup(mac_from_flit(flit));
+    //printf("mac: %012lx\n", mac_from_flit(flit));
 
-    if (sendport == NUMDOWNLINKS) {
+    if ((NUMUPLINKS > 0) && (sendport == NUMDOWNLINKS)) {
         // this has been mapped to "any uplink", so pick one
-        int randval = rand() % NUMUPLINKS;
-        sendport = randval + NUMDOWNLINKS;
-//        printf("sending to random uplink.\n");
-//        printf("port: %04x\n", sendport);
+        sendport = pick_uplink(sp);
     }
     //printf("port: %04x\n", sendport);
     return sendport;
@@ -0,0 +1,79 @@
+/* MAC address -> port lookup, sized at runtime from the switch config.
+ *
+ * Open addressing with linear probing over a power-of-two table kept at most
+ * half full. Each entry is a single word, the 48-bit MAC in the low bits and
+ * the port in the high 16, so a probe sequence usually stays in one cache
+ * line. MACs not in the table go to the default port. */
+
+#define MAC_BITS 48
+#define MAC_MASK ((1UL << MAC_BITS) - 1)
+#define MACTABLE_EMPTY (~0UL)
+
+// the dest MAC is the first 6 bytes of the frame, after NET_IP_ALIGN (2 bytes)
+// of padding, so it is the top 6 bytes of the first flit in network order
+static inline uint64_t mac_from_flit(uint64_t flit) {
+    return __builtin_bswap64(flit) & MAC_MASK;
+}
+
+static inline uint64_t flit_from_mac(uint64_t mac) {
+    return __builtin_bswap64(mac & MAC_MASK);
+}
+
+// parse XX:XX:XX:XX:XX:XX
+static bool parse_mac(const char * str, uint64_t * mac) {
+    unsigned int b[6];
+    if (sscanf(str, "%x:%x:%x:%x:%x:%x", &b[0], &b[1], &b[2], &b[3], &b[4], &b[5]) != 6)
+        return false;
+    *mac = 0;
+    for (int i = 0; i < 6; i++) {
+        if (b[i] > 0xff)
+            return false;
+        *mac = (*mac << 8) | b[i];
+    }
+    return true;
+}
+
+class MacTable {
+    public:
+        void init(size_t nentries, uint16_t default_port);
+        void insert(uint64_t mac, uint16_t port);
+        uint16_t lookup(uint64_t mac) const;
+    private:
+        size_t slot(uint64_t mac) const {
+            return (mac * 0x9E3779B97F4A7C15UL) >> (64 - _bits);
+        }
+        uint64_t * _entries = NULL;
+        size_t _mask = 0;
+        int _bits = 0;
+        uint16_t _default_port = 0;
+};
+
+void MacTable::init(size_t nentries, uint16_t default_port) {
+    _bits = 4;
+    while ((1UL << _bits) < 2 * nentries)
+        _bits++;
+    _mask = (1UL << _bits) - 1;
+    _entries = new uint64_t[_mask + 1];
+    std::fill(_entries, _entries + _mask + 1, MACTABLE_EMPTY);
+    _default_port = default_port;
+}
+
+void MacTable::insert(uint64_t mac, uint16_t port) {
+    mac &= MAC_MASK;
+    for (size_t i = slot(mac); ; i = (i + 1) & _mask) {
+        if (_entries[i] == MACTABLE_EMPTY || (_entries[i] & MAC_MASK) == mac) {
+            _entries[i] = mac | ((uint64_t)port << MAC_BITS);
+            return;
+        }
+    }
+}
+
+uint16_t MacTable::lookup(uint64_t mac) const {
+    for (size_t i = slot(mac); ; i = (i + 1) & _mask) {
+        uint64_t entry = _entries[i];
+        if (entry == MACTABLE_EMPTY)
+            return _default_port;
+        if ((entry & MAC_MASK) == mac)
+            return entry >> MAC_BITS;
+    }
+}
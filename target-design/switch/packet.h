@@ -0,0 +1,256 @@
+#define MAX_PACKET_FLITS 200
+
+struct switchpacket {
+    uint64_t timestamp;
+    uint64_t dat[MAX_PACKET_FLITS];
+    int amtwritten;
+    int amtread;
+    int sender;
+    int priority; // traffic class, set when it is routed
+    struct switchpacket * next; // link in whatever packetlist holds it
+
+    // output side
+    uint32_t qbytes; // bytes it takes up in its output queue
+    bool mark_ce; // set CE on the way out
+    uint64_t txstart; // cycle its first flit went out
+
+    // cut-through: the packet is routed once its headers are in, and the
+    // rest is filled in by the input side while the output side sends it.
+    // amtwritten stays at the header length until the output side sees
+    // CUT_DONE; the input side counts in cut_flits and publishes to
+    // cut_avail. see release_packet for who frees it.
+    bool cut_through;
+    int cut_flits;
+    int cut_avail;
+    int cut_flags;
+    // arrival of each flit, in cycles after the first (saturating). must
+    // stay last: it is only allocated with cut-through on
+    uint16_t flittime[MAX_PACKET_FLITS];
+};
+
+typedef struct switchpacket switchpacket;
+
+// bytes of a packet as allocated, leaving out flittime unless it's used
+static inline size_t switchpacket_bytes() {
+    return cut_through ? sizeof(switchpacket) : offsetof(switchpacket, flittime);
+}
+
+static inline switchpacket * alloc_packet() {
+    return (switchpacket*)calloc(switchpacket_bytes(), 1);
+}
+
+static inline switchpacket * copy_packet(switchpacket * sp) {
+    switchpacket * copy = (switchpacket*)malloc(switchpacket_bytes());
+    memcpy(copy, sp, switchpacket_bytes());
+    return copy;
+}
+
+/* FIFO of packets linked through switchpacket::next, so queueing a packet
+ * touches only the packet and the list, never a separate node. A packet is
+ * in at most one list at a time. Same interface as std::queue. */
+struct packetlist {
+    switchpacket * head = NULL;
+    switchpacket * tail = NULL;
+
+    bool empty() const { return head == NULL; }
+    switchpacket * front() const { return head; }
+
+    void push(switchpacket * sp) {
+        sp->next = NULL;
+        if (tail)
+            tail->next = sp;
+        else
+            head = sp;
+        tail = sp;
+    }
+
+    void pop() {
+        head = head->next;
+        if (!head)
+            tail = NULL;
+    }
+};
+
+/* Header parsing on frames held in a switchpacket.
+ *
+ * Frames arrive with NET_IP_ALIGN bytes of padding in front, so frame byte
+ * i lives at byte i + NET_IP_ALIGN of dat. All multi-byte header fields are
+ * big-endian. */
+
+#define NET_IP_ALIGN 2
+
+#define ETHTYPE_IPV4 0x0800
+#define ETHTYPE_VLAN 0x8100
+
+#define ETH_HEADER_BYTES 14
+#define VLAN_TAG_BYTES 4
+
+#define IP_ECN_MASK 0x3
+#define IP_ECN_NOT_ECT 0x0
+#define IP_ECN_CE 0x3
+
+#define NUM_PRIORITIES 8
+
+static inline uint8_t * frame_bytes(switchpacket * sp) {
+    return (uint8_t*)sp->dat + NET_IP_ALIGN;
+}
+
+static inline int frame_len(switchpacket * sp) {
+    return sp->amtwritten * sizeof(uint64_t) - NET_IP_ALIGN;
+}
+
+static inline uint16_t get_be16(uint8_t * p) {
+    return (p[0] << 8) | p[1];
+}
+
+static inline void put_be16(uint8_t * p, uint16_t val) {
+    p[0] = val >> 8;
+    p[1] = val & 0xff;
+}
+
+/* offset of the L3 header, skipping one VLAN tag if there is one. sets
+ * *ethtype to the L3 ethertype and *pcp to the tag's priority (0 if
+ * untagged). returns -1 if the frame is too short. */
+static int frame_l3_offset(switchpacket * sp, uint16_t * ethtype, int * pcp) {
+    uint8_t * f = frame_bytes(sp);
+    int len = frame_len(sp);
+    int off = ETH_HEADER_BYTES;
+
+    if (len < ETH_HEADER_BYTES)
+        return -1;
+    *ethtype = get_be16(f + 12);
+    *pcp = 0;
+    if (*ethtype == ETHTYPE_VLAN) {
+        if (len < ETH_HEADER_BYTES + VLAN_TAG_BYTES)
+            return -1;
+        *pcp = f[14] >> 5;
+        *ethtype = get_be16(f + 16);
+        off += VLAN_TAG_BYTES;
+    }
+    return off;
+}
+
+/* offset of the IPv4 header, or -1 if this isn't an IPv4 frame */
+static int frame_ipv4_offset(switchpacket * sp) {
+    uint16_t ethtype;
+    int pcp;
+    int off = frame_l3_offset(sp, &ethtype, &pcp);
+    if (off < 0 || ethtype != ETHTYPE_IPV4 || frame_len(sp) < off + 20)
+        return -1;
+    if ((frame_bytes(sp)[off] >> 4) != 4)
+        return -1;
+    return off;
+}
+
+/* traffic class of a frame: the VLAN PCP if tagged, otherwise the top
+ * three bits of the IPv4 DSCP, otherwise 0 */
+static int packet_priority(switchpacket * sp) {
+    uint16_t ethtype;
+    int pcp;
+    int off = frame_l3_offset(sp, &ethtype, &pcp);
+    if (off < 0)
+        return 0;
+    if (get_be16(frame_bytes(sp) + 12) == ETHTYPE_VLAN)
+        return pcp;
+    if (ethtype == ETHTYPE_IPV4 && frame_len(sp) >= off + 2
+            && (frame_bytes(sp)[off] >> 4) == 4)
+        return frame_bytes(sp)[off + 1] >> 5;
+    return 0;
+}
+
+// whether a frame is ECN-capable IPv4
+static bool ipv4_ecn_capable(switchpacket * sp) {
+    int off = frame_ipv4_offset(sp);
+    return off >= 0 && (frame_bytes(sp)[off + 1] & IP_ECN_MASK) != IP_ECN_NOT_ECT;
+}
+
+/* mark an ECN-capable IPv4 header Congestion Experienced, patching the
+ * header checksum incrementally (RFC 1624). ip may point into a copy of
+ * the frame. */
+static void ipv4_mark_ce(uint8_t * ip) {
+    uint8_t tos = ip[1];
+    if ((tos & IP_ECN_MASK) == IP_ECN_NOT_ECT || (tos & IP_ECN_MASK) == IP_ECN_CE)
+        return;
+
+    // the checksum covers the version/ihl/tos word
+    uint16_t oldword = get_be16(ip);
+    ip[1] = tos | IP_ECN_CE;
+    uint16_t newword = get_be16(ip);
+    uint32_t sum = (uint16_t)~get_be16(ip + 10) + (uint16_t)~oldword + newword;
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    put_be16(ip + 10, ~sum);
+}
+
+/* bytes the whole frame will take, as flits. cut-through packets only have
+ * their headers in, so this goes by the IPv4 length if it can */
+static uint32_t packet_queue_bytes(switchpacket * sp) {
+    if (!sp->cut_through)
+        return sp->amtwritten * sizeof(uint64_t);
+    int off = frame_ipv4_offset(sp);
+    if (off < 0)
+        return sp->amtwritten * sizeof(uint64_t);
+    uint32_t bytes = NET_IP_ALIGN + off + get_be16(frame_bytes(sp) + off + 2);
+    bytes = (bytes + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+    bytes = std::max(bytes, (uint32_t)(sp->amtwritten * sizeof(uint64_t)));
+    return std::min(bytes, (uint32_t)(MAX_PACKET_FLITS * sizeof(uint64_t)));
+}
+
+#define CUT_DONE 1     // the input side has the last flit in
+#define CUT_RELEASED 2 // the output side is done with it
+
+/* drop a packet. a cut-through packet may still be being filled in by its
+ * input side, so whichever side finishes with it last frees it */
+static void release_packet(switchpacket * sp) {
+    if (!sp->cut_through ||
+            (__atomic_fetch_or(&sp->cut_flags, CUT_RELEASED, __ATOMIC_ACQ_REL) & CUT_DONE))
+        free(sp);
+}
+
+#define IPPROTO_TCP_NUM 6
+#define IPPROTO_UDP_NUM 17
+
+// 64-bit finalizer: every input bit affects every output bit
+static inline uint64_t hash_mix(uint64_t x) {
+    x ^= x >> 32;
+    x *= 0xd6e8feb86659fd93UL;
+    x ^= x >> 32;
+    x *= 0xd6e8feb86659fd93UL;
+    x ^= x >> 32;
+    return x;
+}
+
+/* hash of the flow a frame belongs to, for multipath routing. IPv4 frames
+ * hash on the 5-tuple (ports only for unfragmented TCP/UDP), anything else
+ * on its source and destination MACs. the tuple is packed into two words
+ * and mixed with a couple of multiplies, no tables or per-byte loops.
+ * seed should differ per switch, or every tier of a tree picks the same
+ * path index for the same flows. */
+static uint64_t flow_hash(switchpacket * sp, uint64_t seed) {
+    uint8_t * f = frame_bytes(sp);
+    int off = frame_ipv4_offset(sp);
+    uint64_t w0, w1;
+
+    if (off < 0) {
+        w0 = 0;
+        w1 = 0;
+        memcpy(&w0, f, 6);
+        memcpy(&w1, f + 6, 6);
+        return hash_mix(hash_mix(w0 ^ seed) ^ w1);
+    }
+
+    uint8_t * ip = f + off;
+    int ihl = (ip[0] & 0xf) * 4;
+    uint8_t proto = ip[9];
+    bool fragment = get_be16(ip + 6) & 0x3fff; // MF or an offset
+    uint32_t src, dst, l4ports = 0;
+    memcpy(&src, ip + 12, 4);
+    memcpy(&dst, ip + 16, 4);
+    if ((proto == IPPROTO_TCP_NUM || proto == IPPROTO_UDP_NUM) && !fragment &&
+            frame_len(sp) >= off + ihl + 4)
+        memcpy(&l4ports, ip + ihl, 4);
+
+    w0 = ((uint64_t)src << 32) | dst;
+    w1 = ((uint64_t)proto << 32) | l4ports;
+    return hash_mix(hash_mix(w0 ^ seed) ^ w1);
+}
@@ -0,0 +1,57 @@
+#!/usr/bin/env bash
+# Switch scaling benchmark: runs a switch with only SyntheticPorts for each
+# port count for a bounded number of rounds per traffic pattern, so the
+# switch itself is the only thing being measured.
+#
+# usage: ./scaling-bench.sh [THREADS] [ROUNDS]
+#   THREADS  worker threads per switch (default: one per cpu)
+#   ROUNDS   rounds per run (default: 2000)
+# Environment overrides: PORTCOUNTS, PATTERNS, LOAD, PACKETFLITS (N,
+# N:N:... or imix), LINKLATENCY, SWITCHLATENCY, BANDWIDTH.
+# Fails if any run's synthetic sinks saw misrouted, malformed or reordered
+# frames, so it doubles as a regression test.
+
+set -eo pipefail
+
+THREADS=${1:-0}
+ROUNDS=${2:-2000}
+PORTCOUNTS=${PORTCOUNTS:-"8 16 32 64 128"}
+PATTERNS=${PATTERNS:-"uniform incast permutation"}
+LOAD=${LOAD:-0.8}
+PACKETFLITS=${PACKETFLITS:-32}
+LINKLATENCY=${LINKLATENCY:-6405}
+SWITCHLATENCY=${SWITCHLATENCY:-10}
+BANDWIDTH=${BANDWIDTH:-200}
+
+SRCDIR=$(cd "$(dirname "$0")" && pwd)
+make -C "$SRCDIR" switch > /dev/null
+WORKDIR=$(mktemp -d)
+trap 'rm -rf "$WORKDIR"' EXIT
+
+THREADARG=""
+if [ "$THREADS" -gt 0 ]; then
+    THREADARG="+threads=$THREADS"
+fi
+
+for pattern in $PATTERNS; do
+    for nports in $PORTCOUNTS; do
+        config=$WORKDIR/$pattern-$nports.conf
+        {
+            echo "linklatency $LINKLATENCY"
+            echo "switchlatency $SWITCHLATENCY"
+            echo "bandwidth $BANDWIDTH"
+            echo "downlinks $nports"
+            echo "uplinks 0"
+            for ((i = 0; i < nports; i++)); do
+                echo "port $i synthetic $pattern $LOAD $PACKETFLITS"
+                # SYNTH_MAC_BASE + i
+                printf "mac 00:12:6d:%02x:%02x:%02x %d\n" \
+                    $((i >> 16 & 255)) $((i >> 8 & 255)) $((i & 255)) $i
+            done
+        } > "$config"
+
+        echo "== $pattern, $nports ports"
+        "$SRCDIR/switch" "$config" $THREADARG +rounds=$ROUNDS \
+            | grep -E "^(ran|synthetic|phases)"
+    done
+done
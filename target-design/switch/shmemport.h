@@ -1,5 +1,7 @@
 #include <errno.h>
 
+#include "shmemring.h"
+
 class ShmemPort : public BasePort {
     public:
         ShmemPort(int portNo, char * shmemportname, bool uplink);
@@ -8,32 +10,20 @@ class ShmemPort : public BasePort {
         void send();
         void recv();
     private:
-        uint8_t * recvbufs[2];
-        uint8_t * sendbufs[2];
-        int currentround = 0;
+        ShmemRing recvring;
+        ShmemRing sendring;
 };
 
 ShmemPort::ShmemPort(int portNo, char * shmemportname, bool uplink) : BasePort(portNo, !uplink) {
-#define SHMEM_EXTRABYTES 1
 #define SHMEM_NAME_SIZE 120
 
     // create shared memory regions
     char name[SHMEM_NAME_SIZE];
-    int shmemfd;
 
     char * recvdirection;
     char * senddirection;
 
-    int ftresult;
-
-    int shm_flags;
-    if (uplink) {
-        // uplink should not truncate on SHM_OPEN
-        shm_flags = O_RDWR /*| O_CREAT*/;
-    } else {
-        shm_flags = O_RDWR | O_CREAT | O_TRUNC;
-    }
-
+    // uplink should not truncate on SHM_OPEN; the downlink side creates
     if (uplink) {
         fprintf(stdout, "Uplink Port\n");
         recvdirection = "stn";
@@ -44,96 +34,35 @@ ShmemPort::ShmemPort(int portNo, char * shmemportname, bool uplink) : BasePort(p
         senddirection = "stn";
     }
 
-    for (int j = 0; j < 2; j++) {
-        int namelen;
-        if (shmemportname) {
-            fprintf(stdout, "Using non-slot-id associated shmemportname:\n");
-            namelen = snprintf(name, SHMEM_NAME_SIZE, "/port_%s%s_%d", recvdirection, shmemportname, j);
-            if (namelen >= SHMEM_NAME_SIZE) {
-                fprintf(stderr, "shmem port name /port_%s%s_%d too large\n",
-                        recvdirection, shmemportname, j);
-            }
-        } else {
-            fprintf(stdout, "Using slot-id associated shmemportname:\n");
-            snprintf(name, SHMEM_NAME_SIZE, "/port_%s%d_%d", recvdirection, _portNo, j);
-        }
-        fprintf(stdout, "opening/creating shmem region\n%s\n", name);
-        shmemfd = shm_open(name, shm_flags, S_IRWXU);
-
-        while (shmemfd == -1) {
-            perror("shm_open failed");
-            if (uplink) {
-                fprintf(stdout, "retrying in 1s...\n");
-                sleep(1);
-                shmemfd = shm_open(name, shm_flags, S_IRWXU);
-            } else {
-                abort();
-            }
-        }
-
-        if (!uplink) {
-            ftresult = ftruncate(shmemfd, BUFSIZE_BYTES+SHMEM_EXTRABYTES);
-            if (ftresult == -1) {
-                perror("ftruncate failed");
-                abort();
-            }
-        }
-
-        recvbufs[j] = (uint8_t*)mmap(NULL, BUFSIZE_BYTES+SHMEM_EXTRABYTES, PROT_READ | PROT_WRITE, MAP_SHARED, shmemfd,0);
-
-        if (recvbufs[j] == MAP_FAILED) {
-            perror("mmap failed");
-            abort();
-        }
-
-        if (!uplink) {
-            memset(recvbufs[j], 0, BUFSIZE_BYTES+SHMEM_EXTRABYTES);
-        }
-
-        if (shmemportname) {
-            fprintf(stdout, "Using non-slot-id associated shmemportname:\n");
-            sprintf(name, "/port_%s%s_%d", senddirection, shmemportname, j);
-        } else {
-            fprintf(stdout, "Using slot-id associated shmemportname:\n");
-            sprintf(name, "/port_%s%d_%d", senddirection, _portNo, j);
-        }
-        fprintf(stdout, "opening/creating shmem region\n%s\n", name);
-        shmemfd = shm_open(name, shm_flags, S_IRWXU);
-
-        while (shmemfd == -1) {
-            perror("shm_open failed");
-            if (uplink) {
-                fprintf(stdout, "retrying in 1s...\n");
-                sleep(1);
-                shmemfd = shm_open(name, shm_flags, S_IRWXU);
-            } else {
-                abort();
-            }
-        }
-
-        if (!uplink) {
-            ftresult = ftruncate(shmemfd, BUFSIZE_BYTES+SHMEM_EXTRABYTES);
-            if (ftresult == -1) {
-                perror("ftruncate failed");
-                abort();
-            }
-        }
-
-        sendbufs[j] = (uint8_t*)mmap(NULL, BUFSIZE_BYTES+SHMEM_EXTRABYTES, PROT_READ | PROT_WRITE, MAP_SHARED, shmemfd,0);
-
-        if (sendbufs[j] == MAP_FAILED) {
-            perror("mmap failed");
-            abort();
-        }
+    int namelen;
+    if (shmemportname) {
+        fprintf(stdout, "Using non-slot-id associated shmemportname:\n");
+        namelen = snprintf(name, SHMEM_NAME_SIZE, "/port_%s%s", recvdirection, shmemportname);
+    } else {
+        fprintf(stdout, "Using slot-id associated shmemportname:\n");
+        namelen = snprintf(name, SHMEM_NAME_SIZE, "/port_%s%d", recvdirection, _portNo);
+    }
+    if (namelen >= SHMEM_NAME_SIZE) {
+        fprintf(stderr, "shmem port name %s too large\n", name);
+        abort();
+    }
+    recvring.open(name, bufsize_bytes(), !uplink, port_node[_portNo]);
 
-        if (!uplink) {
-            memset(sendbufs[j], 0, BUFSIZE_BYTES+SHMEM_EXTRABYTES);
-        }
+    if (shmemportname) {
+        namelen = snprintf(name, SHMEM_NAME_SIZE, "/port_%s%s", senddirection, shmemportname);
+    } else {
+        namelen = snprintf(name, SHMEM_NAME_SIZE, "/port_%s%d", senddirection, _portNo);
     }
+    if (namelen >= SHMEM_NAME_SIZE) {
+        fprintf(stderr, "shmem port name %s too large\n", name);
+        abort();
+    }
+    sendring.open(name, bufsize_bytes(), !uplink, port_node[_portNo]);
 
-    // setup "current" bufs. tick will swap for shmem passing
-    current_input_buf = recvbufs[0];
-    current_output_buf = sendbufs[0];
+    // the first round we send is the empty one the ring was created with.
+    // the input buf is picked up in recv()
+    current_input_buf = NULL;
+    current_output_buf = sendring.producer_acquire();
 }
 
 void ShmemPort::send() {
@@ -142,24 +71,20 @@ void ShmemPort::send() {
         // (and in fact, we're writing too much, so stuff later will get confused)
         ((uint64_t*)current_output_buf)[0] = 0L;
     }
-    // mark flag to initiate "send"
-    current_output_buf[BUFSIZE_BYTES] = 1;
+    // hand this round to the peer
+    sendring.producer_publish();
 }
 
 void ShmemPort::recv() {
-    volatile uint8_t * polladdr = current_input_buf + BUFSIZE_BYTES;
-    while (*polladdr == 0) { ; } // poll
+    current_input_buf = recvring.consumer_acquire();
 }
 
 void ShmemPort::tick_pre() {
-    currentround = (currentround + 1) % 2;
-    current_output_buf = sendbufs[currentround];
+    // waits only if the peer is SHMEM_RING_SLOTS rounds behind
+    current_output_buf = sendring.producer_acquire();
 }
 
 void ShmemPort::tick() {
-    // zero out recv buf flag for next iter
-    current_input_buf[BUFSIZE_BYTES] = 0;
-
-    // swap buf pointers
-    current_input_buf = recvbufs[currentround];
+    // done with this round's input, give the slot back to the peer
+    recvring.consumer_release();
 }
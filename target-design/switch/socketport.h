@@ -1,28 +1,193 @@
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <errno.h>
 #include <unistd.h>
 
-class SocketClientPort : public BasePort {
+// size of the "compressed" (all-invalid) round sent over the socket
+#define COMPRESS_NUM_BYTES (8)
+
+// extra kernel socket buffer space, beyond two full rounds
+#define SOCKET_BUF_SLACK_BYTES (64 * 1024)
+
+/* Common code for both ends of a switch-to-switch TCP link.
+ *
+ * The socket is non-blocking. send() only starts transmitting a round and
+ * recv() drives both the outstanding send and the receive of the peer's
+ * round until the receive completes, so one link never waits on its own
+ * send buffer while the peer is also trying to send. Output buffers are
+ * double-buffered so that the tail of round N's send can drain while the
+ * switch is computing round N+1. */
+class SocketPort : public BasePort {
     public:
-        SocketClientPort(int portNo, char * serverip, int hostport);
+        SocketPort(int portNo);
         void tick();
         void tick_pre();
         void send();
         void recv();
+    protected:
+        void setup_buffers();
+        int sock = -1;
     private:
-        int clientsocket;
+        bool progress_send();
+        void finish_send();
+        uint8_t * sendbufs[2];
+        int currentround = 0;
+
+        uint8_t * pending_send_buf = NULL;
+        size_t pending_send_len = 0;
+        size_t pending_send_done = 0;
+};
+
+/* Socket options shared by both ends. Buffer sizes must be set before
+ * connect()/listen() for TCP window scaling to pick them up. */
+static void socketport_set_bufsizes(int fd, size_t roundbytes) {
+    int bufsize = 2 * roundbytes + SOCKET_BUF_SLACK_BYTES;
+    if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize)) < 0) {
+        perror("setsockopt SO_SNDBUF");
+    }
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize)) < 0) {
+        perror("setsockopt SO_RCVBUF");
+    }
+}
+
+static void socketport_set_connected_opts(int fd) {
+    int opt = 1;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt)) < 0) {
+        perror("setsockopt TCP_NODELAY");
+    }
+    int flags = fcntl(fd, F_GETFL, 0);
+    if ((flags < 0) || (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)) {
+        perror("fcntl O_NONBLOCK");
+        exit(1);
+    }
+}
+
+SocketPort::SocketPort(int portNo) : BasePort(portNo, false) {
+}
+
+void SocketPort::setup_buffers() {
+    // setup "current" bufs. tick_pre will swap output bufs
+    sendbufs[0] = (uint8_t*)calloc(bufsize_bytes(), 1);
+    sendbufs[1] = (uint8_t*)calloc(bufsize_bytes(), 1);
+    current_input_buf = (uint8_t*)calloc(bufsize_bytes(), 1);
+    current_output_buf = sendbufs[0];
+}
+
+// push as much of the pending send as the kernel will take right now.
+// returns true once the whole buffer has been handed to the kernel.
+bool SocketPort::progress_send() {
+    while (pending_send_done < pending_send_len) {
+        ssize_t amtsent = ::send(sock, pending_send_buf + pending_send_done,
+                pending_send_len - pending_send_done, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (amtsent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return false;
+            if (errno == EINTR)
+                continue;
+            perror("SOCKETPORT SEND ERROR");
+            exit(1);
+        }
+        pending_send_done += amtsent;
+    }
+    return true;
+}
+
+// block until the pending send has been fully handed to the kernel
+void SocketPort::finish_send() {
+    while (!progress_send()) {
+        struct pollfd pfd = { sock, POLLOUT, 0 };
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+            perror("SOCKETPORT poll");
+            exit(1);
+        }
+    }
+}
+
+void SocketPort::send() {
+    // the stream is ordered, so the previous round must be out first
+    finish_send();
+
+    pending_send_buf = current_output_buf;
+    pending_send_done = 0;
+    if (((uint64_t*)current_output_buf)[0] == 0xDEADBEEFDEADBEEFL) {
+        pending_send_len = COMPRESS_NUM_BYTES;
+    } else {
+        pending_send_len = bufsize_bytes();
+    }
+    progress_send();
+}
+
+void SocketPort::recv() {
+    size_t amtread = 0;
+    size_t amtwanted = COMPRESS_NUM_BYTES;
+    bool send_done = progress_send();
+
+    while (amtread < amtwanted) {
+        ssize_t got = ::recv(sock, current_input_buf + amtread,
+                amtwanted - amtread, MSG_DONTWAIT);
+        if (got > 0) {
+            amtread += got;
+            if (amtread == COMPRESS_NUM_BYTES && amtwanted == COMPRESS_NUM_BYTES) {
+                if (((uint64_t*)current_input_buf)[0] == 0xDEADBEEFDEADBEEFL) {
+                    memset(current_input_buf, 0x0, bufsize_bytes());
+                    return;
+                }
+                amtwanted = bufsize_bytes();
+            }
+            continue;
+        }
+        if (got == 0) {
+            fprintf(stdout, "SOCKETPORT %d: peer closed connection\n", _portNo);
+            exit(1);
+        }
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            perror("SOCKETPORT RECV ERROR");
+            exit(1);
+        }
+
+        // nothing to read yet: keep pushing our own round while we wait
+        if (!send_done)
+            send_done = progress_send();
+
+        struct pollfd pfd = { sock, (short)(POLLIN | (send_done ? 0 : POLLOUT)), 0 };
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+            perror("SOCKETPORT poll");
+            exit(1);
+        }
+    }
+}
+
+void SocketPort::tick() {
+    // does nothing in this port
+}
+
+void SocketPort::tick_pre() {
+    currentround = (currentround + 1) % 2;
+    // this buffer was handed to send() last round, and this round's send()
+    // drained it before starting, so it is safe to overwrite
+    current_output_buf = sendbufs[currentround];
+}
+
+
+class SocketClientPort : public SocketPort {
+    public:
+        SocketClientPort(int portNo, char * serverip, int hostport);
 };
 
-SocketClientPort::SocketClientPort(int portNo, char * serverip, int hostport) : BasePort(portNo, false) {
+SocketClientPort::SocketClientPort(int portNo, char * serverip, int hostport) : SocketPort(portNo) {
 
     struct sockaddr_in serv_addr;
 
     // connect the uplink socket
     fprintf(stdout, "ClientSocketPort portNo %d connecting to uplink switch %s\n", portNo, serverip);
     // this is a client
-    clientsocket = socket(AF_INET, SOCK_STREAM, 0);
-    if (clientsocket < 0) {
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
         fprintf(stdout, "SOCK FAILED!\n");
         exit(1);
     }
@@ -35,68 +200,24 @@ SocketClientPort::SocketClientPort(int portNo, char * serverip, int hostport) :
         exit(1);
     }
 
-    while (connect(clientsocket, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
+    socketport_set_bufsizes(sock, bufsize_bytes());
+
+    while (connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
         fprintf(stdout, "CONNECTION FAILED, retrying in 1s.\n");
         sleep(1);
     }
 
-
-    // setup "current" bufs. tick will swap for shmem passing
-    current_input_buf = (uint8_t*)calloc(BUFSIZE_BYTES, 1);
-    current_output_buf = (uint8_t*)calloc(BUFSIZE_BYTES, 1);;
-}
-
-void SocketClientPort::send() {
-    if (((uint64_t*)current_output_buf)[0] == 0xDEADBEEFDEADBEEFL) {
-//        printf("sending compressed\n");
-#define COMPRESS_NUM_BYTES (8)
-        int amtsent = ::send(clientsocket, current_output_buf, COMPRESS_NUM_BYTES, 0);
-        if (amtsent != COMPRESS_NUM_BYTES) { printf("SOCKETPORT SEND ERROR\n"); exit(1); }
-    } else {
-        int amtsent = ::send(clientsocket, current_output_buf, BUFSIZE_BYTES, 0);
-        if (amtsent != BUFSIZE_BYTES) { printf("SOCKETPORT SEND ERROR\n"); exit(1); }
-    }
+    socketport_set_connected_opts(sock);
+    setup_buffers();
 }
 
-void SocketClientPort::recv() {
-    int amtread = 0;
-    while (amtread < COMPRESS_NUM_BYTES) {
-        amtread += ::recv(clientsocket, current_input_buf + amtread,
-                COMPRESS_NUM_BYTES - amtread, 0);
-    }
-    if (((uint64_t*)current_input_buf)[0] == 0xDEADBEEFDEADBEEFL) {
-//        printf("recv compressed\n");
-        memset(current_input_buf, 0x0, BUFSIZE_BYTES);
-        return;
-    }
 
-    while (amtread < BUFSIZE_BYTES) {
-        amtread += ::recv(clientsocket, current_input_buf + amtread,
-                BUFSIZE_BYTES - amtread, 0);
-    }
-}
-
-void SocketClientPort::tick() {
-    // does nothing in this port
-}
-
-void SocketClientPort::tick_pre() {
-    // does nothing in this port
-}
-
-
-class SocketServerPort : public BasePort {
+class SocketServerPort : public SocketPort {
     public:
         SocketServerPort(int portNo, int hostport);
-        void tick();
-        void tick_pre();
-        void send();
-        void recv();
-    private:
-        int serversocket;
 };
 
-SocketServerPort::SocketServerPort(int portNo, int hostport) : BasePort(portNo, false) {
+SocketServerPort::SocketServerPort(int portNo, int hostport) : SocketPort(portNo) {
     int server_fd;
     struct sockaddr_in address;
     int opt = 1;
@@ -114,6 +235,9 @@ SocketServerPort::SocketServerPort(int portNo, int hostport) : BasePort(portNo,
         perror("setsockopt");
         exit(EXIT_FAILURE);
     }
+    // accepted sockets inherit these
+    socketport_set_bufsizes(server_fd, bufsize_bytes());
+
     address.sin_family = AF_INET;
     address.sin_addr.s_addr = INADDR_ANY;
     address.sin_port = htons(hostport);
@@ -129,53 +253,13 @@ SocketServerPort::SocketServerPort(int portNo, int hostport) : BasePort(portNo,
     }
 
     fprintf(stdout, "waiting for clients to connect\n");
-    if ((serversocket = accept(server_fd, (struct sockaddr *)&address, (socklen_t*)&addrlen))<0) {
+    if ((sock = accept(server_fd, (struct sockaddr *)&address, (socklen_t*)&addrlen))<0) {
         perror("accept");
         exit(EXIT_FAILURE);
     } else {
         fprintf(stdout, "SocketServerPort %d accepted client\n", portNo);
     }
 
-    // setup "current" bufs. tick will swap for shmem passing
-    current_input_buf = (uint8_t*)calloc(BUFSIZE_BYTES, 1);
-    current_output_buf = (uint8_t*)calloc(BUFSIZE_BYTES, 1);;
-}
-
-void SocketServerPort::send() {
-    if (((uint64_t*)current_output_buf)[0] == 0xDEADBEEFDEADBEEFL) {
-//        printf("sending compressed\n");
-#define COMPRESS_NUM_BYTES (8)
-        int amtsent = ::send(serversocket, current_output_buf, COMPRESS_NUM_BYTES, 0);
-        if (amtsent != COMPRESS_NUM_BYTES) { printf("SOCKETPORT SEND ERROR\n"); exit(1); }
-    } else {
-        int amtsent = ::send(serversocket, current_output_buf, BUFSIZE_BYTES, 0);
-        if (amtsent != BUFSIZE_BYTES) { printf("SOCKETPORT SEND ERROR\n"); exit(1); }
-    }
+    socketport_set_connected_opts(sock);
+    setup_buffers();
 }
-
-void SocketServerPort::recv() {
-    int amtread = 0;
-    while (amtread < COMPRESS_NUM_BYTES) {
-        amtread += ::recv(serversocket, current_input_buf + amtread,
-                COMPRESS_NUM_BYTES - amtread, 0);
-    }
-    if (((uint64_t*)current_input_buf)[0] == 0xDEADBEEFDEADBEEFL) {
-//        printf("recv compressed\n");
-        memset(current_input_buf, 0x0, BUFSIZE_BYTES);
-        return;
-    }
-
-    while (amtread < BUFSIZE_BYTES) {
-        amtread += ::recv(serversocket, current_input_buf + amtread,
-                BUFSIZE_BYTES - amtread, 0);
-    }
-}
-
-void SocketServerPort::tick() {
-    // does nothing in this port
-}
-
-void SocketServerPort::tick_pre() {
-    // does nothing in this port
-}
-
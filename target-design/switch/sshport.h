@@ -1,37 +1,64 @@
-
-#include <queue>
-
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <linux/if.h>
 #include <linux/if_tun.h>
 
-#define NET_IP_ALIGN 2
 #define ETH_MAX_WORDS 190
 #define ETH_MAX_BYTES 1518
 
-struct network_flit {
-    uint64_t data;
-    bool last;
-};
+#define ceil_div(n, d) (((n) - 1) / (d) + 1)
+
+#define TAP_MAX_QUEUES 16
+// iovecs to cover a max size frame in a token buffer, a bigtoken each
+#define TAP_MAX_IOV (ceil_div(ETH_MAX_BYTES + NET_IP_ALIGN, TOKENS_PER_BIGTOKEN * 8) + 1)
 
-/* The other side of this port is a TAP interface to the host network. 
- * This allows users to ssh into a simulated cluster */
+/* The other side of this port is a TAP interface to the host network.
+ * This allows users to ssh into a simulated cluster.
+ *
+ * Frames go straight between the TAP and the port's token buffers: a read
+ * scatters a frame into the input buffer's bigtokens with readv, and a
+ * write gathers one out of the output buffer with writev. Only a frame
+ * that doesn't fit in what is left of an input round, or that is still
+ * going out when an output round ends, is copied through a staging buffer.
+ *
+ * With more than one queue the TAP is opened IFF_MULTI_QUEUE, once per
+ * queue, so the host kernel can spread its side over CPUs. Reads take a
+ * frame from each queue in turn; writes pick a queue by the frame's MACs,
+ * so frames between two hosts stay in order. A switch can have several
+ * SSH ports, each on its own TAP device. */
 class SSHPort : public BasePort {
     public:
-        SSHPort(int portNo);
+        SSHPort(int portNo, const char * devname, int queues);
         void tick();
         void tick_pre();
         void send();
         void recv();
     private:
-        int sshtapfd;
-        uint64_t tap_send_buffer[ETH_MAX_WORDS], tap_recv_buffer[ETH_MAX_WORDS];
-        void *tap_send_frame = ((char *) tap_send_buffer) + NET_IP_ALIGN;
+        int put_staged_input(int tokenno);
+        int input_iovecs(int tokenno, struct iovec * iov);
+        void mark_input_frame(int tokenno, int flits);
+        void stage_output();
+        void write_frame();
+
+        int tapfds[TAP_MAX_QUEUES];
+        int nqueues;
+        int rx_queue = 0;
+
+        // a received frame that didn't fit in the round, and how much of it went
+        uint64_t tap_recv_buffer[ETH_MAX_WORDS];
         void *tap_recv_frame = ((char *) tap_recv_buffer) + NET_IP_ALIGN;
-        int tap_send_idx = 0, tap_len;
-        bool tap_can_send = false;
-        std::queue<network_flit> out_flits;
-        std::queue<network_flit> in_flits;
+        int rx_staged_flits = 0;
+        int rx_staged_next = 0;
+
+        // the frame being sent: gathered in place from the output buffer
+        // (tx_iov), or copied to tap_send_buffer once it spans rounds
+        uint64_t tap_send_buffer[ETH_MAX_WORDS];
+        void *tap_send_frame = ((char *) tap_send_buffer) + NET_IP_ALIGN;
+        struct iovec tx_iov[TAP_MAX_IOV];
+        int tx_iovcnt = 0;
+        int tx_flits = 0;
+        bool tx_staged = false;
+        uint64_t tx_macs = 0; // first two flits xor'd, to pick a queue
 };
 
 /* open TAP device */
@@ -57,35 +84,63 @@ static int tuntap_alloc(const char *dev, int flags) {
     return tapfd;
 }
 
-#define DEVNAME_BYTES 128
-#define ceil_div(n, d) (((n) - 1) / (d) + 1)
-
-SSHPort::SSHPort(int portNo) : BasePort(portNo, false) {
-    char * slotid = NULL; // placeholder for multiple SSH port support if we need it later
-    char devname[DEVNAME_BYTES+1];
-    devname[0] = '\0';
-    strncat(devname, "tap", DEVNAME_BYTES);
-
-    if (!slotid) {
-        fprintf(stderr, "Slot ID not specified. Assuming tap0\n");
-        slotid = (char*) "0";
+SSHPort::SSHPort(int portNo, const char * devname, int queues)
+    : BasePort(portNo, false), nqueues(queues)
+{
+    if (queues < 1 || queues > TAP_MAX_QUEUES) {
+        fprintf(stdout, "SSH Port %d: %d queues, must be 1 to %d\n", portNo, queues,
+                TAP_MAX_QUEUES);
+        exit(1);
     }
-    strncat(devname, slotid, DEVNAME_BYTES-3);
+    // a single queue opens the device as before, so existing non
+    // multi-queue TAP devices still attach
+    int flags = IFF_TAP | IFF_NO_PI | (queues > 1 ? IFF_MULTI_QUEUE : 0);
+    for (int i = 0; i < queues; i++) {
+        tapfds[i] = tuntap_alloc(devname, flags);
+        if (tapfds[i] < 0) {
+            fprintf(stderr, "Could not open tap interface %s\n", devname);
+            abort();
+        }
+    }
+    fprintf(stdout, "SSH Port %d: %s, %d queue%s\n", portNo, devname, queues,
+            queues > 1 ? "s" : "");
+
+    current_input_buf = (uint8_t*) calloc(sizeof(uint8_t), bufsize_bytes());
+    current_output_buf = (uint8_t*) calloc(sizeof(uint8_t), bufsize_bytes());
+}
 
-    sshtapfd = tuntap_alloc(devname, IFF_TAP | IFF_NO_PI);
-    if (sshtapfd < 0) {
-        fprintf(stderr, "Could not open tap interface %s\n", devname);
+/* write a frame out to the TAP, on the queue for its MACs */
+void SSHPort::write_frame() {
+    int queue = ((hash_mix(tx_macs) >> 32) * nqueues) >> 32;
+    ssize_t written;
+    if (tx_staged)
+        written = ::write(tapfds[queue], tap_send_frame, tx_flits * sizeof(uint64_t) - NET_IP_ALIGN);
+    else
+        written = ::writev(tapfds[queue], tx_iov, tx_iovcnt);
+    // the TAP doesn't push back on writes; if it ever does, the frame is
+    // lost, as it would be on a full NIC ring
+    if (written < 0 && errno != EAGAIN) {
+        perror("send()");
         abort();
     }
+}
 
-    current_input_buf = (uint8_t*) calloc(sizeof(uint8_t), BUFSIZE_BYTES);
-    current_output_buf = (uint8_t*) calloc(sizeof(uint8_t), BUFSIZE_BYTES);
+/* the frame being gathered is still going at the end of the round, and its
+ * flits in the output buffer won't survive it: copy them out */
+void SSHPort::stage_output() {
+    uint8_t * dst = (uint8_t*)tap_send_frame;
+    for (int i = 0; i < tx_iovcnt; i++) {
+        memcpy(dst, tx_iov[i].iov_base, tx_iov[i].iov_len);
+        dst += tx_iov[i].iov_len;
+    }
+    tx_iovcnt = 0;
+    tx_staged = true;
 }
 
 void SSHPort::send() {
     // here, we take data that was written to the port by the switch
-    // (data is in current_output_buf)
-    // and push it into queues to send into the TAP
+    // (data is in current_output_buf) and write it to the TAP, a frame
+    // at a time as their last flits come up
 
     if (((uint64_t*)current_output_buf)[0] == 0xDEADBEEFDEADBEEFL) {
         // if compress flag is set, clear it, this port type doesn't care
@@ -93,72 +148,131 @@ void SSHPort::send() {
         ((uint64_t*)current_output_buf)[0] = 0L;
     }
 
-    // first, push into out_flits queue
-    for (int tokenno = 0; tokenno < NUM_TOKENS; tokenno++) {
-        if (is_valid_flit(current_output_buf, tokenno)) {
-            struct network_flit flt;
-            flt.data = get_flit(current_output_buf, tokenno);
-            flt.last = is_last_flit(current_output_buf, tokenno);
-            out_flits.push(flt);
-        }
-    }
+    for (int tokenno = 0; tokenno < num_tokens(); tokenno++) {
+        if (!is_valid_flit(current_output_buf, tokenno))
+            continue;
+        uint64_t * flit = ((uint64_t*)current_output_buf) +
+            (tokenno / TOKENS_PER_BIGTOKEN) * 8 + tokenno % TOKENS_PER_BIGTOKEN + 1;
+        bool last = is_last_flit(current_output_buf, tokenno);
 
-    // then, actually send stuff out on the TAP
-    // next, see if there is data to send
-    if (!tap_can_send) {
-        while (!out_flits.empty()) {
-            tap_send_buffer[tap_send_idx] = out_flits.front().data;
-            tap_can_send = out_flits.front().last;
-            out_flits.pop();
-            tap_send_idx++;
-            if (tap_can_send)
-                break;
+        if (tx_flits < 2)
+            tx_macs ^= *flit;
+        if (tx_flits >= ETH_MAX_WORDS) {
+            // too big for the TAP, it will be dropped
+            tx_flits++;
+        } else if (tx_staged) {
+            tap_send_buffer[tx_flits++] = *flit;
+        } else if (tx_iovcnt && (uint8_t*)tx_iov[tx_iovcnt-1].iov_base +
+                tx_iov[tx_iovcnt-1].iov_len == (uint8_t*)flit) {
+            tx_iov[tx_iovcnt-1].iov_len += sizeof(uint64_t);
+            tx_flits++;
+        } else {
+            // flits only run together within a bigtoken, so a frame takes
+            // at most TAP_MAX_IOV runs
+            if (tx_iovcnt == TAP_MAX_IOV)
+                stage_output();
+            if (tx_staged) {
+                tap_send_buffer[tx_flits++] = *flit;
+            } else {
+                int skip = tx_flits ? 0 : NET_IP_ALIGN;
+                tx_iov[tx_iovcnt].iov_base = (uint8_t*)flit + skip;
+                tx_iov[tx_iovcnt].iov_len = sizeof(uint64_t) - skip;
+                tx_iovcnt++;
+                tx_flits++;
+            }
         }
-    }
 
-    if (tap_can_send) {
-        tap_len = tap_send_idx * sizeof(uint64_t) - NET_IP_ALIGN;
-        if (::write(sshtapfd, tap_send_frame, tap_len) >= 0) {
-            tap_send_idx = 0;
-            tap_can_send = false;
-        } else if (errno != EAGAIN) {
-            perror("send()");
-            abort();
+        if (last) {
+            if (tx_flits <= ETH_MAX_WORDS)
+                write_frame();
+            tx_iovcnt = 0;
+            tx_flits = 0;
+            tx_staged = false;
+            tx_macs = 0;
         }
     }
+    if (tx_iovcnt)
+        stage_output();
 
     // finally, clear current_output_buf for the next iter
-    memset(current_output_buf, 0x0, BUFSIZE_BYTES);
+    memset(current_output_buf, 0x0, bufsize_bytes());
+}
+
+/* iovecs for a max size frame starting at tokenno, over the data words of
+ * the input buffer's bigtokens, leaving the NET_IP_ALIGN padding */
+int SSHPort::input_iovecs(int tokenno, struct iovec * iov) {
+    size_t want = ETH_MAX_BYTES + NET_IP_ALIGN;
+    int cnt = 0;
+    while (want) {
+        int offset = tokenno % TOKENS_PER_BIGTOKEN;
+        size_t len = std::min(want, (TOKENS_PER_BIGTOKEN - offset) * sizeof(uint64_t));
+        iov[cnt].iov_base = ((uint64_t*)current_input_buf) +
+            (tokenno / TOKENS_PER_BIGTOKEN) * 8 + offset + 1;
+        iov[cnt].iov_len = len;
+        cnt++;
+        want -= len;
+        tokenno += TOKENS_PER_BIGTOKEN - offset;
+    }
+    iov[0].iov_base = (uint8_t*)iov[0].iov_base + NET_IP_ALIGN;
+    iov[0].iov_len -= NET_IP_ALIGN;
+    return cnt;
+}
+
+void SSHPort::mark_input_frame(int tokenno, int flits) {
+    for (int i = 0; i < flits; i++)
+        write_valid_flit(current_input_buf, tokenno + i);
+    write_last_flit(current_input_buf, tokenno + flits - 1, 1);
+}
+
+/* write out as much of the staged frame as fits from tokenno on. returns
+ * the next free token */
+int SSHPort::put_staged_input(int tokenno) {
+    for (; rx_staged_next < rx_staged_flits && tokenno < num_tokens(); tokenno++) {
+        write_last_flit(current_input_buf, tokenno, rx_staged_next == rx_staged_flits - 1);
+        write_valid_flit(current_input_buf, tokenno);
+        write_flit(current_input_buf, tokenno, tap_recv_buffer[rx_staged_next++]);
+    }
+    if (rx_staged_next == rx_staged_flits)
+        rx_staged_flits = rx_staged_next = 0;
+    return tokenno;
 }
 
 void SSHPort::recv() {
     // clear the input buf leftover from previous cycle
-    memset(current_input_buf, 0x0, BUFSIZE_BYTES);
-
-    // pull in flits from the TAP
-    tap_len = ::read(sshtapfd, tap_recv_frame, ETH_MAX_BYTES);
-    if (tap_len >= 0) {
-        int i, n = ceil_div(tap_len + NET_IP_ALIGN, sizeof(uint64_t));
-        for (i = 0; i < n; i++) {
-            struct network_flit flt;
-            flt.data = tap_recv_buffer[i];
-            flt.last = i == (n - 1);
-            in_flits.push(flt);
-        }
-    } else if (errno != EAGAIN) {
-        perror("recv()");
-        abort();
-    }
+    memset(current_input_buf, 0x0, bufsize_bytes());
 
-    // next, pull off of in_flits until current_input_buf is full, or we have nothing
-    // left to write
+    // finish a frame from last round, then fill the round from the TAP
+    // until every queue is empty or a frame doesn't fit
+    int tokenno = put_staged_input(0);
+    struct iovec iov[TAP_MAX_IOV];
+    int idle = 0;
+    while (!rx_staged_flits && idle < nqueues && tokenno < num_tokens()) {
+        int fd = tapfds[rx_queue];
+        rx_queue = (rx_queue + 1) % nqueues;
+
+        bool direct = tokenno + ETH_MAX_WORDS <= num_tokens();
+        ssize_t len;
+        if (direct)
+            len = ::readv(fd, iov, input_iovecs(tokenno, iov));
+        else
+            len = ::read(fd, tap_recv_frame, ETH_MAX_BYTES);
+        if (len < 0) {
+            if (errno != EAGAIN) {
+                perror("recv()");
+                abort();
+            }
+            idle++;
+            continue;
+        }
+        idle = 0;
 
-    for (int tokenno = 0; tokenno < NUM_TOKENS; tokenno++) {
-        if (!in_flits.empty()) {
-            write_last_flit(current_input_buf, tokenno, in_flits.front().last);
-            write_valid_flit(current_input_buf, tokenno);
-            write_flit(current_input_buf, tokenno, in_flits.front().data);
-            in_flits.pop();
+        int flits = ceil_div(len + NET_IP_ALIGN, sizeof(uint64_t));
+        if (direct) {
+            mark_input_frame(tokenno, flits);
+            tokenno += flits;
+        } else {
+            rx_staged_flits = flits;
+            tokenno = put_staged_input(tokenno);
         }
     }
 }
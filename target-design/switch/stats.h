@@ -0,0 +1,176 @@
+/* Per-port counters and histograms.
+ *
+ * Each port has one cache-line-aligned block of counters, written only by
+ * the thread of the shard that owns the port, with plain increments. A
+ * shard's ports are contiguous, so its blocks are too, and no two threads
+ * write the same line. Nothing is merged until someone asks: the periodic
+ * dump runs as the completion of a round barrier, when every worker is
+ * parked, so it reads a consistent snapshot without any atomics on the hot
+ * path.
+ *
+ * Histograms have log2 buckets: bucket 0 counts zeros, bucket k counts
+ * values in [2^(k-1), 2^k), and the last bucket everything above.
+ *   queue_hist: bytes queued at the output port when a packet arrives
+ *   latency_hist: cycles from a packet's first flit arriving at the switch
+ *                 to its first flit leaving it
+ *
+ * Counters are cumulative. Dumps go to a file, as one JSON object per line
+ * or as CSV rows (one per port), keyed by simulated cycle. */
+
+#define STATS_HIST_BUCKETS 32
+
+#define STATS_JSON 0
+#define STATS_CSV 1
+
+// per traffic class counters of an output port
+struct classcounters {
+    uint64_t tx_packets = 0;
+    uint64_t tx_bytes = 0;
+    uint64_t drops = 0;
+    uint64_t ecn_marks = 0;
+};
+
+struct alignas(64) portstats {
+    uint64_t rx_packets = 0;
+    uint64_t rx_bytes = 0;
+    uint64_t tx_packets = 0;
+    uint64_t tx_bytes = 0;
+    uint64_t no_route_drops = 0; // received here, nowhere to send it
+    uint64_t tail_drops = 0;
+    uint64_t red_drops = 0;
+    uint64_t ecn_marks = 0;
+    uint64_t pause_frames_received = 0;
+    uint64_t pfc_frames_sent = 0;
+    uint64_t pfc_frames_received = 0;
+    uint64_t latency_sum = 0;
+    uint64_t latency_max = 0;
+    uint64_t queue_hist[STATS_HIST_BUCKETS] = {};
+    uint64_t latency_hist[STATS_HIST_BUCKETS] = {};
+    classcounters classes[NUM_PRIORITIES];
+};
+
+// indexed by port
+portstats * port_stats;
+
+static FILE * stats_file = NULL;
+static int stats_format = STATS_JSON;
+static uint64_t stats_interval = 0;
+static uint64_t stats_next_cycle = 0;
+
+static inline int stats_bucket(uint64_t value) {
+    if (value == 0)
+        return 0;
+    return std::min(64 - __builtin_clzll(value), STATS_HIST_BUCKETS - 1);
+}
+
+void stats_init() {
+    void * mem;
+    if (posix_memalign(&mem, 64, NUMPORTS * sizeof(portstats))) {
+        perror("allocating port stats");
+        exit(1);
+    }
+    port_stats = (portstats*)mem;
+    for (int i = 0; i < NUMPORTS; i++)
+        new (&port_stats[i]) portstats();
+}
+
+/* dump every interval cycles to path, as json or csv */
+void stats_open(const char * path, int format, uint64_t interval) {
+    stats_file = fopen(path, "w");
+    if (!stats_file) {
+        perror("opening stats file");
+        exit(1);
+    }
+    stats_format = format;
+    stats_interval = interval;
+    stats_next_cycle = interval;
+
+    if (format == STATS_CSV) {
+        fprintf(stats_file, "cycle,port,rx_packets,rx_bytes,tx_packets,tx_bytes,"
+                "no_route_drops,tail_drops,red_drops,ecn_marks,pause_frames_received,"
+                "pfc_frames_sent,pfc_frames_received,latency_sum,latency_max");
+        for (int i = 0; i < STATS_HIST_BUCKETS; i++)
+            fprintf(stats_file, ",queue_hist%d", i);
+        for (int i = 0; i < STATS_HIST_BUCKETS; i++)
+            fprintf(stats_file, ",latency_hist%d", i);
+        fprintf(stats_file, "\n");
+    }
+}
+
+static void stats_print_hist(const uint64_t * hist, const char * sep) {
+    for (int i = 0; i < STATS_HIST_BUCKETS; i++)
+        fprintf(stats_file, "%s%lu", i ? sep : "", hist[i]);
+}
+
+static void stats_dump_json(uint64_t cycle) {
+    fprintf(stats_file, "{\"cycle\":%lu,\"ports\":[", cycle);
+    for (int port = 0; port < NUMPORTS; port++) {
+        portstats &s = port_stats[port];
+        fprintf(stats_file, "%s{\"port\":%d,\"rx_packets\":%lu,\"rx_bytes\":%lu,"
+                "\"tx_packets\":%lu,\"tx_bytes\":%lu,\"no_route_drops\":%lu,"
+                "\"tail_drops\":%lu,\"red_drops\":%lu,\"ecn_marks\":%lu,"
+                "\"pause_frames_received\":%lu,\"pfc_frames_sent\":%lu,"
+                "\"pfc_frames_received\":%lu,\"latency_sum\":%lu,\"latency_max\":%lu,"
+                "\"queue_hist\":[", port ? "," : "", port,
+                s.rx_packets, s.rx_bytes, s.tx_packets, s.tx_bytes, s.no_route_drops,
+                s.tail_drops, s.red_drops, s.ecn_marks, s.pause_frames_received,
+                s.pfc_frames_sent, s.pfc_frames_received, s.latency_sum, s.latency_max);
+        stats_print_hist(s.queue_hist, ",");
+        fprintf(stats_file, "],\"latency_hist\":[");
+        stats_print_hist(s.latency_hist, ",");
+        fprintf(stats_file, "],\"classes\":[");
+        for (int prio = 0; prio < NUM_PRIORITIES; prio++) {
+            classcounters &c = s.classes[prio];
+            fprintf(stats_file, "%s{\"tx_packets\":%lu,\"tx_bytes\":%lu,\"drops\":%lu,\"ecn_marks\":%lu}",
+                    prio ? "," : "", c.tx_packets, c.tx_bytes, c.drops, c.ecn_marks);
+        }
+        fprintf(stats_file, "]}");
+    }
+    fprintf(stats_file, "]}\n");
+}
+
+static void stats_dump_csv(uint64_t cycle) {
+    for (int port = 0; port < NUMPORTS; port++) {
+        portstats &s = port_stats[port];
+        fprintf(stats_file, "%lu,%d,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,",
+                cycle, port, s.rx_packets, s.rx_bytes, s.tx_packets, s.tx_bytes,
+                s.no_route_drops, s.tail_drops, s.red_drops, s.ecn_marks,
+                s.pause_frames_received, s.pfc_frames_sent, s.pfc_frames_received,
+                s.latency_sum, s.latency_max);
+        stats_print_hist(s.queue_hist, ",");
+        fprintf(stats_file, ",");
+        stats_print_hist(s.latency_hist, ",");
+        fprintf(stats_file, "\n");
+    }
+}
+
+void stats_dump(uint64_t cycle) {
+    if (stats_format == STATS_CSV)
+        stats_dump_csv(cycle);
+    else
+        stats_dump_json(cycle);
+    fflush(stats_file);
+}
+
+// whether the barrier at this cycle should dump. the same on every thread
+static inline bool stats_due(uint64_t cycle) {
+    return stats_file && (cycle >= stats_next_cycle);
+}
+
+// cycle of the barrier the worker threads are at, for stats_barrier_dump
+thread_local uint64_t stats_barrier_cycle;
+
+/* barrier completion: runs on the last thread to arrive, with the rest
+ * parked, so it's the only thread touching the counters */
+void stats_barrier_dump() {
+    stats_dump(stats_barrier_cycle);
+    while (stats_next_cycle <= stats_barrier_cycle)
+        stats_next_cycle += stats_interval;
+}
+
+void stats_close(uint64_t cycle) {
+    if (!stats_file)
+        return;
+    stats_dump(cycle);
+    fclose(stats_file);
+}
@@ -1,15 +1,21 @@
 #include <functional>
 #include <queue>
+#include <vector>
+#include <string>
 #include <algorithm>
+#include <new>
 #include <stdio.h>
 #include <string.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/fcntl.h>
 #include <unistd.h>
-#include <omp.h>
+#include <pthread.h>
+#include <atomic>
 #include <cstdlib>
+#include <time.h>
 #include <arpa/inet.h>
 
 #define IGNORE_PRINTF
@@ -22,260 +28,616 @@
 // assuming 3.2 GHz, this number / 3.2 = link latency in ns
 // e.g. setting this to 35000 gives you 35000/3.2 = 10937.5 ns latency
 // IMPORTANT: this must be a multiple of 7
+// this is the default; ports can have their own, see BasePort::linklatency()
 //
-// THIS IS SET BY A COMMAND LINE ARGUMENT. DO NOT CHANGE IT HERE.
+// THIS IS SET BY THE CONFIG FILE. DO NOT CHANGE IT HERE.
 //#define LINKLATENCY 6405
 int LINKLATENCY = 0;
 
+// the switch's time step: GCD of all the ports' link latencies. each port
+// exchanges a round with its peer every steps_per_round() steps
+int step_cycles = 0;
+
 // param: switching latency in cycles
 // assuming 3.2 GHz, this number / 3.2 = switching latency in ns
 //
-// THIS IS SET BY A COMMAND LINE ARGUMENT. DO NOT CHANGE IT HERE.
+// THIS IS SET BY THE CONFIG FILE. DO NOT CHANGE IT HERE.
 int switchlat = 0;
 
 #define SWITCHLATENCY (switchlat)
 
 // param: numerator and denominator of bandwidth throttle
-// Used to throttle outbound bandwidth from port
+// Used to throttle outbound bandwidth from port, unless it has its own
 //
-// THESE ARE SET BY A COMMAND LINE ARGUMENT. DO NOT CHANGE IT HERE.
+// THESE ARE SET BY THE CONFIG FILE. DO NOT CHANGE IT HERE.
 int throttle_numer = 1;
 int throttle_denom = 1;
 
-// uncomment to use a limited output buffer size, OUTPUT_BUF_SIZE
-//#define LIMITED_BUFSIZE
+// output buffer sizes and drop/ECN/PFC policies are per port, see
+// queueparams in baseport.h. they are set by the config file.
 
-// size of output buffers, in # of flits
-// only if LIMITED BUFSIZE is set
-// TODO: expose in manager
-#define OUTPUT_BUF_SIZE (131072L)
+// parity of the barriers the current thread's shard has passed, for state
+// that other shards write between barriers
+thread_local int shard_parity = 0;
 
-// pull in # clients config
-#define NUMCLIENTSCONFIG
-#include "switchconfig.h"
-#undef NUMCLIENTSCONFIG
+// param: number of ports. downlinks are ports [0, NUMDOWNLINKS), uplinks
+// are the rest.
+//
+// THESE ARE SET BY THE CONFIG FILE. DO NOT CHANGE IT HERE.
+int NUMPORTS = 0;
+int NUMDOWNLINKS = 0;
+int NUMUPLINKS = 0;
+
+// param: how packets for the uplinks pick one. ECMP hashes each flow onto
+// one uplink (salted with hash_seed, which should differ per switch), random
+// sprays packets and so reorders flows.
+//
+// THESE ARE SET BY THE CONFIG FILE. DO NOT CHANGE IT HERE.
+#define MULTIPATH_RANDOM 0
+#define MULTIPATH_ECMP 1
+int multipath = MULTIPATH_ECMP;
+uint64_t hash_seed = 0;
+
+// param: cut-through switching. a unicast packet is routed once its first
+// CUT_THROUGH_FLITS flits (ethernet, a VLAN tag, IPv4 and L4 ports) are in,
+// instead of once all of it is, and each flit can leave switchlat after it
+// arrived. broadcasts, MAC control frames and short packets are still store
+// and forward.
+//
+// THIS IS SET BY THE CONFIG FILE. DO NOT CHANGE IT HERE.
+#define CUT_THROUGH_FLITS 6
+bool cut_through = false;
 
 // DO NOT TOUCH
-#define NUM_TOKENS (LINKLATENCY)
+// (the # of tokens in a round is per port, see BasePort::num_tokens())
 #define TOKENS_PER_BIGTOKEN (7)
 #define BIGTOKEN_BYTES (64)
-#define NUM_BIGTOKENS (NUM_TOKENS/TOKENS_PER_BIGTOKEN)
-#define BUFSIZE_BYTES (NUM_BIGTOKENS*BIGTOKEN_BYTES)
 
 // DO NOT TOUCH
 #define SWITCHLAT_NUM_TOKENS (SWITCHLATENCY)
 #define SWITCHLAT_NUM_BIGTOKENS (SWITCHLAT_NUM_TOKENS/TOKENS_PER_BIGTOKEN)
 #define SWITCHLAT_BUFSIZE_BYTES (SWITCHLAT_NUM_BIGTOKENS*BIGTOKEN_BYTES)
 
-uint64_t this_iter_cycles_start = 0;
+#include "mactable.h"
 
-// pull in mac2port array
-#define MACPORTSCONFIG
-#include "switchconfig.h"
-#undef MACPORTSCONFIG
+// filled in from the config file
+MacTable mac_table;
 
+#include "packet.h"
 #include "flit.h"
+#include "shmemring.h"
+#include "workers.h"
+#include "capture.h"
+#include "stats.h"
 #include "baseport.h"
 #include "shmemport.h"
 #include "socketport.h"
 #include "sshport.h"
+#include "syntheticport.h"
 
-// TODO: replace these port mapping hacks with a mac -> port mapping,
-// could be hardcoded
-
-BasePort * ports[NUMPORTS];
-
-/* switch from input ports to output ports */
-void do_fast_switching() {
-#pragma omp parallel for
-    for (int port = 0; port < NUMPORTS; port++) {
-        ports[port]->setup_send_buf();
-    }
+#include "switchconfig.h"
 
+// whether a packet with its headers in can be forwarded before the rest
+static bool can_cut_through(switchpacket * sp) {
+    uint16_t ethtype;
+    int pcp;
+    if (frame_bytes(sp)[0] & 1)
+        return false; // broadcast or multicast
+    return frame_l3_offset(sp, &ethtype, &pcp) >= 0 && ethtype != MAC_ETHTYPE;
+}
 
-// preprocess from raw input port to packets
-#pragma omp parallel for
-for (int port = 0; port < NUMPORTS; port++) {
+/* preprocess from raw input port to packets */
+void preprocess_port(int port) {
     BasePort * current_port = ports[port];
     uint8_t * input_port_buf = current_port->current_input_buf;
 
-    for (int tokenno = 0; tokenno < NUM_TOKENS; tokenno++) {
+    for (int tokenno = 0; tokenno < current_port->num_tokens(); tokenno++) {
         if (is_valid_flit(input_port_buf, tokenno)) {
             uint64_t flit = get_flit(input_port_buf, tokenno);
 
             switchpacket * sp;
             if (!(current_port->input_in_progress)) {
-                sp = (switchpacket*)calloc(sizeof(switchpacket), 1);
+                sp = alloc_packet();
                 current_port->input_in_progress = sp;
 
                 // here is where we inject switching latency. this is min port-to-port latency
-                sp->timestamp = this_iter_cycles_start + tokenno + SWITCHLATENCY;
+                sp->timestamp = current_port->round_start + tokenno + SWITCHLATENCY;
                 sp->sender = port;
             }
             sp = current_port->input_in_progress;
 
-            sp->dat[sp->amtwritten++] = flit;
-            if (is_last_flit(input_port_buf, tokenno)) {
+            int flitno = sp->cut_through ? sp->cut_flits++ : sp->amtwritten++;
+            sp->dat[flitno] = flit;
+            bool last = is_last_flit(input_port_buf, tokenno);
+            if (cut_through) {
+                uint64_t offset = current_port->round_start + tokenno + SWITCHLATENCY - sp->timestamp;
+                sp->flittime[flitno] = std::min(offset, (uint64_t)UINT16_MAX);
+                if (!last && flitno == CUT_THROUGH_FLITS - 1 && can_cut_through(sp)) {
+                    // route it now, the rest follows
+                    sp->cut_through = true;
+                    sp->cut_flits = sp->amtwritten;
+                    sp->cut_avail = sp->amtwritten;
+                    current_port->inputqueue.push(sp);
+                }
+            }
+
+            if (last) {
                 current_port->input_in_progress = NULL;
-                if (current_port->push_input(sp)) {
+                int flits = sp->cut_through ? sp->cut_flits : sp->amtwritten;
+                port_stats[port].rx_packets++;
+                port_stats[port].rx_bytes += flits * sizeof(uint64_t);
+                capture_packet(port, CAPTURE_IN, sp, flits, sp->timestamp - SWITCHLATENCY);
+                if (sp->cut_through) {
+                    // hand it over. if the output side already dropped it, it's ours to free
+                    __atomic_store_n(&sp->cut_avail, flits, __ATOMIC_RELEASE);
+                    if (__atomic_fetch_or(&sp->cut_flags, CUT_DONE, __ATOMIC_ACQ_REL) & CUT_RELEASED)
+                        free(sp);
+                } else if (current_port->push_input(sp)) {
                     printf("packet timestamp: %ld, len: %ld, sender: %d\n",
-                            this_iter_cycles_start + tokenno,
+                            current_port->round_start + tokenno,
                             sp->amtwritten, port);
                 }
             }
         }
     }
+
+    // let the output side see what arrived of a packet it may be sending
+    switchpacket * sp = current_port->input_in_progress;
+    if (sp && sp->cut_through)
+        __atomic_store_n(&sp->cut_avail, sp->cut_flits, __ATOMIC_RELEASE);
 }
 
-// next do the switching. but this switching is just shuffling pointers,
-// so it should be fast. it has to be serial though...
+// next do the switching. this is just shuffling pointers, and it is split
+// in two halves around the round barrier so that no thread ever touches
+// another shard's ports:
+// 1) each shard looks up the destination of every packet that arrived on
+//    its own ports and appends it to the inbox the destination shard has
+//    for it. broadcasts get one copy per destination shard.
+// 2) after the barrier, each shard merges its inboxes in timestamp order
+//    into the output queues of its own ports, fanning out broadcasts.
+//
+// inboxes are double-buffered on the round number: shard d is still reading
+// round r's inboxes while a fast shard s may already be filling round r+1's,
+// but s can't get to round r+2 until d has passed the next barrier.
+
+struct routedpacket {
+    switchpacket * switchpack;
+    uint16_t send_to_port;
+};
+
+struct alignas(64) shard_inbox {
+    std::vector<routedpacket> packets;
+};
+
+// [round parity][destination shard][source shard]
+shard_inbox * inboxes[2];
 
-// NO PARALLEL!
-// shift pointers to output queues, but in order. basically.
-// until the input queues have no more complete packets
-// 1) find the next switchpacket with the lowest timestamp across all the inputports
-// 2) look at its mac, copy it into the right ports
-//          i) if it's a broadcast: sorry, you have to make N-1 copies of it...
-//          to put into the other queues
+static shard_inbox & inbox(int parity, int dstshard, int srcshard) {
+    return inboxes[parity][dstshard * nshards + srcshard];
+}
 
 struct tspacket {
     uint64_t timestamp;
+    int sender;
     switchpacket * switchpack;
+    uint16_t send_to_port;
 
+    // ties are broken on sender so the merge doesn't depend on shard layout
     bool operator<(const tspacket &o) const
     {
-        return timestamp > o.timestamp;
+        if (timestamp != o.timestamp)
+            return timestamp > o.timestamp;
+        return sender > o.sender;
     }
 };
 
 typedef struct tspacket tspacket;
 
+// broadcasts go to every downlink, and broadcasts from a downlink also go up
+// one uplink, picked the same way as for unicast. broadcasts from an uplink
+// never go back up.
+#define NUMBROADCASTPORTS (NUMDOWNLINKS)
+
+/* first half: route everything that arrived on this shard's ports */
+void route_shard_inputs(int shard, int parity) {
+    for (int port = shard_first_port[shard]; port < shard_first_port[shard+1]; port++) {
+        packetlist &inputqueue = ports[port]->inputqueue;
+        while (!(inputqueue.empty())) {
+            switchpacket * sp = inputqueue.front();
+            inputqueue.pop();
+            uint16_t send_to_port = get_port_from_packet(sp);
+            sp->priority = packet_priority(sp);
+            //printf("packet for port: %x\n", send_to_port);
+            //printf("packet timestamp: %ld\n", sp->timestamp);
+            if (send_to_port >= NUMPORTS && send_to_port != BROADCAST_ADJUSTED) {
+                // unknown MAC and no uplink to send it to
+                port_stats[port].no_route_drops++;
+                release_packet(sp);
+                continue;
+            }
+            if (send_to_port != BROADCAST_ADJUSTED) {
+                inbox(parity, port_shard[send_to_port], shard).packets.push_back(
+                        routedpacket { sp, send_to_port });
+                continue;
+            }
+            if ((port < NUMDOWNLINKS) && (NUMUPLINKS > 0)) {
+                uint16_t uplink = pick_uplink(sp);
+                switchpacket * upcopy = copy_packet(sp);
+                inbox(parity, port_shard[uplink], shard).packets.push_back(
+                        routedpacket { upcopy, uplink });
+            }
+            if (NUMBROADCASTPORTS == 0) {
+                free(sp);
+                continue;
+            }
+            int lastshard = port_shard[NUMBROADCASTPORTS - 1];
+            for (int dstshard = 0; dstshard <= lastshard; dstshard++) {
+                switchpacket * sp2 = sp;
+                if (dstshard != lastshard) {
+                    sp2 = copy_packet(sp);
+                }
+                inbox(parity, dstshard, shard).packets.push_back(
+                        routedpacket { sp2, BROADCAST_ADJUSTED });
+            }
+        }
+    }
+}
 
-// TODO thread safe priority queue? could do in parallel?
-std::priority_queue<tspacket> pqueue;
-
-for (int i = 0; i < NUMPORTS; i++) {
-    while (!(ports[i]->inputqueue.empty())) {
-        switchpacket * sp = ports[i]->inputqueue.front();
-        ports[i]->inputqueue.pop();
-        pqueue.push( tspacket { sp->timestamp, sp });
+// packets routed to this shard's ports, not yet released to their output
+// queues. only ever touched by the shard's own thread
+thread_local std::priority_queue<tspacket> staged;
+
+/* second half: collect this shard's inboxes */
+void merge_shard_inputs(int shard, int parity) {
+    for (int srcshard = 0; srcshard < nshards; srcshard++) {
+        std::vector<routedpacket> &packets = inbox(parity, shard, srcshard).packets;
+        for (size_t i = 0; i < packets.size(); i++) {
+            switchpacket * sp = packets[i].switchpack;
+            staged.push(tspacket { sp->timestamp, sp->sender, sp, packets[i].send_to_port });
+        }
+        packets.clear();
     }
 }
 
-// next, put back into individual output queues
-while (!pqueue.empty()) {
-    switchpacket * tsp = pqueue.top().switchpack;
-    pqueue.pop();
-    uint16_t send_to_port = get_port_from_flit(tsp->dat[0], 0 /* junk remove arg */);
-    //printf("packet for port: %x\n", send_to_port);
-    //printf("packet timestamp: %ld\n", tsp->timestamp);
-    if (send_to_port == BROADCAST_ADJUSTED) {
-#define ADDUPLINK (NUMUPLINKS > 0 ? 1 : 0)
-        // this will only send broadcasts to the first (zeroeth) uplink.
-        // on a switch receiving broadcast packet from an uplink, this should
-        // automatically prevent switch from sending the broadcast to any uplink
-        for (int i = 0; i < NUMDOWNLINKS + ADDUPLINK; i++) {
-            if (i != tsp->sender ) {
-                switchpacket * tsp2 = (switchpacket*)malloc(sizeof(switchpacket));
-                memcpy(tsp2, tsp, sizeof(switchpacket));
-                ports[i]->outputqueue.push(tsp2);
+/* move staged packets into the output queues of this shard's ports, in
+ * timestamp order, up to horizon. ports with long rounds deliver input
+ * well ahead of ports with short ones, so a packet is only released once
+ * no input still to come can produce an earlier one. */
+void release_shard_outputs(int shard, uint64_t horizon) {
+    int firstport = shard_first_port[shard];
+    int endport = shard_first_port[shard+1];
+
+    while (!staged.empty() && staged.top().timestamp < horizon) {
+        tspacket tsp = staged.top();
+        staged.pop();
+        if (tsp.send_to_port != BROADCAST_ADJUSTED) {
+            ports[tsp.send_to_port]->outputqueue.push(tsp.switchpack);
+            continue;
+        }
+        // this shard's copy goes to the last eligible port, the rest get copies
+        int lastport = std::min(endport, NUMBROADCASTPORTS) - 1;
+        if (lastport == tsp.sender)
+            lastport--;
+        for (int port = firstport; port <= lastport; port++) {
+            if (port == tsp.sender)
+                continue;
+            switchpacket * sp2 = tsp.switchpack;
+            if (port != lastport) {
+                sp2 = copy_packet(tsp.switchpack);
             }
+            ports[port]->outputqueue.push(sp2);
         }
-        free(tsp);
-    } else {
-        ports[send_to_port]->outputqueue.push(tsp);
+        if (lastport < firstport)
+            free(tsp.switchpack);
     }
 }
 
+// distinct steps_per_round() over all ports. a step on which any of these
+// starts a round brings in new input, so all shards meet at the barrier
+std::vector<int> round_lengths;
+
+static bool step_starts_round(uint64_t step) {
+    for (size_t i = 0; i < round_lengths.size(); i++) {
+        if (step % round_lengths[i] == 0)
+            return true;
+    }
+    return false;
+}
 
-// finally in parallel, flush whatever we can to the output queues based on timestamp
+RoundBarrier * round_barrier;
 
-#pragma omp parallel for
-for (int port = 0; port < NUMPORTS; port++) {
-    BasePort * thisport = ports[port];
-    thisport->write_flits_to_output();
+// bounded runs (+rounds=N) stop after N rounds of the default link latency.
+// 0 runs forever
+uint64_t max_rounds = 0;
+
+// where each shard's time goes, on bounded runs
+#define PHASE_SEND 0
+#define PHASE_RECV 1
+#define PHASE_PREPROCESS 2
+#define PHASE_ROUTE 3       // routing, and collecting what other shards routed
+#define PHASE_BARRIER 4     // waiting for the other shards
+#define PHASE_OUTPUT 5      // output queues and writing the output buffers
+#define NUM_PHASES 6
+
+static const char * phase_names[NUM_PHASES] = {
+    "send", "recv", "preprocess", "route", "barrier", "output"
+};
+
+struct alignas(64) phasetimes {
+    uint64_t ns[NUM_PHASES] = {};
+};
+
+// indexed by shard
+phasetimes * shard_phases;
+
+static inline uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
 }
 
+// charge the time since *last to phase
+static inline void phase_done(phasetimes &times, int phase, uint64_t * last) {
+    uint64_t now = now_ns();
+    times.ns[phase] += now - *last;
+    *last = now;
 }
 
-static void simplify_frac(int n, int d, int *nn, int *dd)
-{
-    int a = n, b = d;
+/* main loop of the thread that owns one shard of ports. the only state
+ * shared with other shards is the inboxes, on either side of the barrier.
+ *
+ * time advances in steps of step_cycles. a port starts a round (send last
+ * round's output, receive a round of input) on steps that are a multiple of
+ * its steps_per_round(), and writes its output for the round on the last
+ * step of the round, once every port has delivered input up to its end.
+ * with a single link latency each step is exactly one round. */
+void * shard_worker(void * arg) {
+    int shard = (int)(intptr_t)arg;
+    int firstport = shard_first_port[shard];
+    int endport = shard_first_port[shard+1];
+    uint64_t max_steps = max_rounds * (LINKLATENCY / step_cycles);
+    int parity = 0;
+    bool timed = max_rounds != 0;
+    phasetimes &times = shard_phases[shard];
+    uint64_t last = timed ? now_ns() : 0;
+
+    pin_to_cpu(shard_cpu[shard]);
+    route_seed = shard + 1;
+
+    for (uint64_t step = 0; (max_rounds == 0) || (step < max_steps); step++) {
+        if (step_starts_round(step)) {
+            // handle sends
+            for (int port = firstport; port < endport; port++) {
+                if (step % ports[port]->steps_per_round() == 0)
+                    ports[port]->send();
+            }
+            if (timed)
+                phase_done(times, PHASE_SEND, &last);
+
+            // handle receives. these are blocking per port
+            for (int port = firstport; port < endport; port++) {
+                if (step % ports[port]->steps_per_round() == 0)
+                    ports[port]->recv();
+            }
+            if (timed)
+                phase_done(times, PHASE_RECV, &last);
+
+            for (int port = firstport; port < endport; port++) {
+                if (step % ports[port]->steps_per_round() == 0) {
+                    ports[port]->tick_pre();
+                    ports[port]->setup_send_buf();
+                    preprocess_port(port);
+                }
+            }
+            if (timed)
+                phase_done(times, PHASE_PREPROCESS, &last);
+
+            route_shard_inputs(shard, parity);
+            if (timed)
+                phase_done(times, PHASE_ROUTE, &last);
+
+            // wait for everyone's inputs to be routed. this is also where
+            // stats get dumped, while everyone is waiting
+            uint64_t step_start = step * step_cycles;
+            stats_barrier_cycle = step_start;
+            round_barrier->wait(stats_due(step_start) ? stats_barrier_dump : NULL);
+            if (timed)
+                phase_done(times, PHASE_BARRIER, &last);
+
+            merge_shard_inputs(shard, parity);
+            for (int port = firstport; port < endport; port++) {
+                ports[port]->take_pfc_requests(parity);
+            }
+            parity ^= 1;
+            shard_parity = parity;
+            if (timed)
+                phase_done(times, PHASE_ROUTE, &last);
+        }
+
+        // all input up to the end of this step is in, and none of it can
+        // get through the switch sooner than switchlat
+        uint64_t step_end = (step + 1) * step_cycles;
+        release_shard_outputs(shard, step_end + SWITCHLATENCY);
+
+        for (int port = firstport; port < endport; port++) {
+            BasePort * thisport = ports[port];
+            if ((step + 1) % thisport->steps_per_round() != 0)
+                continue;
 
-    // compute GCD
-    while (b > 0) {
-        int t = b;
-        b = a % b;
-        a = t;
+            // flush whatever we can to the output queues based on timestamp
+            thisport->write_flits_to_output();
+
+            thisport->round_start += thisport->linklatency(); // keep track of time
+
+            // some ports need to handle extra stuff after each iteration
+            // e.g. shmem ports releasing shared buffers
+            thisport->tick();
+        }
+        if (timed)
+            phase_done(times, PHASE_OUTPUT, &last);
     }
+    return NULL;
+}
 
-    *nn = n / a;
-    *dd = d / a;
+/* average time per shard in each phase, for bounded benchmark runs */
+static void report_phases(double elapsed) {
+    fprintf(stdout, "phases (ms per thread):");
+    for (int phase = 0; phase < NUM_PHASES; phase++) {
+        uint64_t ns = 0;
+        for (int shard = 0; shard < nshards; shard++)
+            ns += shard_phases[shard].ns[phase];
+        double ms = ns / 1e6 / nshards;
+        fprintf(stdout, " %s %.1f (%.0f%%)", phase_names[phase], ms, ms / 10 / elapsed);
+    }
+    fprintf(stdout, "\n");
 }
 
-int main (int argc, char *argv[]) {
-    int bandwidth;
+/* queue model totals, for bounded benchmark runs */
+static void report_queues() {
+    portstats total;
+    for (int i = 0; i < NUMPORTS; i++) {
+        portstats &s = port_stats[i];
+        total.tail_drops += s.tail_drops;
+        total.red_drops += s.red_drops;
+        total.ecn_marks += s.ecn_marks;
+        total.pfc_frames_sent += s.pfc_frames_sent;
+        total.pfc_frames_received += s.pfc_frames_received;
+        for (int prio = 0; prio < NUM_PRIORITIES; prio++) {
+            classcounters &c = s.classes[prio];
+            total.classes[prio].tx_packets += c.tx_packets;
+            total.classes[prio].tx_bytes += c.tx_bytes;
+            total.classes[prio].drops += c.drops;
+            total.classes[prio].ecn_marks += c.ecn_marks;
+        }
+    }
+    fprintf(stdout, "queues: %lu tail drops, %lu RED drops, %lu ECN marks, %lu PFC frames sent, %lu received\n",
+            total.tail_drops, total.red_drops, total.ecn_marks, total.pfc_frames_sent,
+            total.pfc_frames_received);
+
+    for (int prio = 0; prio < NUM_PRIORITIES; prio++) {
+        classcounters &c = total.classes[prio];
+        if (c.tx_packets || c.drops)
+            fprintf(stdout, "class %d: tx %lu packets (%lu bytes), %lu drops, %lu ECN marks\n",
+                    prio, c.tx_packets, c.tx_bytes, c.drops, c.ecn_marks);
+    }
 
-    if (argc < 4) {
+    // how evenly multipath spread traffic over the uplinks
+    if (NUMUPLINKS > 1) {
+        fprintf(stdout, "uplink tx packets:");
+        for (int i = NUMDOWNLINKS; i < NUMPORTS; i++)
+            fprintf(stdout, " %lu", port_stats[i].tx_packets);
+        fprintf(stdout, "\n");
+    }
+}
+
+static double now_seconds() {
+    return now_ns() * 1e-9;
+}
+
+int main (int argc, char *argv[]) {
+    if (argc < 2) {
         // if insufficient args, error out
-        fprintf(stdout, "usage: ./switch LINKLATENCY SWITCHLATENCY BANDWIDTH\n");
+        fprintf(stdout, "usage: ./switch CONFIGFILE [+cpus=LIST] [+threads=N] [+rounds=N]\n");
         fprintf(stdout, "insufficient args provided\n.");
-        fprintf(stdout, "LINKLATENCY and SWITCHLATENCY should be provided in cycles.\n");
-        fprintf(stdout, "BANDWIDTH should be provided in Gbps\n");
+        fprintf(stdout, "CONFIGFILE gives the ports, MAC table, latencies and bandwidth.\n");
+        fprintf(stdout, "See switchconfig.h for the format.\n");
+        fprintf(stdout, "+threads=N splits the ports across N worker threads (default: one per cpu)\n");
+        fprintf(stdout, "+cpus=LIST pins worker thread i to the i-th cpu of LIST, e.g. 0-7,16-23\n");
+        fprintf(stdout, "+rounds=N stops after N rounds and reports the switching rate and where\n");
+        fprintf(stdout, "  the time went. with synthetic ports, exits 1 if their sink checks failed\n");
         exit(1);
     }
 
-    LINKLATENCY = atoi(argv[1]);
-    switchlat = atoi(argv[2]);
-    bandwidth = atoi(argv[3]);
-
-    simplify_frac(bandwidth, 200, &throttle_numer, &throttle_denom);
+    switchconfig config;
+    load_switch_config(argv[1], config);
 
-    fprintf(stdout, "Using link latency: %d\n", LINKLATENCY);
+    fprintf(stdout, "Using link latency: %d (time step %d)\n", LINKLATENCY, step_cycles);
     fprintf(stdout, "Using switching latency: %d\n", SWITCHLATENCY);
     fprintf(stdout, "BW throttle set to %d/%d\n", throttle_numer, throttle_denom);
+    fprintf(stdout, "Ports: %d downlinks, %d uplinks, %lu MAC table entries\n",
+            NUMDOWNLINKS, NUMUPLINKS, config.macs.size());
+
+    const char * cpulist = NULL;
+    int nthreads = 0;
+    for (int i = 2; i < argc; i++) {
+        if (strncmp(argv[i], "+cpus=", 6) == 0) {
+            cpulist = argv[i] + 6;
+        } else if (strncmp(argv[i], "+threads=", 9) == 0) {
+            nthreads = atoi(argv[i] + 9);
+        } else if (strncmp(argv[i], "+rounds=", 8) == 0) {
+            max_rounds = strtoull(argv[i] + 8, NULL, 10);
+        }
+    }
 
-    if ((LINKLATENCY % 7) != 0) {
-        // if invalid link latency, error out.
-        fprintf(stdout, "INVALID LINKLATENCY. Currently must be multiple of 7 cycles.\n");
+    // split the ports into shards, one pinned thread each. do this before
+    // building the ports so their buffers can be placed on the right node
+    assign_shards(cpulist, nthreads);
+    void * mem;
+    if (posix_memalign(&mem, 64, nshards * sizeof(phasetimes))) {
+        perror("allocating phase times");
         exit(1);
     }
+    shard_phases = (phasetimes*)mem;
+    for (int shard = 0; shard < nshards; shard++)
+        new (&shard_phases[shard]) phasetimes();
+
+    stats_init();
+    if (!config.stats_path.empty())
+        stats_open(config.stats_path.c_str(), config.stats_format, config.stats_interval);
+    setup_ports(config);
+    if (!config.capture_path.empty()) {
+        std::vector<bool> captured(NUMPORTS);
+        for (int i = 0; i < NUMPORTS; i++)
+            captured[i] = config.ports[i].capture;
+        capture_start(config.capture_path.c_str(), config.snaplen, config.capture_filter, captured);
+    }
 
-    omp_set_num_threads(NUMPORTS); // we parallelize over ports, so max threads = # ports
-
-#define PORTSETUPCONFIG
-#include "switchconfig.h"
-#undef PORTSETUPCONFIG
-
-    while (true) {
-
-        // handle sends
-#pragma omp parallel for
-        for (int port = 0; port < NUMPORTS; port++) {
-            ports[port]->send();
-        }
+    for (int port = 0; port < NUMPORTS; port++) {
+        int steps = ports[port]->steps_per_round();
+        if (std::find(round_lengths.begin(), round_lengths.end(), steps) == round_lengths.end())
+            round_lengths.push_back(steps);
+    }
 
-        // handle receives. these are blocking per port
-#pragma omp parallel for
-        for (int port = 0; port < NUMPORTS; port++) {
-            ports[port]->recv();
-        }
- 
-#pragma omp parallel for
-        for (int port = 0; port < NUMPORTS; port++) {
-            ports[port]->tick_pre();
+    // plain new doesn't honour alignas(64) before C++17
+    for (int parity = 0; parity < 2; parity++) {
+        if (posix_memalign(&mem, 64, nshards * nshards * sizeof(shard_inbox))) {
+            perror("allocating shard inboxes");
+            exit(1);
         }
+        inboxes[parity] = (shard_inbox*)mem;
+        for (int i = 0; i < nshards * nshards; i++)
+            new (&inboxes[parity][i]) shard_inbox();
+    }
+    if (posix_memalign(&mem, 64, sizeof(RoundBarrier))) {
+        perror("allocating round barrier");
+        exit(1);
+    }
+    round_barrier = new (mem) RoundBarrier(nshards);
 
-        do_fast_switching();
-
-        this_iter_cycles_start += LINKLATENCY; // keep track of time
+    double start = now_seconds();
 
-        // some ports need to handle extra stuff after each iteration
-        // e.g. shmem ports swapping shared buffers
-#pragma omp parallel for
-        for (int port = 0; port < NUMPORTS; port++) {
-            ports[port]->tick();
+    pthread_t * threads = new pthread_t[nshards];
+    for (int shard = 1; shard < nshards; shard++) {
+        if (pthread_create(&threads[shard], NULL, shard_worker, (void*)(intptr_t)shard)) {
+            perror("pthread_create");
+            exit(1);
         }
+    }
+    shard_worker((void*)(intptr_t)0);
 
+    // only reached on bounded runs
+    for (int shard = 1; shard < nshards; shard++) {
+        pthread_join(threads[shard], NULL);
     }
+    double elapsed = now_seconds() - start;
+    capture_stop();
+    stats_close(max_rounds * LINKLATENCY);
+
+    fprintf(stdout, "ran %lu rounds in %.3f s: %.1f rounds/s, %.3f Mcycles/s with %d threads\n",
+            max_rounds, elapsed, max_rounds / elapsed,
+            max_rounds * LINKLATENCY / elapsed / 1e6, nshards);
+    uint64_t failed = report_synthetic_ports(ports, NUMPORTS, elapsed);
+    report_queues();
+    report_phases(elapsed);
+    return failed ? 1 : 0;
 }
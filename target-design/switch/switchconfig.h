@@ -0,0 +1,385 @@
+/* Runtime switch configuration.
+ *
+ * One binary serves every switch in a topology; what differs between them
+ * is read at startup from a config file (emitted by the manager, see
+ * deploy/runtools/switch_model_config.py). The file is one directive per
+ * line, whitespace separated, with # comments:
+ *
+ *   linklatency CYCLES         link latency, a multiple of 7
+ *   switchlatency CYCLES       min port-to-port latency
+ *   bandwidth GBPS             output bandwidth of downlinks, out of 200
+ *   downlinks N                ports [0, N) are downlinks
+ *   uplinks M                  ports [N, N+M) are uplinks
+ *   multipath ecmp|random      how traffic for the uplinks picks one
+ *   hashseed N                 ECMP hash salt, should differ per switch
+ *   cutthrough on|off          forward packets before their last flit is in
+ *   capture FILE               capture all ports to a pcapng file
+ *   snaplen BYTES              bytes of each frame to capture
+ *   filter EXPR                only capture frames matching EXPR, see capture.h
+ *   stats FILE                 dump port counters to FILE, see stats.h
+ *   statsformat json|csv       format of the stats dumps
+ *   statsinterval CYCLES       simulated cycles between stats dumps
+ *   port NO shmem NAME downlink|uplink
+ *   port NO socketserver HOSTPORT
+ *   port NO socketclient IP HOSTPORT
+ *   port NO ssh [TAPDEV [QUEUES]]  TAP to the host, default tap0 with one queue
+ *   port NO synthetic uniform|incast|permutation LOAD SIZES
+ *                              SIZES is N, N:N:... or imix, see syntheticport.h
+ *   mac XX:XX:XX:XX:XX:XX PORT
+ *
+ * Output queues (see queueparams in baseport.h) default to unbounded. These
+ * set the queue model for all ports:
+ *
+ *   buffer BYTES               output buffer size, tail drop when full
+ *   red MINBYTES MAXBYTES MAXP RED on the instantaneous queue depth
+ *   ecn on|off                 mark ECN-capable packets instead of RED drop
+ *   pfc XOFFBYTES QUANTA       send PFC pauses above XOFFBYTES per priority
+ *   sched fifo|sp|drr          output scheduler across traffic classes
+ *   drr BYTES[:BYTES...]       DRR quantum, one for all classes or one each
+ *
+ * A port line may end with latency=CYCLES and/or bandwidth=GBPS to give
+ * that port its own link latency (a multiple of 7) and output bandwidth.
+ * A port with its own bandwidth is throttled even if it is an uplink. The
+ * switch steps time in the GCD of all the link latencies, so latencies that
+ * share a large common factor run faster. It may also override the queue
+ * model with buffer=BYTES, red=MIN:MAX:MAXP, ecn=on|off, pfc=XOFF:QUANTA, sched=..., drr=....
+ * With capture=off a port is left out of the capture.
+ *
+ * Every port must be given. MACs not in the table go to the uplinks, or are
+ * dropped on a switch with no uplinks. */
+
+#define CONFIG_LINE_BYTES 1024
+
+struct portconfig {
+    std::vector<std::string> args; // type, then its args
+    int latency = 0; // 0: use the switch-wide one
+    int bandwidth = 0;
+    // queue options (key, value) that override the switch-wide ones
+    std::vector<std::pair<std::string, std::string> > queueopts;
+    bool capture = true;
+};
+
+struct switchconfig {
+    queueparams queue;
+    std::vector<portconfig> ports;
+    std::vector<std::pair<uint64_t, uint16_t> > macs;
+    std::string capture_path; // empty: no capture
+    uint32_t snaplen = CAPTURE_MAX_BYTES;
+    std::vector<capturefilterterm> capture_filter;
+    std::string stats_path; // empty: no dumps
+    int stats_format = STATS_JSON;
+    uint64_t stats_interval = 10000000;
+};
+
+static int gcd(int a, int b) {
+    while (b > 0) {
+        int t = b;
+        b = a % b;
+        a = t;
+    }
+    return a;
+}
+
+static void simplify_frac(int n, int d, int *nn, int *dd)
+{
+    int a = gcd(n, d);
+    *nn = n / a;
+    *dd = d / a;
+}
+
+static void config_error(const char * path, int lineno, const char * msg) {
+    fprintf(stdout, "%s:%d: %s\n", path, lineno, msg);
+    exit(1);
+}
+
+/* set one queue model option. values with several fields are separated
+ * by colons. returns false if the value doesn't parse. */
+static bool set_queue_option(queueparams &queue, const std::string &key, const std::string &value) {
+    unsigned long a, b;
+    double p;
+    if (key == "buffer") {
+        return sscanf(value.c_str(), "%lu", &queue.limit_bytes) == 1;
+    } else if (key == "red") {
+        if (sscanf(value.c_str(), "%lu:%lu:%lf", &a, &b, &p) != 3 || a >= b || p < 0.0 || p > 1.0)
+            return false;
+        queue.red_min = a;
+        queue.red_max = b;
+        queue.red_maxp = p;
+        return true;
+    } else if (key == "ecn") {
+        if (value != "on" && value != "off")
+            return false;
+        queue.ecn = value == "on";
+        return true;
+    } else if (key == "pfc") {
+        if (sscanf(value.c_str(), "%lu:%lu", &a, &b) != 2 || b == 0 || b > 0xffff)
+            return false;
+        queue.pfc_xoff = a;
+        queue.pfc_quanta = b;
+        return true;
+    } else if (key == "sched") {
+        if (value == "fifo")
+            queue.sched = QSCHED_FIFO;
+        else if (value == "sp")
+            queue.sched = QSCHED_SP;
+        else if (value == "drr")
+            queue.sched = QSCHED_DRR;
+        else
+            return false;
+        return true;
+    } else if (key == "drr") {
+        uint32_t quanta[NUM_PRIORITIES];
+        int n = 0;
+        const char * str = value.c_str();
+        while (n < NUM_PRIORITIES) {
+            char * end;
+            long q = strtol(str, &end, 10);
+            if (end == str || q <= 0)
+                return false;
+            quanta[n++] = q;
+            if (*end == '\0')
+                break;
+            if (*end != ':')
+                return false;
+            str = end + 1;
+        }
+        if (n != 1 && n != NUM_PRIORITIES)
+            return false;
+        for (int i = 0; i < NUM_PRIORITIES; i++)
+            queue.drr_quantum[i] = quanta[n == 1 ? 0 : i];
+        return true;
+    }
+    return false;
+}
+
+static bool is_queue_option(const std::string &key) {
+    return key == "buffer" || key == "red" || key == "ecn" || key == "pfc" ||
+        key == "sched" || key == "drr";
+}
+
+/* read the config file, set the global switch parameters, and build the
+ * MAC table. ports are only built later, by setup_ports, since the workers
+ * need to know the port count first. */
+void load_switch_config(const char * path, switchconfig &config) {
+    FILE * f = fopen(path, "r");
+    if (!f) {
+        perror("opening switch config");
+        exit(1);
+    }
+
+    char line[CONFIG_LINE_BYTES];
+    int lineno = 0;
+    int bandwidth = 200;
+    while (fgets(line, sizeof(line), f)) {
+        lineno++;
+        char * comment = strchr(line, '#');
+        if (comment)
+            *comment = '\0';
+
+        std::vector<std::string> tok;
+        for (char * t = strtok(line, " \t\r\n"); t; t = strtok(NULL, " \t\r\n"))
+            tok.push_back(t);
+        if (tok.empty())
+            continue;
+
+        const std::string &key = tok[0];
+        if (key == "port") {
+            if (tok.size() < 3)
+                config_error(path, lineno, "port needs a number and a type");
+            int portno = atoi(tok[1].c_str());
+            if (portno < 0 || portno >= NUMDOWNLINKS + NUMUPLINKS)
+                config_error(path, lineno, "port number out of range (give downlinks/uplinks first)");
+            config.ports.resize(NUMDOWNLINKS + NUMUPLINKS);
+            portconfig &port = config.ports[portno];
+            port.args.clear();
+            for (size_t i = 2; i < tok.size(); i++) {
+                if (tok[i].compare(0, 8, "latency=") == 0) {
+                    port.latency = atoi(tok[i].c_str() + 8);
+                } else if (tok[i].compare(0, 10, "bandwidth=") == 0) {
+                    port.bandwidth = atoi(tok[i].c_str() + 10);
+                    if (port.bandwidth <= 0)
+                        config_error(path, lineno, "bandwidth must be positive");
+                } else if (tok[i] == "capture=on" || tok[i] == "capture=off") {
+                    port.capture = tok[i] == "capture=on";
+                } else if (tok[i].find('=') != std::string::npos &&
+                        is_queue_option(tok[i].substr(0, tok[i].find('=')))) {
+                    size_t eq = tok[i].find('=');
+                    port.queueopts.push_back(std::make_pair(tok[i].substr(0, eq), tok[i].substr(eq + 1)));
+                } else {
+                    port.args.push_back(tok[i]);
+                }
+            }
+            if (port.args.empty())
+                config_error(path, lineno, "port needs a type");
+        } else if (key == "mac") {
+            uint64_t mac;
+            if (tok.size() != 3 || !parse_mac(tok[1].c_str(), &mac))
+                config_error(path, lineno, "expected mac XX:XX:XX:XX:XX:XX PORT");
+            config.macs.push_back(std::make_pair(mac, (uint16_t)atoi(tok[2].c_str())));
+        } else if (key == "filter") {
+            std::vector<std::string> words(tok.begin() + 1, tok.end());
+            config.capture_filter.clear();
+            if (!parse_capture_filter(words, config.capture_filter))
+                config_error(path, lineno, "bad capture filter");
+        } else if (is_queue_option(key)) {
+            // fields become one colon separated value, like on port lines
+            std::string value = tok.size() > 1 ? tok[1] : "";
+            for (size_t i = 2; i < tok.size(); i++)
+                value += ":" + tok[i];
+            if (!set_queue_option(config.queue, key, value))
+                config_error(path, lineno, "bad queue option");
+        } else if (tok.size() != 2) {
+            config_error(path, lineno, "expected a key and one value");
+        } else if (key == "linklatency") {
+            LINKLATENCY = atoi(tok[1].c_str());
+        } else if (key == "switchlatency") {
+            switchlat = atoi(tok[1].c_str());
+        } else if (key == "bandwidth") {
+            bandwidth = atoi(tok[1].c_str());
+        } else if (key == "downlinks") {
+            NUMDOWNLINKS = atoi(tok[1].c_str());
+        } else if (key == "uplinks") {
+            NUMUPLINKS = atoi(tok[1].c_str());
+        } else if (key == "multipath") {
+            if (tok[1] == "ecmp")
+                multipath = MULTIPATH_ECMP;
+            else if (tok[1] == "random")
+                multipath = MULTIPATH_RANDOM;
+            else
+                config_error(path, lineno, "expected multipath ecmp|random");
+        } else if (key == "cutthrough") {
+            if (tok[1] != "on" && tok[1] != "off")
+                config_error(path, lineno, "expected cutthrough on|off");
+            cut_through = tok[1] == "on";
+        } else if (key == "hashseed") {
+            hash_seed = strtoull(tok[1].c_str(), NULL, 0);
+        } else if (key == "stats") {
+            config.stats_path = tok[1];
+        } else if (key == "statsformat") {
+            if (tok[1] == "json")
+                config.stats_format = STATS_JSON;
+            else if (tok[1] == "csv")
+                config.stats_format = STATS_CSV;
+            else
+                config_error(path, lineno, "expected statsformat json|csv");
+        } else if (key == "statsinterval") {
+            config.stats_interval = strtoull(tok[1].c_str(), NULL, 0);
+            if (config.stats_interval == 0)
+                config_error(path, lineno, "statsinterval must be positive");
+        } else if (key == "capture") {
+            config.capture_path = tok[1];
+        } else if (key == "snaplen") {
+            config.snaplen = atoi(tok[1].c_str());
+            if (config.snaplen == 0)
+                config_error(path, lineno, "snaplen must be positive");
+        } else {
+            config_error(path, lineno, "unknown directive");
+        }
+    }
+    fclose(f);
+
+    NUMPORTS = NUMDOWNLINKS + NUMUPLINKS;
+    if (NUMPORTS <= 0) {
+        fprintf(stdout, "%s: switch has no ports\n", path);
+        exit(1);
+    }
+    config.ports.resize(NUMPORTS);
+    for (int i = 0; i < NUMPORTS; i++) {
+        if (config.ports[i].args.empty()) {
+            fprintf(stdout, "%s: no setup given for port %d\n", path, i);
+            exit(1);
+        }
+    }
+
+    if ((LINKLATENCY <= 0) || ((LINKLATENCY % 7) != 0)) {
+        // if invalid link latency, error out.
+        fprintf(stdout, "INVALID LINKLATENCY. Currently must be multiple of 7 cycles.\n");
+        exit(1);
+    }
+
+    simplify_frac(bandwidth, 200, &throttle_numer, &throttle_denom);
+
+    port_links = new linkparams[NUMPORTS];
+    step_cycles = LINKLATENCY;
+    for (int i = 0; i < NUMPORTS; i++) {
+        portconfig &port = config.ports[i];
+        linkparams &link = port_links[i];
+        link.latency = port.latency ? port.latency : LINKLATENCY;
+        if ((link.latency <= 0) || ((link.latency % 7) != 0)) {
+            fprintf(stdout, "INVALID latency for port %d. Currently must be multiple of 7 cycles.\n", i);
+            exit(1);
+        }
+        link.throttle = port.bandwidth > 0;
+        link.throttle_numer = link.throttle_denom = 1;
+        if (link.throttle) {
+            simplify_frac(port.bandwidth, 200, &link.throttle_numer, &link.throttle_denom);
+        }
+        step_cycles = gcd(step_cycles, link.latency);
+
+        link.queue = config.queue;
+        for (size_t j = 0; j < port.queueopts.size(); j++) {
+            if (!set_queue_option(link.queue, port.queueopts[j].first, port.queueopts[j].second)) {
+                fprintf(stdout, "%s: bad %s option for port %d\n", path,
+                        port.queueopts[j].first.c_str(), i);
+                exit(1);
+            }
+        }
+    }
+
+    // unknown MACs map to "any uplink"
+    mac_table.init(config.macs.size(), NUMDOWNLINKS);
+    for (size_t i = 0; i < config.macs.size(); i++) {
+        if (config.macs[i].second >= NUMPORTS) {
+            fprintf(stdout, "%s: MAC %012lx mapped to nonexistent port %d\n", path,
+                    config.macs[i].first, config.macs[i].second);
+            exit(1);
+        }
+        mac_table.insert(config.macs[i].first, config.macs[i].second);
+    }
+}
+
+static void port_args_error(int portno, const char * usage) {
+    fprintf(stdout, "bad setup for port %d, expected: port %d %s\n", portno, portno, usage);
+    exit(1);
+}
+
+void setup_ports(switchconfig &config) {
+    ports = new BasePort*[NUMPORTS];
+    for (int i = 0; i < NUMPORTS; i++) {
+        std::vector<std::string> &args = config.ports[i].args;
+        const std::string &type = args[0];
+        if (type == "shmem") {
+            if (args.size() != 3 || (args[2] != "downlink" && args[2] != "uplink"))
+                port_args_error(i, "shmem NAME downlink|uplink");
+            ports[i] = new ShmemPort(i, (char*)args[1].c_str(), args[2] == "uplink");
+        } else if (type == "socketserver") {
+            if (args.size() != 2)
+                port_args_error(i, "socketserver HOSTPORT");
+            ports[i] = new SocketServerPort(i, atoi(args[1].c_str()));
+        } else if (type == "socketclient") {
+            if (args.size() != 3)
+                port_args_error(i, "socketclient IP HOSTPORT");
+            ports[i] = new SocketClientPort(i, (char*)args[1].c_str(), atoi(args[2].c_str()));
+        } else if (type == "ssh") {
+            if (args.size() > 3)
+                port_args_error(i, "ssh [TAPDEV [QUEUES]]");
+            ports[i] = new SSHPort(i, args.size() > 1 ? args[1].c_str() : "tap0",
+                    args.size() > 2 ? atoi(args[2].c_str()) : 1);
+        } else if (type == "synthetic") {
+            std::vector<int> sizes;
+            int pattern = SYNTH_UNIFORM;
+            if (args.size() == 4 && args[1] == "incast")
+                pattern = SYNTH_INCAST;
+            else if (args.size() == 4 && args[1] == "permutation")
+                pattern = SYNTH_PERMUTATION;
+            else if (args.size() != 4 || args[1] != "uniform")
+                pattern = -1;
+            if (pattern < 0 || !parse_synthetic_sizes(args[3], sizes))
+                port_args_error(i, "synthetic uniform|incast|permutation LOAD N|N:N:...|imix");
+            ports[i] = new SyntheticPort(i, pattern, atof(args[2].c_str()), sizes);
+        } else {
+            fprintf(stdout, "unknown type %s for port %d\n", type.c_str(), i);
+            exit(1);
+        }
+    }
+}
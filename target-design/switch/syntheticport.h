@@ -0,0 +1,267 @@
+/* A port with no peer, for benchmarking the switch on its own.
+ *
+ * The generator side fills the port's input buffer every round with
+ * frames to other ports, at a given fraction of line rate. The sink side
+ * consumes whatever the switch wrote to the output buffer, counts it and
+ * checks it. Destinations are picked by the traffic pattern:
+ *   SYNTH_UNIFORM:     uniformly at random among the other ports
+ *   SYNTH_INCAST:      every port sends to port 0, which sends nothing. load
+ *                      is the total offered to port 0, split across the
+ *                      senders, so its output queue stays bounded
+ *   SYNTH_PERMUTATION: port i always sends to port (i + NUMPORTS/2) %
+ *                      NUMPORTS, so no two senders share an output
+ * Frame sizes, in flits, are given as N, as N:N:... to pick each of the
+ * sizes listed with equal odds (repeat one to weight it), or as imix (7:4:1
+ * of 8, 72 and 190 flits, roughly 64, 576 and 1518 byte frames). Frames are
+ * at least SYNTH_MIN_FLITS long, so they all carry a sequence number.
+ *
+ * Port i sends to MAC SYNTH_MAC_BASE + i, so the switch config should map
+ * those MACs to port i. Frames are ECN-capable IPv4/UDP, in traffic class
+ * (DSCP >> 3) i % NUM_PRIORITIES, from 10.0.x.y (x.y = i) to the
+ * destination port's address, with a per-sender sequence number in the
+ * first payload flit. The sink counts how many arrive marked CE, and
+ * flags frames that reach the wrong port, whose length disagrees with
+ * their IPv4 header, or that arrive out of order or twice from a sender.
+ * Drops are not errors, the queues may be bounded. */
+
+#define SYNTH_UNIFORM 0
+#define SYNTH_INCAST 1
+#define SYNTH_PERMUTATION 2
+
+// ethernet, IPv4 and UDP headers, then the sequence number
+#define SYNTH_MIN_FLITS 6
+#define SYNTH_SEQ_FLIT 5
+
+#define SYNTH_ETHTYPE_IPV4 0x0800
+#define SYNTH_MAC_BASE 0x00126d000000UL
+
+class SyntheticPort : public BasePort {
+    public:
+        SyntheticPort(int portNo, int pattern, double load, const std::vector<int> &sizes);
+        void tick();
+        void tick_pre();
+        void send();
+        void recv();
+
+        uint64_t tx_packets = 0;
+        uint64_t tx_flits = 0;
+        uint64_t rx_packets = 0;
+        uint64_t rx_flits = 0;
+        uint64_t rx_ce = 0;
+        // sink check failures
+        uint64_t rx_misrouted = 0;
+        uint64_t rx_bad_length = 0;
+        uint64_t rx_out_of_order = 0;
+    private:
+        int pick_dest();
+        void check_frame();
+        int _pattern;
+        double _load;
+        std::vector<int> _sizes;
+        unsigned int _seed;
+
+        // generator state, carried across rounds for frames that straddle one
+        uint64_t next_start = 0; // cycle the next frame starts at
+        int flits_left = 0;
+        int cur_flits = 0;
+        int cur_dest = 0;
+
+        // sink state: the head of the frame coming in, and the last
+        // sequence number seen from each sender
+        uint64_t rx_head[SYNTH_MIN_FLITS];
+        int rx_flitno = 0;
+        std::vector<uint64_t> rx_next_seq;
+};
+
+/* parse a size spec (N, N:N:..., or imix) into a list of frame sizes in
+ * flits to pick from. returns false on anything else */
+static bool parse_synthetic_sizes(const std::string &spec, std::vector<int> &sizes) {
+    sizes.clear();
+    if (spec == "imix") {
+        sizes.insert(sizes.end(), 7, 8);
+        sizes.insert(sizes.end(), 4, 72);
+        sizes.push_back(190);
+        return true;
+    }
+    size_t start = 0;
+    while (start <= spec.size()) {
+        size_t end = spec.find(':', start);
+        if (end == std::string::npos)
+            end = spec.size();
+        char * stop;
+        std::string word = spec.substr(start, end - start);
+        long flits = strtol(word.c_str(), &stop, 10);
+        if (word.empty() || *stop || flits < 1 || flits > MAX_PACKET_FLITS)
+            return false;
+        sizes.push_back(std::max((int)flits, SYNTH_MIN_FLITS));
+        start = end + 1;
+    }
+    return true;
+}
+
+SyntheticPort::SyntheticPort(int portNo, int pattern, double load, const std::vector<int> &sizes)
+    : BasePort(portNo, true), _pattern(pattern), _load(load), _sizes(sizes),
+      _seed(portNo + 1), rx_next_seq(NUMPORTS, 0)
+{
+    static const char * names[] = { "uniform", "incast", "permutation" };
+    double mean_flits = 0;
+    for (size_t i = 0; i < sizes.size(); i++)
+        mean_flits += sizes[i];
+    mean_flits /= sizes.size();
+    fprintf(stdout, "Synthetic Port %d: %s, load %.2f, %.1f flits/packet\n", portNo,
+            names[pattern], load, mean_flits);
+    current_input_buf = (uint8_t*)calloc(bufsize_bytes(), 1);
+    current_output_buf = (uint8_t*)calloc(bufsize_bytes(), 1);
+    if (pattern == SYNTH_INCAST)
+        _load = load / (NUMPORTS - 1);
+    // spread out the first frames so ports don't all start in lockstep
+    next_start = rand_r(&_seed) % (_linklatency + 1);
+}
+
+int SyntheticPort::pick_dest() {
+    if (_pattern == SYNTH_INCAST)
+        return 0;
+    if (_pattern == SYNTH_PERMUTATION)
+        return (_portNo + std::max(NUMPORTS / 2, 1)) % NUMPORTS;
+    int dest = rand_r(&_seed) % (NUMPORTS - 1);
+    return dest >= _portNo ? dest + 1 : dest;
+}
+
+/* a whole frame came in, rx_flitno flits of it. check what its header says
+ * against where and how it arrived */
+void SyntheticPort::check_frame() {
+    if (rx_flitno < SYNTH_MIN_FLITS || (rx_head[1] >> 48) != htons(SYNTH_ETHTYPE_IPV4)) {
+        // not one of ours: a PFC frame, or a runt
+        return;
+    }
+    uint16_t iplen = ntohs((rx_head[2] >> 16) & 0xffff);
+    if ((size_t)(iplen + ETH_HEADER_BYTES + NET_IP_ALIGN) != rx_flitno * sizeof(uint64_t))
+        rx_bad_length++;
+    if ((ntohl(rx_head[4] & 0xffffffff) & 0xffff) != (uint32_t)_portNo)
+        rx_misrouted++;
+
+    uint64_t sender = rx_head[SYNTH_SEQ_FLIT] >> 32;
+    uint64_t seq = rx_head[SYNTH_SEQ_FLIT] & 0xffffffff;
+    if (sender >= (uint64_t)NUMPORTS || seq < rx_next_seq[sender])
+        rx_out_of_order++;
+    else
+        rx_next_seq[sender] = seq + 1;
+}
+
+void SyntheticPort::send() {
+    // sink: count what the switch sent us this round
+    if (((uint64_t*)current_output_buf)[0] == 0xDEADBEEFDEADBEEFL) {
+        ((uint64_t*)current_output_buf)[0] = 0L;
+        return;
+    }
+    for (int tokenno = 0; tokenno < num_tokens(); tokenno++) {
+        if (is_valid_flit(current_output_buf, tokenno)) {
+            if (rx_flitno < SYNTH_MIN_FLITS)
+                rx_head[rx_flitno] = get_flit(current_output_buf, tokenno);
+            // IPv4 tos is byte 1 of the third flit
+            if (rx_flitno == 2)
+                rx_ce += ((rx_head[2] >> 8) & IP_ECN_MASK) == IP_ECN_CE;
+            rx_flits++;
+            rx_flitno++;
+            if (is_last_flit(current_output_buf, tokenno)) {
+                rx_packets++;
+                check_frame();
+                rx_flitno = 0;
+            }
+        }
+    }
+}
+
+void SyntheticPort::recv() {
+    for (int bigtokenno = 0; bigtokenno < num_bigtokens(); bigtokenno++) {
+        *((uint64_t*)(current_input_buf) + bigtokenno*8) = 0L;
+    }
+    if (_load <= 0.0 || (_pattern == SYNTH_INCAST && _portNo == 0))
+        return;
+
+    uint64_t round_end = round_start + _linklatency;
+    for (uint64_t t = std::max(round_start, next_start); t < round_end; t++) {
+        int tokenno = t - round_start;
+        if (flits_left == 0) {
+            if (t < next_start) {
+                t = next_start - 1;
+                continue;
+            }
+            cur_flits = _sizes.size() == 1 ? _sizes[0] : _sizes[rand_r(&_seed) % _sizes.size()];
+            flits_left = cur_flits;
+            cur_dest = pick_dest();
+            tx_packets++;
+        }
+
+        uint64_t flit;
+        int flitno = cur_flits - flits_left;
+        if (flitno == 0) {
+            // 2 bytes of NET_IP_ALIGN padding, then the destination MAC
+            flit = flit_from_mac(SYNTH_MAC_BASE + cur_dest);
+        } else if (flitno == 1) {
+            flit = (uint64_t)htons(SYNTH_ETHTYPE_IPV4) << 48;
+        } else if (flitno == 2) {
+            // IPv4 version/ihl, tos with ECT(0), total length
+            uint16_t iplen = cur_flits * sizeof(uint64_t) - NET_IP_ALIGN - ETH_HEADER_BYTES;
+            uint8_t tos = ((_portNo % NUM_PRIORITIES) << 5) | 0x02;
+            flit = 0x45 | (tos << 8) | ((uint64_t)htons(iplen) << 16);
+        } else if (flitno == 3) {
+            // ttl, UDP, no checksum, source address 10.0.x.y
+            flit = 64 | (17 << 8) | ((uint64_t)htonl(0x0a000000 | _portNo) << 32);
+        } else if (flitno == 4) {
+            // destination address, then UDP ports
+            flit = htonl(0x0a000000 | cur_dest) | ((uint64_t)htons(1024 + (tx_packets & 0xfff)) << 32)
+                | ((uint64_t)htons(5000) << 48);
+        } else {
+            // the sequence number, from 0
+            flit = ((uint64_t)_portNo << 32) | (tx_packets - 1);
+        }
+        write_valid_flit(current_input_buf, tokenno);
+        write_last_flit(current_input_buf, tokenno, flits_left == 1);
+        write_flit(current_input_buf, tokenno, flit);
+        tx_flits++;
+
+        if (--flits_left == 0) {
+            // idle gap so the long-run average is _load of line rate
+            double mean_gap = cur_flits * (1.0 - _load) / _load;
+            next_start = t + 1 + (uint64_t)(mean_gap * 2.0 * rand_r(&_seed) / RAND_MAX);
+        }
+    }
+}
+
+void SyntheticPort::tick_pre() {
+    // output buf is private, nothing to swap
+}
+
+void SyntheticPort::tick() {
+    // nothing to release
+}
+
+/* totals over all synthetic ports, for bounded benchmark runs. returns
+ * the number of frames that failed the sink checks */
+uint64_t report_synthetic_ports(BasePort ** ports, int nports, double elapsed) {
+    uint64_t tx_packets = 0, tx_flits = 0, rx_packets = 0, rx_flits = 0, rx_ce = 0;
+    uint64_t misrouted = 0, bad_length = 0, out_of_order = 0;
+    int nsynth = 0;
+    for (int i = 0; i < nports; i++) {
+        SyntheticPort * sp = dynamic_cast<SyntheticPort*>(ports[i]);
+        if (!sp)
+            continue;
+        nsynth++;
+        tx_packets += sp->tx_packets;
+        tx_flits += sp->tx_flits;
+        rx_packets += sp->rx_packets;
+        rx_flits += sp->rx_flits;
+        rx_ce += sp->rx_ce;
+        misrouted += sp->rx_misrouted;
+        bad_length += sp->rx_bad_length;
+        out_of_order += sp->rx_out_of_order;
+    }
+    if (!nsynth)
+        return 0;
+    fprintf(stdout, "synthetic ports: %d, tx %lu packets (%lu flits), rx %lu packets (%lu flits, %lu CE), %.3f Mpkts/s switched\n",
+            nsynth, tx_packets, tx_flits, rx_packets, rx_flits, rx_ce, rx_packets / elapsed / 1e6);
+    fprintf(stdout, "synthetic checks: %lu misrouted, %lu bad length, %lu out of order\n",
+            misrouted, bad_length, out_of_order);
+    return misrouted + bad_length + out_of_order;
+}
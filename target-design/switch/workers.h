@@ -0,0 +1,145 @@
+#include <pthread.h>
+#include <sched.h>
+
+/* Persistent worker threads for the switch.
+ *
+ * The ports are split into contiguous shards, one per worker thread, and
+ * each worker is pinned to its own core for the whole run. A shard does all
+ * the work for the ports it owns: send, recv, input preprocessing, routing
+ * of its inputs into the inboxes of the destination shards, and, after the
+ * one barrier per round, merging its inboxes into its ports' output queues
+ * and writing output. So the number of threads is independent of the
+ * number of ports. */
+
+#define MAX_CPUS 1024
+#define MAX_NUMA_NODES 64
+
+// all sized by assign_shards, once the port count is known
+int nshards;
+// first port of each shard; shard s owns [shard_first_port[s], shard_first_port[s+1])
+int * shard_first_port;
+// cpu each shard's thread is pinned to
+int * shard_cpu;
+int * port_shard;
+// NUMA node of the cpu that services each port
+int * port_node;
+
+class RoundBarrier {
+    public:
+        RoundBarrier(int nthreads) : _nthreads(nthreads) {}
+        // block until all threads have arrived. the last arrival runs
+        // completion (if any) before anyone is released.
+        void wait(void (*completion)());
+    private:
+        int _nthreads;
+        alignas(64) std::atomic<uint32_t> arrived{0};
+        alignas(64) std::atomic<uint32_t> generation{0};
+        std::atomic<uint32_t> waiters{0};
+};
+
+void RoundBarrier::wait(void (*completion)()) {
+    uint32_t gen = generation.load(std::memory_order_acquire);
+    if (arrived.fetch_add(1, std::memory_order_acq_rel) + 1 == (uint32_t)_nthreads) {
+        arrived.store(0, std::memory_order_relaxed);
+        if (completion)
+            completion();
+        generation.store(gen + 1, std::memory_order_release);
+        shmem_wake(&generation, &waiters);
+    } else {
+        shmem_wait_while_eq(&generation, gen, &waiters);
+    }
+}
+
+/* parse a cpu list like "0-3,8,10-11". returns # of cpus parsed. */
+static int parse_cpu_list(const char * str, int * cpus, int maxcpus) {
+    int ncpus = 0;
+    while (*str && ncpus < maxcpus) {
+        char * end;
+        long first = strtol(str, &end, 10);
+        long last = first;
+        if (end == str) {
+            fprintf(stdout, "INVALID CPU LIST: %s\n", str);
+            exit(1);
+        }
+        if (*end == '-') {
+            str = end + 1;
+            last = strtol(str, &end, 10);
+        }
+        for (long cpu = first; cpu <= last && ncpus < maxcpus; cpu++) {
+            cpus[ncpus++] = cpu;
+        }
+        str = (*end == ',') ? end + 1 : end;
+    }
+    return ncpus;
+}
+
+/* cpus this process may run on, in order */
+static int allowed_cpus(int * cpus, int maxcpus) {
+    cpu_set_t set;
+    int ncpus = 0;
+    if (sched_getaffinity(0, sizeof(set), &set) < 0) {
+        perror("sched_getaffinity");
+        return 0;
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE && ncpus < maxcpus; cpu++) {
+        if (CPU_ISSET(cpu, &set))
+            cpus[ncpus++] = cpu;
+    }
+    return ncpus;
+}
+
+static int cpu_to_node(int cpu) {
+    char path[128];
+    for (int node = 0; node < MAX_NUMA_NODES; node++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/node%d", cpu, node);
+        if (access(path, F_OK) == 0)
+            return node;
+    }
+    return -1;
+}
+
+/* split the ports into nthreads shards (0: as many as we have cpus for)
+ * and give each shard a cpu, from cpulist if given, otherwise round-robin
+ * over the cpus we are allowed to run on */
+void assign_shards(const char * cpulist, int nthreads) {
+    int cpus[MAX_CPUS];
+    int ncpus = cpulist ? parse_cpu_list(cpulist, cpus, MAX_CPUS)
+                        : allowed_cpus(cpus, MAX_CPUS);
+
+    nshards = nthreads > 0 ? nthreads : std::max(ncpus, 1);
+    nshards = std::min(nshards, NUMPORTS);
+
+    shard_first_port = new int[nshards + 1];
+    shard_cpu = new int[nshards];
+    port_shard = new int[NUMPORTS];
+    port_node = new int[NUMPORTS];
+
+    for (int shard = 0; shard <= nshards; shard++) {
+        shard_first_port[shard] = (shard * NUMPORTS) / nshards;
+    }
+
+    for (int shard = 0; shard < nshards; shard++) {
+        shard_cpu[shard] = ncpus ? cpus[shard % ncpus] : -1;
+        int node = ncpus ? cpu_to_node(shard_cpu[shard]) : -1;
+        for (int port = shard_first_port[shard]; port < shard_first_port[shard+1]; port++) {
+            port_shard[port] = shard;
+            port_node[port] = node;
+        }
+        fprintf(stdout, "shard %d: ports %d-%d, cpu %d, node %d\n", shard,
+                shard_first_port[shard], shard_first_port[shard+1] - 1,
+                shard_cpu[shard], node);
+    }
+}
+
+void pin_to_cpu(int cpu) {
+    if (cpu < 0)
+        return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err) {
+        fprintf(stderr, "pthread_setaffinity_np to cpu %d failed: %s\n", cpu, strerror(err));
+    }
+}
+